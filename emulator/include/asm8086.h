@@ -0,0 +1,42 @@
+#ifndef ASM8086_H
+#define ASM8086_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-process assembler for the NASM subset the course programs use, so
+// source can be run without a nasm binary. It produces the same flat binary
+// as `nasm -f bin`: .text at the org address, then .data aligned to 4, with
+// .bss taking no space in the file.
+//
+// Supported: org, bits 16, cpu, section/segment .text/.data/.bss, labels
+// (with and without a colon, .local ones), equ, times, db/dw/dd,
+// resb/resw/resd, align/alignb, $ and $$, NASM expressions and number
+// syntax, the 8086 instruction set plus the 186 forms the CPU implements
+// (push imm, pusha/popa, shifts by an immediate, enter/leave, ins/outs).
+// Conditional jumps are short only, as on a real 8086.
+
+// Bump whenever the same source can assemble to different bytes; cached
+// assembly and run results are keyed on it
+#define ASM_VERSION 2
+
+typedef struct {
+    uint8_t *code;       // the binary (malloc'd), NULL on failure
+    size_t size;
+    int error_line;      // line of the first error, 0 if none
+    char *errors;        // "line N: message\n" per error (malloc'd), NULL if none
+    size_t errors_len;
+} AsmResult;
+
+// Assemble len bytes of source. Returns 1 with res->code set, or 0 with the
+// errors in res (on allocation failure both code and errors may be NULL).
+int asm_assemble(const char *src, size_t len, AsmResult *res);
+void asm_result_free(AsmResult *res);
+
+// Canonical form of the source for cache keys: comments, the blanks around
+// each line and trailing empty lines removed, line numbers kept. Sources with
+// the same canonical form assemble to the same result. out needs room for len
+// bytes; returns the length of the canonical form.
+size_t asm_normalize(const char *src, size_t len, char *out);
+
+#endif
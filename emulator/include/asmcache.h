@@ -0,0 +1,35 @@
+#ifndef ASMCACHE_H
+#define ASMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/asm8086.h"
+#include "../include/lru.h"
+
+// Assembly results keyed by the canonical form of the source (asm_normalize)
+// and ASM_VERSION, so a resubmitted program skips the assembler even if only
+// its comments or indentation changed. Entries are kept in an LRU in memory
+// and, given a directory, also one file per source there, which outlives the
+// process: the directory is loaded when the cache is created and new
+// entries are written to it by a background thread. Sources that fail to
+// assemble are cached as well.
+// Not thread-safe: one thread owns a cache.
+typedef struct AsmCache AsmCache;
+
+typedef struct {
+    LruStats mem;
+    uint64_t disk_loaded, disk_writes; // entries read at creation, files written
+} AsmCacheStats;
+
+// max_bytes bounds the memory part; dir may be NULL. Reads the whole
+// directory before returning. NULL on allocation failure.
+AsmCache *asm_cache_new(size_t max_bytes, const char *dir);
+// Waits for the queued writes
+void asm_cache_free(AsmCache *c);
+
+// asm_assemble through the cache, with the same results
+int asm_cache_assemble(AsmCache *c, const char *src, size_t len, AsmResult *res);
+
+void asm_cache_stats(const AsmCache *c, AsmCacheStats *out);
+
+#endif
@@ -7,26 +7,84 @@
 #define FLAG_PF 0x0004
 
 #include<stdint.h>
+#include<stddef.h>
 #include "../include/cpu.h"
 #include "../include/memory.h"
+#include "../include/input.h"
+#include "../include/ports.h"
+#include "../include/dosfs.h"
+#include "../include/video.h"
 
+// Program output of one machine (DOS console, teletype, debug port). Kept
+// NUL-terminated. Without a sink, output beyond EMU_OUTPUT_SIZE - 1 bytes is
+// dropped; with one, a full buffer is handed to it and emptied, and
+// emu_output_flush() hands over whatever is buffered.
+#define EMU_OUTPUT_SIZE 65536
+
+// Bump whenever a change can alter what a program does or prints; cached
+// results are keyed on it
+#define EMU_CORE_VERSION 1
+typedef void (*EmuOutputSink)(void *ctx, const char *data, size_t len);
+
+typedef struct EmuOutput {
+    char data[EMU_OUTPUT_SIZE];
+    size_t pos;
+    EmuOutputSink sink;
+    void *sink_ctx;
+} EmuOutput;
+
+void emu_output_reset(EmuOutput *out);
+void emu_putchar(EmuOutput *out, char c);
+void emu_puts(EmuOutput *out, const char *s);
+void emu_write(EmuOutput *out, const char *data, size_t len);
+void emu_output_flush(EmuOutput *out);
+// Pass NULL to go back to plain buffering
+void emu_set_output_sink(EmuOutput *out, EmuOutputSink sink, void *ctx);
+
+// Why cpu_step() returned 0
+enum {
+    CPU_RUNNING = 0,
+    CPU_STOP_EXIT,       // INT 21h AH=00h/4Ch
+    CPU_STOP_HALT,       // HLT
+    CPU_STOP_DIVIDE,     // DIV/IDIV by zero
+    CPU_STOP_BAD_OPCODE, // unknown or unsupported instruction
+};
+
+// All emulator state lives here (and in Memory8086), so any number of
+// machines can run side by side on different threads.
 typedef struct {
     uint16_t ax, bx, cx, dx;
     uint16_t si, di, bp, sp;
     uint16_t ip;
     uint16_t flags;
     uint16_t cs, ds, es, ss;
+
+    // Scripted keyboard input for INT 21h/16h reads (NULL = none, reads see EOF)
+    EmuInput *input;
+    // I/O port devices for IN/OUT/INS/OUTS (NULL = every port unmapped)
+    PortBus *ports;
+    // Files behind the INT 21h handle functions (NULL = only handles 0-4)
+    DosFs *dos;
+    // Text screen behind INT 10h (NULL = teletype output only)
+    VideoState *video;
+
+    // Prefix state carried from a prefix byte to the instruction it modifies
+    int rep_prefix;       // 0 none, 1 REP/REPE, 2 REPNE
+    int segment_override;
+    uint16_t override_value;
+    int traced_start;     // start-of-program debug trace already logged
+    int stop_reason;      // CPU_STOP_* once cpu_step() has returned 0
+    uint8_t exit_code;    // CPU_STOP_EXIT: AL of INT 21h AH=4Ch, 0 for AH=00h
+    uint8_t bad_opcode;   // CPU_STOP_BAD_OPCODE: the opcode byte
+
+    EmuOutput out;
 } CPU8086;
 
 void cpu_init(CPU8086 *cpu);
 
 int cpu_step(CPU8086 *cpu, Memory8086 *mem);
-
-// Output buffer exported for external frontends
-extern char emu_output[];
-extern size_t emu_out_pos;
-void emu_putchar(char c);
-void emu_puts(const char *s);
-void emu_output_flush(void);
+// Execute up to max_steps instructions and return how many completed. The
+// machine has stopped if cpu->stop_reason is no longer CPU_RUNNING.
+uint64_t cpu_run(CPU8086 *cpu, Memory8086 *mem, uint64_t max_steps);
 
 #endif
\ No newline at end of file
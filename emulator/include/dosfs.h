@@ -0,0 +1,72 @@
+#ifndef DOSFS_H
+#define DOSFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Virtual DOS file system behind the INT 21h handle functions. Files live in
+// memory: either sent along with the job (dosfs_add_file) or pulled in from a
+// sandboxed host directory the first time they are opened. Reads and writes
+// copy straight between these buffers and guest memory. Files that came from
+// (or were created under) the host directory are written back when closed.
+//
+// Handles 0-4 are the standard DOS devices and are handled by the CPU core
+// (stdin = scripted input, stdout/stderr = emulator output); dosfs hands out
+// handles from DOSFS_FIRST_HANDLE upwards.
+
+#define DOSFS_MAX_HANDLES 20
+#define DOSFS_FIRST_HANDLE 5
+#define DOSFS_NAME_MAX 80
+#define DOSFS_MAX_FILE_SIZE (16u << 20)
+
+// DOS error codes returned in AX with CF set
+#define DOSERR_INVALID_FUNCTION 1
+#define DOSERR_FILE_NOT_FOUND 2
+#define DOSERR_PATH_NOT_FOUND 3
+#define DOSERR_TOO_MANY_FILES 4
+#define DOSERR_ACCESS_DENIED 5
+#define DOSERR_INVALID_HANDLE 6
+#define DOSERR_INSUFFICIENT_MEMORY 8
+#define DOSERR_INVALID_ACCESS 12
+
+typedef struct {
+    char name[DOSFS_NAME_MAX]; // normalized: upper case, '/' separators, no drive
+    uint8_t *data;
+    uint32_t len;
+    uint32_t cap;
+    int dirty; // written since it was loaded or last written back
+} DosFile;
+
+typedef struct {
+    DosFile *file; // NULL = free
+    uint32_t pos;
+    uint8_t mode; // 0 read, 1 write, 2 read/write
+} DosHandle;
+
+typedef struct {
+    char host_root[260]; // empty = no host directory
+    DosFile **files;
+    size_t nfiles;
+    size_t cap;
+    DosHandle handles[DOSFS_MAX_HANDLES];
+} DosFs;
+
+// host_root may be NULL for a purely in-memory file system
+void dosfs_init(DosFs *fs, const char *host_root);
+void dosfs_free(DosFs *fs);
+
+// Add (or replace) an in-memory file; returns 0 on a bad name or no memory
+int dosfs_add_file(DosFs *fs, const char *name, const void *data, size_t len);
+// Whether dosfs_add_file would accept the name
+int dosfs_valid_name(const char *name);
+
+// INT 21h backends. Each returns 0 on success or a DOSERR_* code.
+int dosfs_open(DosFs *fs, const char *path, uint8_t mode, uint16_t *handle);
+int dosfs_create(DosFs *fs, const char *path, uint16_t *handle);
+int dosfs_close(DosFs *fs, uint16_t handle);
+int dosfs_read(DosFs *fs, uint16_t handle, uint8_t *dst, uint16_t count, uint16_t *done);
+int dosfs_write(DosFs *fs, uint16_t handle, const uint8_t *src, uint16_t count, uint16_t *done);
+int dosfs_seek(DosFs *fs, uint16_t handle, uint8_t whence, int32_t offset, uint32_t *new_pos);
+int dosfs_delete(DosFs *fs, const char *path);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#define SOCKET int
+#define closesocket close
+#endif
+
+// Readiness notification for non-blocking sockets: epoll on Linux,
+// poll()/WSAPoll elsewhere. One thread owns the loop; evloop_wake() is the
+// only call that is safe from other threads.
+
+#define EV_READ 0x01
+#define EV_WRITE 0x02
+#define EV_ERROR 0x04 // hangup or socket error (always reported)
+
+typedef struct {
+    void *data;  // as registered, NULL for a wakeup
+    int events;
+} EvEvent;
+
+typedef struct EvLoop EvLoop;
+
+EvLoop *evloop_new(void);
+void evloop_free(EvLoop *loop);
+
+// events is a mask of EV_READ/EV_WRITE; 0 still reports EV_ERROR
+int evloop_add(EvLoop *loop, SOCKET fd, int events, void *data);
+int evloop_mod(EvLoop *loop, SOCKET fd, int events, void *data);
+void evloop_del(EvLoop *loop, SOCKET fd);
+
+// Wait up to timeout_ms (-1 = forever). Returns the number of events stored
+// in out (0 on timeout), or -1 on error. Pending wakeups are folded into one
+// event with data == NULL.
+int evloop_wait(EvLoop *loop, EvEvent *out, int max, int timeout_ms);
+
+// Make a blocked evloop_wait return. Callable from any thread.
+void evloop_wake(EvLoop *loop);
+
+int evloop_set_nonblocking(SOCKET fd);
+
+#endif
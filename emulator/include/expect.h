@@ -0,0 +1,44 @@
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/cpu.h"
+#include "../include/memory.h"
+
+// Assertions a job carries in SECTION_EXPECT (see protocol.h), checked
+// against its output and final machine state once it has run, so a grader
+// gets pass/fail and the first mismatch instead of the whole output.
+typedef struct {
+    uint8_t *entries;     // the sections' entries, back to back
+    size_t len;
+    size_t count;         // entries
+    // what the output checks need, gathered as the output goes by
+    uint64_t hash;        // FNV-1a 64 of the output so far
+    uint8_t *head;        // its first head_cap bytes, for prefix checks
+    size_t head_len, head_cap;
+} ExpectSet;
+
+// Outcome, as carried in the result record
+typedef struct {
+    uint8_t status;       // CHECK_*
+    uint8_t kind;         // EXPECT_* of the first failed assertion
+    uint16_t index;       // its number
+    uint32_t where;
+    uint64_t expected, actual;
+} ExpectResult;
+
+// NULL if the section data is well formed, else the reason it is not
+const char *expect_validate(const uint8_t *p, size_t len);
+
+void expect_init(ExpectSet *e);
+void expect_free(ExpectSet *e);
+// Add the entries of one validated section. Returns 0 if memory ran out.
+int expect_add(ExpectSet *e, const uint8_t *p, size_t len);
+// Feed the output to the set, in order and in pieces of any size
+void expect_output(ExpectSet *e, const void *data, size_t len);
+// Check every assertion in order and stop at the first that fails
+void expect_finish(const ExpectSet *e, const CPU8086 *cpu, const Memory8086 *mem,
+                   uint64_t instructions, ExpectResult *out);
+
+#endif
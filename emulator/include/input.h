@@ -0,0 +1,41 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Scripted keyboard/stdin input for one machine. DOS INT 21h and BIOS INT 16h
+// read from it instead of a real keyboard, so interactive programs can run
+// unattended. Line endings are stored the way DOS sees the Enter key: "\r\n"
+// and "\n" both become a single '\r'.
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t cap;
+    int pending_cr; // last appended byte was '\r' (swallow a following '\n')
+} EmuInput;
+
+// Returned by reads once the queue is exhausted
+#define INPUT_EOF (-1)
+
+void input_init(EmuInput *in);
+void input_free(EmuInput *in);
+
+// Append raw bytes (line endings are normalized); returns 0 on allocation failure
+int input_append(EmuInput *in, const void *data, size_t len);
+
+// Append everything readable from f; returns 0 on read or allocation failure
+int input_append_file(EmuInput *in, FILE *f);
+
+// Number of bytes still queued
+size_t input_available(const EmuInput *in);
+
+// Next byte without consuming it, or INPUT_EOF
+int input_peek(const EmuInput *in);
+
+// Consume and return the next byte, or INPUT_EOF
+int input_getc(EmuInput *in);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+// Log categories (index into the runtime threshold table)
+#define LOG_CAT_CPU 0
+#define LOG_CAT_DOS 1
+#define LOG_CAT_BIOS 2
+#define LOG_CAT_SERVER 3
+#define LOG_CAT_COUNT 4
+
+// Log levels, most severe first
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+// Compile-time filter. A call whose level is above EMU_LOG_MAX_LEVEL or whose
+// category is disabled with EMU_LOG_DISABLE_<CAT> folds to `if (0)` and emits
+// no code at all. Release builds (NDEBUG) keep INFO and below by default.
+#ifndef EMU_LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define EMU_LOG_MAX_LEVEL LOG_INFO
+#else
+#define EMU_LOG_MAX_LEVEL LOG_TRACE
+#endif
+#endif
+
+#ifdef EMU_LOG_DISABLE_CPU
+#define EMU_LOG_BUILT_0 0
+#else
+#define EMU_LOG_BUILT_0 1
+#endif
+#ifdef EMU_LOG_DISABLE_DOS
+#define EMU_LOG_BUILT_1 0
+#else
+#define EMU_LOG_BUILT_1 1
+#endif
+#ifdef EMU_LOG_DISABLE_BIOS
+#define EMU_LOG_BUILT_2 0
+#else
+#define EMU_LOG_BUILT_2 1
+#endif
+#ifdef EMU_LOG_DISABLE_SERVER
+#define EMU_LOG_BUILT_3 0
+#else
+#define EMU_LOG_BUILT_3 1
+#endif
+
+#define EMU_LOG_CAT_BUILT_(cat) EMU_LOG_BUILT_##cat
+#define EMU_LOG_CAT_BUILT(cat) EMU_LOG_CAT_BUILT_(cat)
+
+#if defined(__GNUC__)
+#define EMU_LOG_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define EMU_LOG_UNLIKELY(x) (x)
+#endif
+
+// Runtime filter: highest level enabled per category
+extern int emu_log_threshold[LOG_CAT_COUNT];
+
+// Compiled-in calls cost one load and one well-predicted branch when disabled
+#define EMU_LOG(cat, level, ...)                                          \
+    do                                                                    \
+    {                                                                     \
+        if (EMU_LOG_CAT_BUILT(cat) && (level) <= EMU_LOG_MAX_LEVEL &&     \
+            EMU_LOG_UNLIKELY((level) <= emu_log_threshold[cat]))          \
+            emu_log_write((cat), (level), __VA_ARGS__);                   \
+    } while (0)
+
+#define LOG_ENABLED(cat, level)                                       \
+    (EMU_LOG_CAT_BUILT(cat) && (level) <= EMU_LOG_MAX_LEVEL &&         \
+     EMU_LOG_UNLIKELY((level) <= emu_log_threshold[cat]))
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 3, 4)))
+#endif
+void emu_log_write(int cat, int level, const char *fmt, ...);
+
+// Parse a spec like "debug", "dos=trace,server=debug" or "cpu=off" and apply it
+// on top of the defaults (everything at INFO). Returns 0 on a malformed spec.
+int emu_log_configure(const char *spec);
+
+// Configure from the EMU_LOG environment variable, if set
+void emu_log_init_from_env(void);
+
+// Mirror every log line to an additional file (NULL to stop)
+void emu_log_set_file(FILE *f);
+
+#endif
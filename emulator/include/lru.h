@@ -0,0 +1,33 @@
+#ifndef LRU_H
+#define LRU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte-bounded LRU map from byte-string keys to byte-string values. Keys
+// are compared in full, so a hash collision never returns the wrong value.
+// Not thread-safe: one thread owns a cache.
+typedef struct LruCache LruCache;
+
+typedef struct {
+    uint64_t hits, misses, evictions;
+    size_t entries;
+    size_t bytes;     // keys, values and bookkeeping
+    size_t max_bytes;
+} LruStats;
+
+// NULL on allocation failure
+LruCache *lru_new(size_t max_bytes);
+void lru_free(LruCache *c);
+
+// Value stored under key, or NULL. A hit makes the entry the most recently
+// used one; the pointer stays valid until the next lru_put.
+const void *lru_get(LruCache *c, const void *key, size_t key_len, size_t *value_len);
+// Store a copy of value under key, replacing any previous value and evicting
+// the least recently used entries to stay within max_bytes. Returns 0 if the
+// entry does not fit at all or memory ran out.
+int lru_put(LruCache *c, const void *key, size_t key_len, const void *value, size_t value_len);
+
+void lru_stats(const LruCache *c, LruStats *out);
+
+#endif
@@ -5,8 +5,16 @@
 
 #define MEMORY_SIZE 0x100000
 
+// Video memory window (B800:0000). Writes into it are tracked in 16-byte
+// chunks so display devices can find what changed without scanning it all.
+#define VRAM_BASE 0xB8000
+#define VRAM_SIZE 0x8000
+#define VRAM_CHUNK_SHIFT 4
+#define VRAM_CHUNKS (VRAM_SIZE >> VRAM_CHUNK_SHIFT)
+
 typedef struct {
     uint8_t data[MEMORY_SIZE];
+    uint32_t vram_dirty[VRAM_CHUNKS / 32]; // one bit per chunk
 }Memory8086;
 
 //byte read cheyan
@@ -21,4 +29,8 @@ uint16_t mem_read16(Memory8086 *mem, uint32_t addr);
 //word write cheyan
 void mem_write16(Memory8086 *mem, uint32_t addr, uint16_t value);
 
-#endif
\ No newline at end of file
+// For code that writes mem->data directly (block transfers): mark the range
+// as written so video dirty tracking still sees it
+void mem_mark_written(Memory8086 *mem, uint32_t addr, uint32_t len);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Counters with a single writer thread each. The writer updates them with
+// plain relaxed loads and stores (no locked instructions); any thread may
+// read them at any time and sum them across writers.
+typedef atomic_uint_fast64_t MetricCounter;
+
+static inline void metric_add(MetricCounter *c, uint64_t v)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline uint64_t metric_read(const MetricCounter *c)
+{
+    return atomic_load_explicit((MetricCounter *)c, memory_order_relaxed);
+}
+
+// Latency histogram with power-of-two buckets: bucket 0 counts values below
+// 1 us, bucket i values in [2^(i-1), 2^i) us. The last bucket also takes
+// everything longer.
+#define METRICS_BUCKETS 32
+
+typedef struct {
+    MetricCounter counts[METRICS_BUCKETS];
+    MetricCounter sum_ns;
+} Histogram;
+
+void histogram_record(Histogram *h, uint64_t ns);
+
+// Sum of several writers' histograms, for reporting
+typedef struct {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} HistogramTotal;
+
+void histogram_total_add(HistogramTotal *t, const Histogram *h);
+// Estimated q-quantile (0..1) in seconds, interpolated within its bucket
+double histogram_quantile(const HistogramTotal *t, double q);
+
+// Growable text buffer for the Prometheus exposition format
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;       // an allocation failed; data holds what fit
+} MetricsText;
+
+void metrics_text_printf(MetricsText *t, const char *fmt, ...);
+// name_bucket{le=...} lines, name_sum, name_count and p50/p95/p99 gauges
+void metrics_text_histogram(MetricsText *t, const char *name, const char *help, const HistogramTotal *h);
+void metrics_text_free(MetricsText *t);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Monotonic clock in nanoseconds (only differences are meaningful)
+uint64_t emu_now_ns(void);
+
+// Give up the CPU for roughly the given number of microseconds
+void emu_sleep_us(unsigned us);
+
+// Number of online processors (at least 1)
+int emu_cpu_count(void);
+
+// Fill buf with bytes from the system's secure random source; 0 on failure
+int emu_random_bytes(void *buf, size_t len);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PORTS_H
+#define PORTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// I/O port dispatch for IN/OUT/INS/OUTS. Device models register callbacks
+// for a port range; ports nobody registered read as 0xFF and ignore writes.
+//
+// The table is two-level: 256 pages of 256 ports, and a page is only
+// allocated once something is registered in it, so an empty bus costs 2 KiB
+// and an unmapped access is a single NULL check.
+
+typedef uint8_t (*PortRead8)(void *dev, uint16_t port);
+typedef void (*PortWrite8)(void *dev, uint16_t port, uint8_t value);
+typedef uint16_t (*PortRead16)(void *dev, uint16_t port);
+typedef void (*PortWrite16)(void *dev, uint16_t port, uint16_t value);
+// Block transfers for REP INS/OUTS: count items of width 1 or 2 bytes
+typedef void (*PortReadBlock)(void *dev, uint16_t port, uint8_t *dst, size_t count, int width);
+typedef void (*PortWriteBlock)(void *dev, uint16_t port, const uint8_t *src, size_t count, int width);
+
+// Any callback may be NULL. Missing 16-bit handlers fall back to two byte
+// accesses (port, port+1); missing block handlers fall back to one access
+// per item.
+typedef struct {
+    PortRead8 read8;
+    PortWrite8 write8;
+    PortRead16 read16;
+    PortWrite16 write16;
+    PortReadBlock read_block;
+    PortWriteBlock write_block;
+    void *dev;
+} PortHandler;
+
+typedef struct {
+    PortHandler *pages[256];
+} PortBus;
+
+void ports_init(PortBus *bus);
+void ports_free(PortBus *bus);
+
+// Map ports [first, first + count) to handler (copied). Later registrations
+// replace earlier ones. Returns 0 on allocation failure.
+int ports_register(PortBus *bus, uint16_t first, uint32_t count, const PortHandler *handler);
+
+// bus may be NULL (every port unmapped)
+uint8_t ports_in8(PortBus *bus, uint16_t port);
+uint16_t ports_in16(PortBus *bus, uint16_t port);
+void ports_out8(PortBus *bus, uint16_t port, uint8_t value);
+void ports_out16(PortBus *bus, uint16_t port, uint16_t value);
+void ports_in_block(PortBus *bus, uint16_t port, uint8_t *dst, size_t count, int width);
+void ports_out_block(PortBus *bus, uint16_t port, const uint8_t *src, size_t count, int width);
+
+// Bochs/QEMU style debug console: bytes written to port 0xE9 go to out (the
+// machine's output buffer), reads return 0xE9 so programs can probe for it.
+#define DEBUGCON_PORT 0xE9
+struct EmuOutput;
+int ports_add_debugcon(PortBus *bus, struct EmuOutput *out);
+
+#endif
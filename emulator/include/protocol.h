@@ -0,0 +1,221 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Wire format shared by emu_server and its clients. All integers are
+// little-endian.
+//
+// Legacy mode (default):
+//   client -> server: u32 payload length, payload (.COM image)
+//   server -> client: u32 output length, output bytes
+// A payload over 65280 bytes (64 KiB less the PSP) is not run; the reply
+// is then the reason as the output (in stream mode followed by a
+// FRAME_RESULT with EXIT_REJECTED).
+//
+// Stream mode: the client sends EMU_STREAM_MAGIC in place of the length and
+// then the usual u32 length + payload. The server answers with a sequence of
+// frames while the program runs:
+//   u8 frame type, u32 payload length, payload
+// and always finishes with exactly one FRAME_RESULT.
+
+#define EMU_STREAM_MAGIC 0x53363845u // "E86S"
+
+// Job mode: the client sends EMU_JOB_MAGIC, a u8 flags byte and then tagged
+// sections (u8 tag, u32 length, data) ending with SECTION_END. The reply is the
+// legacy u32 length + output, or frames if JOB_FLAG_STREAM is set. Unknown
+// section tags are skipped.
+#define EMU_JOB_MAGIC 0x4A363845u // "E86J"
+
+#define JOB_FLAG_STREAM 0x01
+#define JOB_FLAG_VIDEO 0x02  // with JOB_FLAG_STREAM: also send FRAME_VIDEO_TEXT/GFX
+// Bulk work: queue in the batch lane, which only gets the workers interactive
+// jobs leave free. MSG_JOB_BATCH programs always go there.
+#define JOB_FLAG_LOW_PRIORITY 0x04
+// One-shot buffered E86J only: follow the legacy reply (u32 length, output)
+// with a FRAME_RESULT frame, as in stream mode
+#define JOB_FLAG_RESULT 0x08
+// With SECTION_EXPECT: leave the output out of a buffered reply (legacy or
+// MSG_JOB) when every assertion passed, and set RESULT_FLAG_OUTPUT_OMITTED in
+// its result record. MSG_JOB_BATCH programs do so when the batch has it.
+#define JOB_FLAG_CHECK_ONLY 0x10
+
+// Pipelined mode: the client sends EMU_PIPE_MAGIC and a u16 protocol
+// version, the server answers with EMU_PIPE_MAGIC and the u16 version both
+// will use, the lower of the two. After that the connection carries any
+// number of messages in both directions, each
+//   u8 type, u32 request id, u32 payload length, payload
+// Requests may be sent back to back without waiting for replies. Every reply
+// frame carries the id of the request it belongs to, and replies for
+// different requests arrive in whatever order the jobs finish. A buffered
+// MSG_JOB is answered with FRAME_OUTPUT (the whole output, omitted when empty)
+// followed by FRAME_RESULT; a streamed one gets the usual frame sequence.
+#define EMU_PIPE_MAGIC 0x50363845u // "E86P"
+// Version 2: FRAME_BATCH_RESULT entries carry the full result record
+#define EMU_PROTOCOL_VERSION 2
+
+#define MSG_HEADER_SIZE 9
+
+// client -> server messages
+#define MSG_JOB 0x10 // u8 job flags + sections, as in E86J
+// u32 program count, then per program { u32 length, sections }. The programs
+// run in parallel and are answered with a single FRAME_BATCH_RESULT. Batch
+// programs are never streamed. The top byte of the count holds batch flags:
+// JOB_FLAG_CHECK_ONLY applies it to every program.
+#define MSG_JOB_BATCH 0x11
+#define BATCH_COUNT_MASK 0x00FFFFFFu
+#define BATCH_FLAGS_SHIFT 24
+#define MSG_STATS 0x12 // no payload, answered with FRAME_STATS
+// Unix socket only, buffered job exchanged through shared memory. The
+// message carries a memfd (SCM_RIGHTS) sealed with F_SEAL_SHRINK, holding
+// the program and room for the output; other descriptors are refused.
+// Payload: u8 job flags (no streaming),
+// u32 program offset, u32 program length, u32 output offset, u32 output
+// capacity, then further sections as in E86J (input, files, limits, end).
+// The output is written to the shared memory and the reply is a lone
+// FRAME_RESULT whose output byte count is what was written there.
+#define MSG_JOB_SHM 0x13
+#define SHM_JOB_HEADER_SIZE 17
+// Sessions: a machine kept on the server between requests, for tools that
+// load a program once and then run, inspect and patch it bit by bit. Every
+// session message but MSG_SESSION_CREATE starts with the u32 session id and
+// the SESSION_TOKEN_SIZE random token the create was answered with; a wrong
+// token gets the same error as an unknown id. The answer is FRAME_SESSION
+// (u32 session id, then the data noted below) or FRAME_ERROR, and
+// FRAME_BUSY when the server has too many sessions. A session outlives the
+// connection that created it and is destroyed once it has been idle too
+// long. Not available in fork mode.
+#define SESSION_TOKEN_SIZE 16
+// Optional sections, as for MSG_SESSION_LOAD; answer: the token
+#define MSG_SESSION_CREATE 0x14
+// Sections as in E86J (program or source, input, files): replaces the
+// machine with a fresh one holding them
+#define MSG_SESSION_LOAD 0x15
+// u64 instructions (0 = server default budget), u32 timeout in ms (0 = server
+// default). Answered like a buffered MSG_JOB, with the output and
+// instruction count of this run; it ends with EXIT_BUDGET once the
+// instructions have run. A machine that has stopped answers at once.
+#define MSG_SESSION_RUN 0x16
+// Answer: u16 registers in EXPECT_REG_* order, u8 EXIT_* the machine stopped
+// with (0 while it can run)
+#define MSG_SESSION_GET_REGS 0x17
+// Entries of { u8 EXPECT_REG_*, u16 value }; answered like GET_REGS. A
+// stopped machine can run again afterwards.
+#define MSG_SESSION_SET_REGS 0x18
+#define MSG_SESSION_READ 0x19    // u32 linear address, u32 length; answer: the bytes
+#define MSG_SESSION_WRITE 0x1A   // u32 linear address, bytes
+#define MSG_SESSION_DESTROY 0x1B
+// u32 id of a job, batch or session run sent earlier on this connection and
+// not answered yet: stop it. The worker notices within one RUN_SLICE of
+// instructions and the request is answered as usual, with EXIT_CANCELLED and
+// the output so far; batch programs that have not started do not run. Only
+// an id with nothing in flight gets an answer, FRAME_ERROR under the
+// cancel message's own id.
+#define MSG_CANCEL 0x1C
+// Session message: u8 SESSION_FRAME_* format; answer: the machine's current
+// graphics frame (modes 04h-06h), as for emu8086 --frame. Text modes get
+// FRAME_ERROR.
+#define MSG_SESSION_FRAME 0x1D
+#define SESSION_FRAME_RAW 0x00 // u16 width, u16 height, one CGA colour index per pixel
+#define SESSION_FRAME_PPM 0x01 // binary PPM (P6) through the CGA palette
+
+#define SECTION_HEADER_SIZE 5
+
+#define SECTION_END 0x00     // no payload, terminates the request
+#define SECTION_PROGRAM 0x01 // .COM image loaded at 0000:0100
+#define SECTION_INPUT 0x02   // scripted keyboard input for INT 21h/16h
+#define SECTION_FILE 0x03    // u8 name length, name, contents: file visible to INT 21h
+#define SECTION_BUDGET 0x04  // u64 instruction limit (0 = server default)
+#define SECTION_TIMEOUT 0x05 // u32 wall-clock limit in ms (0 = server default)
+// Assertions checked once the job has run, reported in the result record:
+// entries of { u8 EXPECT_* kind, u16 length, data }. A job may carry several
+// such sections; their entries are numbered in order from 0.
+#define SECTION_EXPECT 0x06
+// NASM-syntax source (the subset asm8086.h describes), assembled by the
+// server in place of a SECTION_PROGRAM, which the job must then not carry.
+// If it does not assemble the job does not run: its result has
+// EXIT_ASM_ERROR and the error line, its output the error messages.
+#define SECTION_SOURCE 0x07
+
+#define EXPECT_OUTPUT_HASH 0x01       // u64 FNV-1a 64 of the whole output
+#define EXPECT_OUTPUT_PREFIX 0x02     // bytes the output starts with
+#define EXPECT_REGISTER 0x03          // u8 EXPECT_REG_*, u16 value, u16 mask of the bits compared
+#define EXPECT_MEMORY 0x04            // u32 linear address, bytes found there
+#define EXPECT_MAX_INSTRUCTIONS 0x05  // u64 most instructions the job may take
+
+// EXPECT_REGISTER numbers: the record's register order, then CS and IP
+enum {
+    EXPECT_REG_AX, EXPECT_REG_BX, EXPECT_REG_CX, EXPECT_REG_DX,
+    EXPECT_REG_SI, EXPECT_REG_DI, EXPECT_REG_BP, EXPECT_REG_SP,
+    EXPECT_REG_DS, EXPECT_REG_ES, EXPECT_REG_SS, EXPECT_REG_FLAGS,
+    EXPECT_REG_CS, EXPECT_REG_IP, EXPECT_REG_COUNT
+};
+
+#define FRAME_HEADER_SIZE 5
+
+#define FRAME_OUTPUT 0x01    // raw chunk of guest output
+#define FRAME_HEARTBEAT 0x02 // u64 instructions executed so far
+// The result record, RESULT_SIZE bytes:
+//   u64 instructions executed, u32 total output bytes, u8 exit reason,
+//   u16 CS, u16 IP where execution stopped (the first 17 bytes, all that
+//   older servers sent), u8 DOS exit code (AL of INT 21h AH=4Ch),
+//   u8 unsupported opcode (EXIT_BAD_OPCODE), u8 RESULT_FLAG_*,
+//   u16 AX BX CX DX SI DI BP SP DS ES SS FLAGS, u64 ns spent running,
+//   u64 ns waiting for the first worker, then the SECTION_EXPECT outcome:
+//   u8 CHECK_*, u8 EXPECT_* kind of the first failed assertion, u16 its
+//   number, u32 where it failed (output offset, EXPECT_REG_* or linear
+//   address of the first differing byte), u64 expected and u64 actual value
+//   there (the byte, register, hash or instruction count; actual is
+//   CHECK_NO_BYTE where the output ended first), u32 line of the first
+//   assembly error (SECTION_SOURCE, 0 if none)
+// Clients should ignore any bytes past the fields they know.
+#define FRAME_RESULT 0x03
+#define RESULT_SIZE 88
+#define RESULT_FLAG_CACHED 0x01 // answered from the result cache, times are 0
+#define RESULT_FLAG_OUTPUT_OMITTED 0x02 // JOB_FLAG_CHECK_ONLY: output not sent
+
+#define CHECK_NONE 0x00   // the job carried no assertions
+#define CHECK_PASSED 0x01
+#define CHECK_FAILED 0x02
+#define CHECK_NO_BYTE 0xFFFFFFFFFFFFFFFFull
+// Text screen cells changed since the previous video frame (the first one
+// covers the whole screen): u8 mode, u8 cursor row, u8 cursor col, u16 run
+// count, then runs of { u8 row, u8 col, u8 cells, cells * (char, attr) }
+#define FRAME_VIDEO_TEXT 0x04
+// CGA graphics (modes 04h-06h) changed since the previous video frame, as
+// rectangles of packed framebuffer bytes: u8 mode, u8 colour select, u16 rect
+// count, then rects of { u16 x byte, u16 y, u16 width bytes, u16 height,
+// height * width bytes }. See video_gfx_delta.
+#define FRAME_VIDEO_GFX 0x05
+// Pipelined mode only: the request with this id was rejected, text reason.
+// Nothing else is sent for that id.
+#define FRAME_ERROR 0x06
+// Pipelined mode only, answer to MSG_JOB_BATCH: u32 program count, then per
+// program in request order { result record, output }. Protocol version 1
+// has { u8 exit reason, u64 instructions executed, u16 CS, u16 IP,
+// u32 output length, output } instead.
+#define FRAME_BATCH_RESULT 0x07
+// Answer to MSG_STATS: server counters as text, one "name value" per line
+// (Prometheus exposition format)
+#define FRAME_STATS 0x08
+// Pipelined mode only: the request with this id was not queued because the
+// server or this connection has too much work already, text reason. Nothing
+// else is sent for that id; the client may retry later. One-shot requests
+// get the reason as their output instead, in stream mode followed by a
+// FRAME_RESULT with EXIT_BUSY.
+#define FRAME_BUSY 0x09
+// Answer to a session message: u32 session id, then what the message returns
+#define FRAME_SESSION 0x0A
+
+// Exit reasons
+#define EXIT_TERMINATED 0x01  // INT 21h AH=00h/4Ch
+#define EXIT_HALT 0x02        // HLT
+#define EXIT_DIVIDE_ERROR 0x03
+#define EXIT_BAD_OPCODE 0x04  // unknown or unsupported instruction
+#define EXIT_BUDGET 0x05      // instruction budget used up
+#define EXIT_TIMEOUT 0x06     // wall-clock limit reached
+#define EXIT_CRASHED 0x07     // fork mode: the job's process died
+#define EXIT_BUSY 0x08        // not run, the server was overloaded
+#define EXIT_REJECTED 0x09    // not run, the request was invalid (e.g. program too large)
+#define EXIT_ASM_ERROR 0x0A   // not run, SECTION_SOURCE did not assemble
+#define EXIT_CANCELLED 0x0B   // stopped by MSG_CANCEL
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Lock-free single-producer / single-consumer ring of fixed-size slots.
+// The producer fills a slot in place and publishes it, the consumer reads it
+// in place and releases it, so nothing is copied through the queue itself.
+// Exactly one thread may produce and one thread may consume at a time.
+typedef struct {
+    uint8_t *slots;
+    size_t slot_size;
+    size_t mask;                 // capacity - 1, capacity is a power of two
+    // head and tail live on separate cache lines so the two threads don't
+    // keep stealing the same line from each other
+    _Alignas(64) _Atomic size_t head;   // next slot to consume (written by consumer)
+    _Alignas(64) _Atomic size_t tail;   // next slot to produce (written by producer)
+} SpscQueue;
+
+// capacity is rounded up to a power of two; returns 0 on allocation failure
+int spsc_init(SpscQueue *q, size_t slot_size, size_t capacity);
+void spsc_free(SpscQueue *q);
+
+// Producer side: slot to fill, or NULL when the ring is full
+void *spsc_reserve(SpscQueue *q);
+// Producer side: make the slot returned by spsc_reserve visible to the consumer
+void spsc_publish(SpscQueue *q);
+
+// Consumer side: oldest published slot, or NULL when the ring is empty
+void *spsc_peek(SpscQueue *q);
+// Consumer side: hand the slot returned by spsc_peek back to the producer
+void spsc_release(SpscQueue *q);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "../include/memory.h"
+#include "../include/ports.h"
+
+// 80x25 colour text mode backed by guest memory at B800:0000 (page 0 only).
+// Each cell is a character byte followed by an attribute byte. The INT 10h
+// handler in cpu.c drives it through these functions; programs may also
+// write the cells directly.
+//
+// Modes 04h/05h (320x200, 4 colours) and 06h (640x200, 2 colours) use the
+// CGA layout instead: 80 bytes per scanline, even lines at B800:0000 and odd
+// lines at B800:2000, pixels packed MSB first.
+#define TEXT_COLS 80
+#define TEXT_ROWS 25
+#define TEXT_ROW_BYTES (TEXT_COLS * 2)
+#define TEXT_DEFAULT_ATTR 0x07
+
+#define CGA_HEIGHT 200
+#define CGA_ROW_BYTES 80
+#define CGA_BANK_OFFSET 0x2000
+#define CGA_PLANE_SIZE 0x4000
+// CGA registers: mode control, colour select, status
+#define CGA_PORT_MODE 0x3D8
+#define CGA_PORT_COLOR 0x3D9
+#define CGA_PORT_STATUS 0x3DA
+
+typedef struct {
+    uint8_t mode;
+    uint8_t cursor_row;
+    uint8_t cursor_col;
+    // cursor as of the last exported frame
+    uint8_t sent_row;
+    uint8_t sent_col;
+    uint8_t cga_mode_ctl;  // last value written to 3D8h
+    uint8_t cga_color;     // colour select register (3D9h)
+    uint8_t cga_status;    // toggles the retrace bits on each 3DAh read
+} VideoState;
+
+// Mode 3, cleared screen, cursor at 0,0
+void video_init(VideoState *v, Memory8086 *mem);
+
+// INT 10h primitives
+void video_set_mode(VideoState *v, Memory8086 *mem, uint8_t mode, int clear);
+void video_set_cursor(VideoState *v, Memory8086 *mem, uint8_t row, uint8_t col);
+// Scroll the window rows top..bottom, cols left..right by lines (0 = blank it)
+void video_scroll(Memory8086 *mem, int up, uint8_t lines, uint8_t attr,
+                  uint8_t top, uint8_t left, uint8_t bottom, uint8_t right);
+// The same in modes 04h-06h: the window is in character cells of 8x8 pixels
+// and the lines scrolled in are filled with pixel value color
+void video_scroll_gfx(VideoState *v, Memory8086 *mem, int up, uint8_t lines, uint8_t color,
+                      uint8_t top, uint8_t left, uint8_t bottom, uint8_t right);
+// Write ch count times from the cursor on without moving it (attr < 0 keeps attributes)
+void video_write_chars(VideoState *v, Memory8086 *mem, uint8_t ch, int attr, uint16_t count);
+uint16_t video_read_cell(VideoState *v, Memory8086 *mem);
+// Teletype output: handles BEL/BS/LF/CR, wraps and scrolls
+void video_teletype(VideoState *v, Memory8086 *mem, uint8_t ch, int attr);
+
+// Incremental frame export. Encodes the cells changed since the last call and
+// clears their dirty bits. Returns the encoded size, or 0 if neither a cell
+// nor the cursor changed (or cap is too small for the frame). Layout:
+//   u8 mode, u8 cursor row, u8 cursor col, u16 run count,
+//   runs of { u8 row, u8 col, u8 cells, cells * (char, attr) }
+size_t video_text_delta(VideoState *v, Memory8086 *mem, uint8_t *out, size_t cap);
+
+// Print the screen as plain text, trailing blanks and empty rows trimmed
+void video_dump_text(Memory8086 *mem, FILE *f);
+
+// Graphics modes
+int video_is_graphics(const VideoState *v);
+int video_width(const VideoState *v);     // pixels per scanline (320 or 640)
+int video_columns(const VideoState *v);   // text columns reported to INT 10h
+// INT 10h AH=0Ch/0Dh: bit 7 of color XORs the pixel in
+void video_put_pixel(VideoState *v, Memory8086 *mem, uint16_t x, uint16_t y, uint8_t color);
+uint8_t video_get_pixel(VideoState *v, Memory8086 *mem, uint16_t x, uint16_t y);
+// INT 10h AH=0Bh: BH=0 sets background/intensity from BL, BH=1 picks palette BL
+void video_set_palette(VideoState *v, uint8_t id, uint8_t value);
+// Colour select/status registers at 3D8h-3DAh
+int video_add_cga_ports(VideoState *v, PortBus *bus);
+
+// Incremental graphics export. Dirty 16-byte chunks (5 per scanline) are
+// merged into rectangles of whole bytes, scanlines stacked when they share
+// the same span. Layout:
+//   u8 mode, u8 colour select, u16 rect count,
+//   rects of { u16 x byte, u16 y, u16 width bytes, u16 height,
+//              height * width bytes of packed pixels, top scanline first }
+// Falls back to one full-screen rectangle (16012 bytes) if the rectangles
+// would not fit in cap. Returns 0 if nothing changed or cap is too small.
+size_t video_gfx_delta(VideoState *v, Memory8086 *mem, uint8_t *out, size_t cap);
+
+// Whole-frame export: one palette index per pixel (width x 200), and the
+// same as binary PPM through the CGA palette, in a malloc'd buffer of *len
+// bytes (NULL if out of memory) or written to f
+void video_render_indexed(VideoState *v, Memory8086 *mem, uint8_t *pixels);
+uint8_t *video_render_ppm(VideoState *v, Memory8086 *mem, size_t *len);
+int video_write_ppm(VideoState *v, Memory8086 *mem, FILE *f);
+
+#endif
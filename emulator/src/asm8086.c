@@ -0,0 +1,1934 @@
+#include "../include/asm8086.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PASSES 32
+#define NAME_LEN 64
+#define OUTPUT_MAX 0x10000     // a .COM image is one segment
+#define MAX_ERRORS 20          // reported per run, the rest are only counted
+#define SECTION_ALIGN 4        // nasm -f bin default for .data and .bss
+
+enum { SEC_TEXT, SEC_DATA, SEC_BSS, SEC_COUNT };
+
+// Encodings that depend on symbol values start small and only grow from one
+// pass to the next, so the passes always settle. One set per statement.
+#define GROW_WIDE 0x01         // 16-bit immediate, near jump
+#define GROW_DISP8 0x02        // memory operand needs a displacement
+#define GROW_DISP16 0x04       // ... a 16-bit one
+
+typedef struct
+{
+    char name[NAME_LEN];
+    int64_t value;
+    int pass;                  // pass that last defined it, 0 = not yet
+    int section;               // SEC_* of a label, -1 for equ
+    int used;                  // slot taken
+} Symbol;
+
+typedef struct
+{
+    uint8_t *data;             // NULL for .bss, which only counts
+    size_t size, cap;
+} SectionBuf;
+
+typedef struct
+{
+    Symbol *syms;              // open addressing, power-of-two capacity
+    size_t nsyms, sym_cap;
+    uint8_t *grow;             // GROW_* per statement
+    size_t grow_cap;
+    size_t stmt;
+    int pass;
+    int final;                 // last pass: report errors and keep the bytes
+    int changed;               // a label moved or an encoding grew
+    int failed;                // this pass found an error
+    int64_t org;
+    int org_seen;
+    int section;
+    SectionBuf sec[SEC_COUNT];
+    int64_t base[SEC_COUNT];   // section addresses, from the previous pass
+    int64_t drift[SEC_COUNT];  // how far this pass's labels have moved so far
+    char scope[NAME_LEN];      // last non-local label, prefix of .local ones
+    char *line_buf;
+    size_t line_cap;
+    int line;
+    int line_failed;           // report only the first error of a line
+    int unknown;               // the last expression used an undefined symbol
+    int undefined;             // some expression in this pass did
+    int nerrors;
+    AsmResult *res;
+} Asm;
+
+enum { OP_NONE, OP_REG, OP_SREG, OP_MEM, OP_IMM, OP_FAR };
+
+typedef struct
+{
+    int kind;
+    int reg;                   // OP_REG, OP_SREG
+    int size;                  // 1 or 2 for registers, keyword size otherwise (0 = none)
+    int strict;                // size given with `strict`
+    int dist;                  // DIST_* keyword on a jump target
+    int rm;                    // OP_MEM: ModRM r/m, -1 for a direct address
+    int seg;                   // OP_MEM: segment override, -1 for none
+    int64_t value;             // immediate, displacement or far offset
+    int64_t seg_value;         // OP_FAR: segment
+    int unknown;               // value uses a symbol not defined yet
+} Operand;
+
+enum { DIST_NONE, DIST_SHORT, DIST_NEAR, DIST_FAR };
+
+enum
+{
+    K_FIXED, K_ALU, K_GRP3, K_INCDEC, K_SHIFT, K_MOV, K_PUSH, K_POP, K_XCHG, K_LPTR,
+    K_TEST, K_JMP, K_CALL, K_JCC, K_LOOP, K_INT, K_IN, K_OUT, K_RET, K_AAM, K_ENTER, K_PREFIX,
+    K_REG8, K_REG16, K_SREG, K_DIRECTIVE, K_SIZE
+};
+
+enum
+{
+    D_ALIGN, D_ALIGNB, D_BITS, D_CPU, D_DB, D_DD, D_DW, D_EQU, D_EXTERN, D_GLOBAL, D_ORG,
+    D_RESB, D_RESD, D_RESW, D_SECTION, D_TIMES, D_USE16
+};
+
+enum { SZ_BYTE, SZ_WORD, SZ_DWORD, SZ_STRICT, SZ_SHORT, SZ_NEAR, SZ_FAR };
+
+// Instructions (K_FIXED..K_PREFIX, op is the opcode or ModRM extension),
+// registers (op is the ModRM number), directives (D_*) and size keywords
+// (SZ_*): every reserved word, so each word is classified with one lookup
+typedef struct
+{
+    const char *name;
+    uint8_t kind;
+    uint8_t op;
+} Keyword;
+
+#define KEYWORD_MAX 7 // longest name
+
+// Sorted for bsearch
+static const Keyword keywords[] = {
+    { "aaa", K_FIXED, 0x37 }, { "aad", K_AAM, 0xD5 }, { "aam", K_AAM, 0xD4 }, { "aas", K_FIXED, 0x3F },
+    { "adc", K_ALU, 2 }, { "add", K_ALU, 0 }, { "ah", K_REG8, 4 }, { "al", K_REG8, 0 },
+    { "align", K_DIRECTIVE, D_ALIGN }, { "alignb", K_DIRECTIVE, D_ALIGNB }, { "and", K_ALU, 4 },
+    { "ax", K_REG16, 0 }, { "bh", K_REG8, 7 }, { "bits", K_DIRECTIVE, D_BITS }, { "bl", K_REG8, 3 },
+    { "bp", K_REG16, 5 }, { "bx", K_REG16, 3 }, { "byte", K_SIZE, SZ_BYTE }, { "call", K_CALL, 0 },
+    { "cbw", K_FIXED, 0x98 }, { "ch", K_REG8, 5 }, { "cl", K_REG8, 1 }, { "clc", K_FIXED, 0xF8 },
+    { "cld", K_FIXED, 0xFC }, { "cli", K_FIXED, 0xFA }, { "cmc", K_FIXED, 0xF5 }, { "cmp", K_ALU, 7 },
+    { "cmpsb", K_FIXED, 0xA6 }, { "cmpsw", K_FIXED, 0xA7 }, { "cpu", K_DIRECTIVE, D_CPU },
+    { "cs", K_SREG, 1 }, { "cwd", K_FIXED, 0x99 }, { "cx", K_REG16, 1 }, { "daa", K_FIXED, 0x27 },
+    { "das", K_FIXED, 0x2F }, { "db", K_DIRECTIVE, D_DB }, { "dd", K_DIRECTIVE, D_DD },
+    { "dec", K_INCDEC, 1 }, { "dh", K_REG8, 6 }, { "di", K_REG16, 7 }, { "div", K_GRP3, 6 },
+    { "dl", K_REG8, 2 }, { "ds", K_SREG, 3 }, { "dw", K_DIRECTIVE, D_DW }, { "dword", K_SIZE, SZ_DWORD },
+    { "dx", K_REG16, 2 }, { "enter", K_ENTER, 0xC8 }, { "equ", K_DIRECTIVE, D_EQU }, { "es", K_SREG, 0 },
+    { "extern", K_DIRECTIVE, D_EXTERN }, { "far", K_SIZE, SZ_FAR }, { "global", K_DIRECTIVE, D_GLOBAL },
+    { "hlt", K_FIXED, 0xF4 }, { "idiv", K_GRP3, 7 }, { "imul", K_GRP3, 5 }, { "in", K_IN, 0 },
+    { "inc", K_INCDEC, 0 }, { "insb", K_FIXED, 0x6C }, { "insw", K_FIXED, 0x6D }, { "int", K_INT, 0xCD },
+    { "int3", K_FIXED, 0xCC }, { "into", K_FIXED, 0xCE }, { "iret", K_FIXED, 0xCF }, { "ja", K_JCC, 0x77 },
+    { "jae", K_JCC, 0x73 }, { "jb", K_JCC, 0x72 }, { "jbe", K_JCC, 0x76 }, { "jc", K_JCC, 0x72 },
+    { "jcxz", K_LOOP, 0xE3 }, { "je", K_JCC, 0x74 }, { "jg", K_JCC, 0x7F }, { "jge", K_JCC, 0x7D },
+    { "jl", K_JCC, 0x7C }, { "jle", K_JCC, 0x7E }, { "jmp", K_JMP, 0 }, { "jna", K_JCC, 0x76 },
+    { "jnae", K_JCC, 0x72 }, { "jnb", K_JCC, 0x73 }, { "jnbe", K_JCC, 0x77 }, { "jnc", K_JCC, 0x73 },
+    { "jne", K_JCC, 0x75 }, { "jng", K_JCC, 0x7E }, { "jnge", K_JCC, 0x7C }, { "jnl", K_JCC, 0x7D },
+    { "jnle", K_JCC, 0x7F }, { "jno", K_JCC, 0x71 }, { "jnp", K_JCC, 0x7B }, { "jns", K_JCC, 0x79 },
+    { "jnz", K_JCC, 0x75 }, { "jo", K_JCC, 0x70 }, { "jp", K_JCC, 0x7A }, { "jpe", K_JCC, 0x7A },
+    { "jpo", K_JCC, 0x7B }, { "js", K_JCC, 0x78 }, { "jz", K_JCC, 0x74 }, { "lahf", K_FIXED, 0x9F },
+    { "lds", K_LPTR, 0xC5 }, { "lea", K_LPTR, 0x8D }, { "leave", K_FIXED, 0xC9 }, { "les", K_LPTR, 0xC4 },
+    { "lock", K_PREFIX, 0xF0 }, { "lodsb", K_FIXED, 0xAC }, { "lodsw", K_FIXED, 0xAD },
+    { "loop", K_LOOP, 0xE2 }, { "loope", K_LOOP, 0xE1 }, { "loopne", K_LOOP, 0xE0 },
+    { "loopnz", K_LOOP, 0xE0 }, { "loopz", K_LOOP, 0xE1 }, { "mov", K_MOV, 0 }, { "movsb", K_FIXED, 0xA4 },
+    { "movsw", K_FIXED, 0xA5 }, { "mul", K_GRP3, 4 }, { "near", K_SIZE, SZ_NEAR }, { "neg", K_GRP3, 3 },
+    { "nop", K_FIXED, 0x90 }, { "not", K_GRP3, 2 }, { "or", K_ALU, 1 }, { "org", K_DIRECTIVE, D_ORG },
+    { "out", K_OUT, 0 }, { "outsb", K_FIXED, 0x6E }, { "outsw", K_FIXED, 0x6F }, { "pop", K_POP, 0 },
+    { "popa", K_FIXED, 0x61 }, { "popf", K_FIXED, 0x9D }, { "push", K_PUSH, 0 }, { "pusha", K_FIXED, 0x60 },
+    { "pushf", K_FIXED, 0x9C }, { "rcl", K_SHIFT, 2 }, { "rcr", K_SHIFT, 3 }, { "rep", K_PREFIX, 0xF3 },
+    { "repe", K_PREFIX, 0xF3 }, { "repne", K_PREFIX, 0xF2 }, { "repnz", K_PREFIX, 0xF2 },
+    { "repz", K_PREFIX, 0xF3 }, { "resb", K_DIRECTIVE, D_RESB }, { "resd", K_DIRECTIVE, D_RESD },
+    { "resw", K_DIRECTIVE, D_RESW }, { "ret", K_RET, 0xC3 }, { "retf", K_RET, 0xCB }, { "retn", K_RET, 0xC3 },
+    { "rol", K_SHIFT, 0 }, { "ror", K_SHIFT, 1 }, { "sahf", K_FIXED, 0x9E }, { "sal", K_SHIFT, 4 },
+    { "sar", K_SHIFT, 7 }, { "sbb", K_ALU, 3 }, { "scasb", K_FIXED, 0xAE }, { "scasw", K_FIXED, 0xAF },
+    { "section", K_DIRECTIVE, D_SECTION }, { "segment", K_DIRECTIVE, D_SECTION }, { "shl", K_SHIFT, 4 },
+    { "short", K_SIZE, SZ_SHORT }, { "shr", K_SHIFT, 5 }, { "si", K_REG16, 6 }, { "sp", K_REG16, 4 },
+    { "ss", K_SREG, 2 }, { "stc", K_FIXED, 0xF9 }, { "std", K_FIXED, 0xFD }, { "sti", K_FIXED, 0xFB },
+    { "stosb", K_FIXED, 0xAA }, { "stosw", K_FIXED, 0xAB }, { "strict", K_SIZE, SZ_STRICT },
+    { "sub", K_ALU, 5 }, { "test", K_TEST, 0 }, { "times", K_DIRECTIVE, D_TIMES },
+    { "use16", K_DIRECTIVE, D_USE16 }, { "wait", K_FIXED, 0x9B }, { "word", K_SIZE, SZ_WORD },
+    { "xchg", K_XCHG, 0 }, { "xlat", K_FIXED, 0xD7 }, { "xlatb", K_FIXED, 0xD7 }, { "xor", K_ALU, 6 },
+};
+
+// ---------------------------------------------------------------------------
+// Errors and symbols
+// ---------------------------------------------------------------------------
+
+static void asm_error(Asm *a, const char *fmt, ...)
+{
+    a->failed = 1;
+    if (!a->final || a->line_failed) return;
+    a->line_failed = 1;
+    AsmResult *res = a->res;
+    if (!res->error_line) res->error_line = a->line;
+    if (++a->nerrors > MAX_ERRORS) return;
+    char msg[192];
+    int n = snprintf(msg, sizeof(msg), "line %d: ", a->line);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg + n, sizeof(msg) - (size_t)n - 1, fmt, ap);
+    va_end(ap);
+    size_t len = strlen(msg);
+    msg[len++] = '\n';
+    char *errors = realloc(res->errors, res->errors_len + len + 1);
+    if (!errors) return;
+    memcpy(errors + res->errors_len, msg, len);
+    res->errors = errors;
+    res->errors_len += len;
+    errors[res->errors_len] = 0;
+}
+
+static uint64_t hash_name(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *s; ++s)
+    {
+        h ^= (uint8_t)*s;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// The symbol's slot, created if missing. NULL if memory ran out.
+static Symbol *symbol_slot(Asm *a, const char *name)
+{
+    if (2 * (a->nsyms + 1) > a->sym_cap)
+    {
+        size_t cap = a->sym_cap ? 2 * a->sym_cap : 64;
+        Symbol *syms = calloc(cap, sizeof(*syms));
+        if (!syms) return NULL;
+        for (size_t i = 0; i < a->sym_cap; ++i)
+        {
+            if (!a->syms[i].used) continue;
+            size_t j = hash_name(a->syms[i].name) & (cap - 1);
+            while (syms[j].used) j = (j + 1) & (cap - 1);
+            syms[j] = a->syms[i];
+        }
+        free(a->syms);
+        a->syms = syms;
+        a->sym_cap = cap;
+    }
+    size_t i = hash_name(name) & (a->sym_cap - 1);
+    while (a->syms[i].used && strcmp(a->syms[i].name, name) != 0) i = (i + 1) & (a->sym_cap - 1);
+    Symbol *s = &a->syms[i];
+    if (!s->used)
+    {
+        s->used = 1;
+        snprintf(s->name, sizeof(s->name), "%s", name);
+        a->nsyms++;
+    }
+    return s;
+}
+
+// Local labels (.name) belong to the last ordinary label
+static void full_name(Asm *a, const char *name, char *out)
+{
+    size_t n = 0;
+    if (name[0] == '.' && name[1] != '.')
+    {
+        n = strlen(a->scope);
+        memcpy(out, a->scope, n);
+    }
+    size_t m = strlen(name);
+    if (m > NAME_LEN - 1 - n) m = NAME_LEN - 1 - n;
+    memcpy(out + n, name, m);
+    out[n + m] = 0;
+}
+
+// Define a label of section (SEC_*) or, with section -1, an equ constant
+static void define_symbol(Asm *a, const char *name, int64_t value, int section)
+{
+    char full[NAME_LEN];
+    full_name(a, name, full);
+    Symbol *s = symbol_slot(a, full);
+    if (!s)
+    {
+        asm_error(a, "out of memory");
+        return;
+    }
+    if (s->pass == a->pass)
+    {
+        asm_error(a, "symbol `%s' redefined", full);
+        return;
+    }
+    if (s->pass == 0 || s->value != value) a->changed = 1;
+    if (s->pass && section >= 0 && s->section == section) a->drift[section] = value - s->value;
+    s->value = value;
+    s->pass = a->pass;
+    s->section = section;
+}
+
+// ---------------------------------------------------------------------------
+// Output
+// ---------------------------------------------------------------------------
+
+static int64_t here(const Asm *a)
+{
+    return a->base[a->section] + (int64_t)a->sec[a->section].size;
+}
+
+// Reserve n bytes in the current section, zeroed outside .bss
+static uint8_t *reserve(Asm *a, size_t n)
+{
+    static uint8_t scratch[16];
+    SectionBuf *s = &a->sec[a->section];
+    if (n > OUTPUT_MAX - s->size)
+    {
+        asm_error(a, "program larger than 64 KiB");
+        return n <= sizeof(scratch) ? scratch : NULL;
+    }
+    if (a->section == SEC_BSS)
+    {
+        s->size += n;
+        return NULL;
+    }
+    if (s->size + n > s->cap)
+    {
+        size_t cap = s->cap ? s->cap : 256;
+        while (cap < s->size + n) cap *= 2;
+        uint8_t *data = realloc(s->data, cap);
+        if (!data)
+        {
+            asm_error(a, "out of memory");
+            return n <= sizeof(scratch) ? scratch : NULL;
+        }
+        s->data = data;
+        s->cap = cap;
+    }
+    uint8_t *p = s->data + s->size;
+    memset(p, 0, n);
+    s->size += n;
+    return p;
+}
+
+static void emit8(Asm *a, int64_t v)
+{
+    if (a->section == SEC_BSS)
+    {
+        asm_error(a, "only reserving space is allowed in .bss");
+        return;
+    }
+    uint8_t *p = reserve(a, 1);
+    if (p) p[0] = (uint8_t)v;
+}
+
+static void emit16(Asm *a, int64_t v)
+{
+    emit8(a, v & 0xFF);
+    emit8(a, (v >> 8) & 0xFF);
+}
+
+// ---------------------------------------------------------------------------
+// Lexing
+// ---------------------------------------------------------------------------
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static const char *skip_space(const char *p)
+{
+    while (is_blank(*p)) ++p;
+    return p;
+}
+
+static int ident_start(int c)
+{
+    return isalpha(c) || c == '_' || c == '.' || c == '?' || c == '@';
+}
+
+static int ident_char(int c)
+{
+    return isalnum(c) || c == '_' || c == '.' || c == '?' || c == '@' || c == '$' || c == '#' || c == '~';
+}
+
+// Read an identifier into out (NAME_LEN). Returns its length, 0 if none.
+static size_t read_ident(const char **pp, char *out)
+{
+    const char *p = *pp;
+    if (!ident_start((uint8_t)*p)) return 0;
+    size_t n = 0;
+    while (ident_char((uint8_t)p[n])) ++n;
+    size_t keep = n < NAME_LEN ? n : NAME_LEN - 1;
+    memcpy(out, p, keep);
+    out[keep] = 0;
+    *pp = p + n;
+    return n;
+}
+
+static int name_is(const char *word, const char *name)
+{
+    for (; *word && *name; ++word, ++name)
+        if (tolower((uint8_t)*word) != *name) return 0;
+    return *word == 0 && *name == 0;
+}
+
+static int keyword_cmp(const void *key, const void *elem)
+{
+    return strcmp(key, ((const Keyword *)elem)->name);
+}
+
+// The reserved word `word' is, case-insensitively, or NULL
+static const Keyword *find_keyword(const char *word)
+{
+    char lower[KEYWORD_MAX + 1];
+    size_t n = 0;
+    for (; word[n]; ++n)
+    {
+        if (n == KEYWORD_MAX) return NULL;
+        lower[n] = (char)tolower((uint8_t)word[n]);
+    }
+    lower[n] = 0;
+    return bsearch(lower, keywords, sizeof(keywords) / sizeof(keywords[0]), sizeof(keywords[0]), keyword_cmp);
+}
+
+// Register number if word is a register of kind (K_REG8, K_REG16, K_SREG), else -1
+static int find_reg(const char *word, int kind)
+{
+    const Keyword *k = find_keyword(word);
+    return k && k->kind == kind ? k->op : -1;
+}
+
+static int is_reg(const char *word)
+{
+    const Keyword *k = find_keyword(word);
+    return k && (k->kind == K_REG8 || k->kind == K_REG16 || k->kind == K_SREG);
+}
+
+// Read a quoted string starting at **pp into out (up to cap bytes). Back
+// quotes take C escapes. Returns the length, or -1 if it is not closed.
+static long read_string(const char **pp, uint8_t *out, size_t cap)
+{
+    const char *p = *pp;
+    char q = *p++;
+    size_t n = 0;
+    while (*p && *p != q)
+    {
+        int c = (uint8_t)*p++;
+        if (q == '`' && c == '\\' && *p)
+        {
+            c = (uint8_t)*p++;
+            switch (c)
+            {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'e': c = 0x1B; break;
+            case '0': c = 0; break;
+            case 'x':
+            {
+                int v = 0, digits = 0;
+                while (digits < 2 && isxdigit((uint8_t)*p))
+                {
+                    v = v * 16 + (isdigit((uint8_t)*p) ? *p - '0' : tolower((uint8_t)*p) - 'a' + 10);
+                    ++p;
+                    ++digits;
+                }
+                c = v;
+                break;
+            }
+            }
+        }
+        if (n < cap) out[n] = (uint8_t)c;
+        ++n;
+    }
+    if (*p != q) return -1;
+    *pp = p + 1;
+    return (long)n;
+}
+
+// ---------------------------------------------------------------------------
+// Expressions (NASM precedence, 64-bit)
+// ---------------------------------------------------------------------------
+
+static int64_t expr_or(Asm *a, const char **pp);
+
+static int digit_value(int c)
+{
+    if (isdigit(c)) return c - '0';
+    if (isalpha(c)) return tolower(c) - 'a' + 10;
+    return 99;
+}
+
+static int parse_digits(const char *s, size_t len, int radix, int64_t *out)
+{
+    int64_t v = 0;
+    size_t digits = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (s[i] == '_') continue;
+        int d = digit_value((uint8_t)s[i]);
+        if (d >= radix) return 0;
+        v = v * radix + d;
+        ++digits;
+    }
+    *out = v;
+    return digits > 0;
+}
+
+static int64_t parse_number(Asm *a, const char **pp)
+{
+    const char *s = *pp;
+    size_t n = 0;
+    if (s[0] == '$') ++n;
+    while (isalnum((uint8_t)s[n]) || s[n] == '_') ++n;
+    *pp = s + n;
+    int64_t v = 0;
+    int ok;
+    char last = (char)tolower((uint8_t)s[n - 1]);
+    char second = n > 2 ? (char)tolower((uint8_t)s[1]) : 0;
+    if (s[0] == '$')
+        ok = parse_digits(s + 1, n - 1, 16, &v);
+    else if (last == 'h')
+        ok = parse_digits(s, n - 1, 16, &v);
+    else if (s[0] == '0' && (second == 'x' || second == 'h'))
+        ok = parse_digits(s + 2, n - 2, 16, &v);
+    else if (s[0] == '0' && (second == 'b' || second == 'y'))
+        ok = parse_digits(s + 2, n - 2, 2, &v);
+    else if (s[0] == '0' && (second == 'o' || second == 'q'))
+        ok = parse_digits(s + 2, n - 2, 8, &v);
+    else if (s[0] == '0' && (second == 'd' || second == 't'))
+        ok = parse_digits(s + 2, n - 2, 10, &v);
+    else if (last == 'b' || last == 'y')
+        ok = parse_digits(s, n - 1, 2, &v);
+    else if (last == 'o' || last == 'q')
+        ok = parse_digits(s, n - 1, 8, &v);
+    else if (last == 'd' || last == 't')
+        ok = parse_digits(s, n - 1, 10, &v);
+    else
+        ok = parse_digits(s, n, 10, &v);
+    if (!ok) asm_error(a, "invalid number `%.*s'", (int)n, s);
+    return v;
+}
+
+static int64_t expr_primary(Asm *a, const char **pp)
+{
+    const char *p = skip_space(*pp);
+    int64_t v = 0;
+    if (*p == '(')
+    {
+        ++p;
+        v = expr_or(a, &p);
+        p = skip_space(p);
+        if (*p == ')') ++p;
+        else asm_error(a, "expecting `)'");
+    }
+    else if (isdigit((uint8_t)*p) || (p[0] == '$' && isdigit((uint8_t)p[1])))
+    {
+        v = parse_number(a, &p);
+    }
+    else if (p[0] == '$' && p[1] == '$')
+    {
+        v = a->base[a->section];
+        p += 2;
+    }
+    else if (*p == '$')
+    {
+        v = here(a);
+        ++p;
+    }
+    else if (*p == '\'' || *p == '"' || *p == '`')
+    {
+        uint8_t chars[8];
+        long n = read_string(&p, chars, sizeof(chars));
+        if (n < 0) asm_error(a, "unterminated string");
+        else if (n > 8) asm_error(a, "character constant too long");
+        for (long i = n < 8 ? n : 8; i-- > 0;) v = v << 8 | chars[i];
+    }
+    else if (ident_start((uint8_t)*p))
+    {
+        char name[NAME_LEN], full[NAME_LEN];
+        read_ident(&p, name);
+        if (is_reg(name))
+        {
+            asm_error(a, "invalid use of register `%s'", name);
+        }
+        else
+        {
+            full_name(a, name, full);
+            Symbol *s = symbol_slot(a, full);
+            if (s && s->pass == a->pass)
+            {
+                v = s->value;
+            }
+            else if (s && s->pass)
+            {
+                // forward reference: last pass's value, moved as far as the
+                // labels before it have moved since, which saves passes
+                v = s->value + (s->section >= 0 ? a->drift[s->section] : 0);
+            }
+            else
+            {
+                a->unknown = 1;
+                a->undefined = 1;
+                if (a->final) asm_error(a, "symbol `%s' not defined", full);
+            }
+        }
+    }
+    else
+    {
+        asm_error(a, "expression syntax error");
+    }
+    *pp = p;
+    return v;
+}
+
+static int64_t expr_unary(Asm *a, const char **pp)
+{
+    const char *p = skip_space(*pp);
+    int64_t v;
+    if (*p == '-') { ++p; v = -expr_unary(a, &p); }
+    else if (*p == '+') { ++p; v = expr_unary(a, &p); }
+    else if (*p == '~') { ++p; v = ~expr_unary(a, &p); }
+    else if (*p == '!') { ++p; v = !expr_unary(a, &p); }
+    else v = expr_primary(a, &p);
+    *pp = p;
+    return v;
+}
+
+static int64_t expr_mul(Asm *a, const char **pp)
+{
+    int64_t v = expr_unary(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        char op = *p;
+        if (op != '*' && op != '/' && op != '%') break;
+        int sign = p[1] == op && op != '*'; // // and %% are the signed forms
+        p += 1 + sign;
+        int64_t r = expr_unary(a, &p);
+        *pp = p;
+        if (op == '*')
+        {
+            v *= r;
+        }
+        else if (r == 0)
+        {
+            if (!a->unknown) asm_error(a, "division by zero");
+            v = 0;
+        }
+        else if (sign)
+        {
+            v = op == '/' ? v / r : v % r;
+        }
+        else
+        {
+            v = (int64_t)(op == '/' ? (uint64_t)v / (uint64_t)r : (uint64_t)v % (uint64_t)r);
+        }
+    }
+    return v;
+}
+
+static int64_t expr_add(Asm *a, const char **pp)
+{
+    int64_t v = expr_mul(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        if (*p != '+' && *p != '-') break;
+        char op = *p++;
+        int64_t r = expr_mul(a, &p);
+        *pp = p;
+        v = op == '+' ? v + r : v - r;
+    }
+    return v;
+}
+
+static int64_t expr_shift(Asm *a, const char **pp)
+{
+    int64_t v = expr_add(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        if (!((p[0] == '<' && p[1] == '<') || (p[0] == '>' && p[1] == '>'))) break;
+        char op = *p;
+        p += 2;
+        int64_t r = expr_add(a, &p);
+        *pp = p;
+        if (r < 0 || r > 63) v = 0;
+        else v = op == '<' ? (int64_t)((uint64_t)v << r) : (int64_t)((uint64_t)v >> r);
+    }
+    return v;
+}
+
+static int64_t expr_and(Asm *a, const char **pp)
+{
+    int64_t v = expr_shift(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        if (*p != '&' || p[1] == '&') break;
+        ++p;
+        v &= expr_shift(a, &p);
+        *pp = p;
+    }
+    return v;
+}
+
+static int64_t expr_xor(Asm *a, const char **pp)
+{
+    int64_t v = expr_and(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        if (*p != '^' || p[1] == '^') break;
+        ++p;
+        v ^= expr_and(a, &p);
+        *pp = p;
+    }
+    return v;
+}
+
+static int64_t expr_or(Asm *a, const char **pp)
+{
+    int64_t v = expr_xor(a, pp);
+    for (;;)
+    {
+        const char *p = skip_space(*pp);
+        if (*p != '|' || p[1] == '|') break;
+        ++p;
+        v |= expr_xor(a, &p);
+        *pp = p;
+    }
+    return v;
+}
+
+// Evaluate an expression whose value decides what a statement emits (org,
+// times, res*, align, equ). While it uses a symbol not defined yet the
+// caller skips the statement; the last pass reports the symbol.
+static int64_t expr_known(Asm *a, const char **pp)
+{
+    a->unknown = 0;
+    return expr_or(a, pp);
+}
+
+// ---------------------------------------------------------------------------
+// Operands
+// ---------------------------------------------------------------------------
+
+// The r/m code for a set of base and index registers, -1 if invalid
+static int rm_for(int bx, int bp, int si, int di)
+{
+    if (bx + bp > 1 || si + di > 1) return -1;
+    if (bx && si) return 0;
+    if (bx && di) return 1;
+    if (bp && si) return 2;
+    if (bp && di) return 3;
+    if (si) return 4;
+    if (di) return 5;
+    if (bp) return 6;
+    if (bx) return 7;
+    return -2; // no registers: direct address
+}
+
+// [seg: base + index + displacement]; s is the text between the brackets
+static void parse_memory(Asm *a, char *s, Operand *op)
+{
+    op->kind = OP_MEM;
+    op->seg = -1;
+    const char *p = skip_space(s);
+    const char *q = p;
+    char word[NAME_LEN];
+    if (read_ident(&q, word) && find_reg(word, K_SREG) >= 0 && *skip_space(q) == ':')
+    {
+        op->seg = find_reg(word, K_SREG);
+        p = skip_space(q) + 1;
+    }
+    // Split at the top-level + and - into terms. Register terms pick the
+    // addressing mode, the rest is the displacement.
+    int regs[4] = { 0, 0, 0, 0 }; // bx bp si di
+    char disp[512];
+    size_t dlen = 0;
+    char sign = '+';
+    while (*(p = skip_space(p)))
+    {
+        const char *start = p;
+        int depth = 0;
+        char prev = 0;
+        while (*p)
+        {
+            char c = *p;
+            if (c == '\'' || c == '"' || c == '`')
+            {
+                uint8_t tmp[8];
+                if (read_string(&p, tmp, sizeof(tmp)) < 0) break;
+                prev = c;
+                continue;
+            }
+            if (c == '(') depth++;
+            else if (c == ')') depth--;
+            else if ((c == '+' || c == '-') && depth == 0 && prev &&
+                     (ident_char((uint8_t)prev) || prev == ')' || prev == '\'' || prev == '"' || prev == '`'))
+                break;
+            if (c != ' ' && c != '\t') prev = c;
+            ++p;
+        }
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) --end;
+        char term[NAME_LEN];
+        const char *t = start;
+        int r = -1;
+        if (read_ident(&t, term) && t == end) r = find_reg(term, K_REG16);
+        if (r == 3 || r == 5 || r == 6 || r == 7)
+        {
+            int slot = r == 3 ? 0 : r == 5 ? 1 : r == 6 ? 2 : 3;
+            if (sign == '-' || regs[slot]) op->rm = -1, regs[slot] = 2; // poisoned
+            else regs[slot] = 1;
+        }
+        else if (r >= 0 || (t == end && is_reg(term)))
+        {
+            regs[0] = 2;
+        }
+        else
+        {
+            // sign(term)
+            size_t n = (size_t)(end - start);
+            if (n + 3 >= sizeof(disp) - dlen)
+            {
+                asm_error(a, "effective address too long");
+                return;
+            }
+            disp[dlen++] = sign;
+            disp[dlen++] = '(';
+            memcpy(disp + dlen, start, n);
+            dlen += n;
+            disp[dlen++] = ')';
+        }
+        if (!*p) break;
+        sign = *p++;
+    }
+    if (regs[0] == 2 || regs[1] == 2 || regs[2] == 2 || regs[3] == 2 ||
+        (op->rm = rm_for(regs[0], regs[1], regs[2], regs[3])) == -1)
+    {
+        asm_error(a, "invalid effective address");
+        op->rm = -2;
+    }
+    if (op->rm == -2) op->rm = -1; // direct
+    op->value = 0;
+    a->unknown = 0;
+    if (dlen)
+    {
+        disp[dlen] = 0;
+        const char *d = disp;
+        op->value = expr_or(a, &d);
+        if (*skip_space(d)) asm_error(a, "invalid effective address");
+    }
+    op->unknown = a->unknown;
+}
+
+// Parse one operand at *pp. Returns 0 on a syntax error.
+static int parse_operand(Asm *a, const char **pp, Operand *op)
+{
+    memset(op, 0, sizeof(*op));
+    op->seg = -1;
+    const char *p = skip_space(*pp);
+    char word[NAME_LEN];
+    for (;;)
+    {
+        const char *q = p;
+        if (!read_ident(&q, word)) break;
+        const Keyword *k = find_keyword(word);
+        if (!k || k->kind != K_SIZE) break;
+        switch (k->op)
+        {
+        case SZ_BYTE: op->size = 1; break;
+        case SZ_WORD: op->size = 2; break;
+        case SZ_DWORD: op->size = 4; break;
+        case SZ_STRICT: op->strict = 1; break;
+        case SZ_SHORT: op->dist = DIST_SHORT; break;
+        case SZ_NEAR: op->dist = DIST_NEAR; break;
+        case SZ_FAR: op->dist = DIST_FAR; break;
+        }
+        p = skip_space(q);
+    }
+    if (*p == '[')
+    {
+        const char *close = strchr(p, ']');
+        if (!close)
+        {
+            asm_error(a, "expecting `]'");
+            return 0;
+        }
+        char inner[512];
+        size_t n = (size_t)(close - p - 1);
+        if (n >= sizeof(inner))
+        {
+            asm_error(a, "effective address too long");
+            return 0;
+        }
+        memcpy(inner, p + 1, n);
+        inner[n] = 0;
+        parse_memory(a, inner, op);
+        *pp = close + 1;
+        return 1;
+    }
+    const char *q = p;
+    if (read_ident(&q, word))
+    {
+        const char *after = skip_space(q);
+        const Keyword *k = *after == ',' || *after == 0 ? find_keyword(word) : NULL;
+        if (k && (k->kind == K_REG8 || k->kind == K_REG16 || k->kind == K_SREG))
+        {
+            op->kind = k->kind == K_SREG ? OP_SREG : OP_REG;
+            op->reg = k->op;
+            op->size = k->kind == K_REG8 ? 1 : 2;
+            *pp = q;
+            return 1;
+        }
+    }
+    op->kind = OP_IMM;
+    a->unknown = 0;
+    op->value = expr_or(a, &p);
+    p = skip_space(p);
+    if (*p == ':')
+    {
+        // segment:offset of a far jump or call
+        ++p;
+        op->kind = OP_FAR;
+        op->seg_value = op->value;
+        op->value = expr_or(a, &p);
+    }
+    op->unknown = a->unknown;
+    *pp = p;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Encoding
+// ---------------------------------------------------------------------------
+
+static uint8_t *grow_slot(Asm *a)
+{
+    static uint8_t none;
+    if (a->stmt >= a->grow_cap)
+    {
+        size_t cap = a->grow_cap ? a->grow_cap : 256;
+        while (cap <= a->stmt) cap *= 2;
+        uint8_t *g = realloc(a->grow, cap);
+        if (!g)
+        {
+            asm_error(a, "out of memory");
+            return &none;
+        }
+        memset(g + a->grow_cap, 0, cap - a->grow_cap);
+        a->grow = g;
+        a->grow_cap = cap;
+    }
+    return &a->grow[a->stmt];
+}
+
+// Whether the statement uses the larger encoding `flag`, switching to it for
+// good once `need` says so
+static int grown(Asm *a, uint8_t flag, int need)
+{
+    uint8_t *g = grow_slot(a);
+    if (need && !(*g & flag))
+    {
+        *g |= flag;
+        a->changed = 1;
+    }
+    return (*g & flag) != 0;
+}
+
+// Fits a sign-extended byte as a 16-bit value
+static int fits_s8(int64_t v)
+{
+    uint16_t u = (uint16_t)v;
+    return u < 0x80 || u >= 0xFF80;
+}
+
+static void emit_seg_prefix(Asm *a, const Operand *op)
+{
+    if (op->kind == OP_MEM && op->seg >= 0) emit8(a, 0x26 | op->seg << 3);
+}
+
+static void emit_modrm(Asm *a, int reg, const Operand *rm)
+{
+    if (rm->kind == OP_REG)
+    {
+        emit8(a, 0xC0 | reg << 3 | rm->reg);
+        return;
+    }
+    if (rm->rm < 0)
+    {
+        emit8(a, reg << 3 | 6);
+        emit16(a, rm->value);
+        return;
+    }
+    int need8 = rm->rm == 6 || (!rm->unknown && (uint16_t)rm->value != 0);
+    int wide = grown(a, GROW_DISP16, !rm->unknown && !fits_s8(rm->value));
+    int disp8 = !wide && grown(a, GROW_DISP8, need8);
+    emit8(a, (wide ? 0x80 : disp8 ? 0x40 : 0) | reg << 3 | rm->rm);
+    if (wide) emit16(a, rm->value);
+    else if (disp8) emit8(a, rm->value);
+}
+
+static int is_rm(const Operand *op)
+{
+    return op->kind == OP_REG || op->kind == OP_MEM;
+}
+
+// Operand size of an instruction with destination d and source s (NULL if
+// none); 0 after reporting an error
+static int operand_size(Asm *a, const Operand *d, const Operand *s)
+{
+    int dsize = d->kind == OP_REG || d->kind == OP_SREG || d->kind == OP_MEM ? d->size : 0;
+    int ssize = s && (s->kind == OP_REG || s->kind == OP_SREG || s->kind == OP_MEM) ? s->size : 0;
+    if (dsize && ssize && dsize != ssize)
+    {
+        asm_error(a, "mismatch in operand sizes");
+        return 0;
+    }
+    int size = dsize ? dsize : ssize ? ssize : s && s->kind == OP_IMM ? 0 : d->size;
+    if (!size)
+    {
+        asm_error(a, "operation size not specified");
+        return 0;
+    }
+    if (size == 4)
+    {
+        asm_error(a, "32-bit operands are not supported");
+        return 0;
+    }
+    return size;
+}
+
+static void bad_operands(Asm *a)
+{
+    asm_error(a, "invalid combination of opcode and operands");
+}
+
+static void check_short(Asm *a, const Operand *target, int64_t rel)
+{
+    if (a->final && !target->unknown && (rel < -128 || rel > 127))
+        asm_error(a, "short jump is out of range");
+}
+
+// Whether an immediate gets the sign-extended byte form
+static int imm_short(Asm *a, const Operand *imm)
+{
+    if (imm->strict && imm->size) return imm->size == 1;
+    return !grown(a, GROW_WIDE, !imm->unknown && !fits_s8(imm->value));
+}
+
+static void encode(Asm *a, const Keyword *m, Operand *ops, int n)
+{
+    Operand *d = &ops[0], *s = &ops[1];
+    switch (m->kind)
+    {
+    case K_FIXED:
+        if (n) { bad_operands(a); return; }
+        emit8(a, m->op);
+        return;
+    case K_AAM:
+        if (n > 1 || (n == 1 && d->kind != OP_IMM)) { bad_operands(a); return; }
+        emit8(a, m->op);
+        emit8(a, n ? d->value : 10);
+        return;
+    case K_ENTER:
+        if (n != 2 || d->kind != OP_IMM || s->kind != OP_IMM) { bad_operands(a); return; }
+        emit8(a, m->op);
+        emit16(a, d->value);
+        emit8(a, s->value);
+        return;
+    case K_RET:
+        if (n > 1 || (n == 1 && d->kind != OP_IMM)) { bad_operands(a); return; }
+        if (n) { emit8(a, m->op - 1); emit16(a, d->value); }
+        else emit8(a, m->op);
+        return;
+    case K_INT:
+        if (n != 1 || d->kind != OP_IMM) { bad_operands(a); return; }
+        emit8(a, m->op);
+        emit8(a, d->value);
+        return;
+    case K_ALU:
+    {
+        if (n != 2) { bad_operands(a); return; }
+        int base = m->op * 8;
+        if (is_rm(d) && s->kind == OP_REG)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, d);
+            emit8(a, base + (size == 2));
+            emit_modrm(a, s->reg, d);
+        }
+        else if (d->kind == OP_REG && s->kind == OP_MEM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, s);
+            emit8(a, base + 2 + (size == 2));
+            emit_modrm(a, d->reg, s);
+        }
+        else if (is_rm(d) && s->kind == OP_IMM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            if (size == 1 && d->kind == OP_REG && d->reg == 0)
+            {
+                emit8(a, base + 4);
+                emit8(a, s->value);
+            }
+            else if (size == 1)
+            {
+                emit_seg_prefix(a, d);
+                emit8(a, 0x80);
+                emit_modrm(a, m->op, d);
+                emit8(a, s->value);
+            }
+            else if (imm_short(a, s))
+            {
+                emit_seg_prefix(a, d);
+                emit8(a, 0x83);
+                emit_modrm(a, m->op, d);
+                emit8(a, s->value);
+            }
+            else if (d->kind == OP_REG && d->reg == 0)
+            {
+                emit8(a, base + 5);
+                emit16(a, s->value);
+            }
+            else
+            {
+                emit_seg_prefix(a, d);
+                emit8(a, 0x81);
+                emit_modrm(a, m->op, d);
+                emit16(a, s->value);
+            }
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_TEST:
+    {
+        if (n != 2) { bad_operands(a); return; }
+        if (d->kind == OP_MEM && s->kind == OP_REG)
+        {
+            Operand t = *d;
+            *d = *s;
+            *s = t;
+        }
+        if (is_rm(d) && s->kind == OP_REG)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, d);
+            emit8(a, 0x84 + (size == 2));
+            emit_modrm(a, s->reg, d);
+        }
+        else if (d->kind == OP_REG && s->kind == OP_MEM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, s);
+            emit8(a, 0x84 + (size == 2));
+            emit_modrm(a, d->reg, s);
+        }
+        else if (is_rm(d) && s->kind == OP_IMM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            if (d->kind == OP_REG && d->reg == 0)
+            {
+                emit8(a, 0xA8 + (size == 2));
+            }
+            else
+            {
+                emit_seg_prefix(a, d);
+                emit8(a, 0xF6 + (size == 2));
+                emit_modrm(a, 0, d);
+            }
+            if (size == 2) emit16(a, s->value);
+            else emit8(a, s->value);
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_GRP3:
+    {
+        if (n != 1 || !is_rm(d)) { bad_operands(a); return; }
+        int size = operand_size(a, d, NULL);
+        if (!size) return;
+        emit_seg_prefix(a, d);
+        emit8(a, 0xF6 + (size == 2));
+        emit_modrm(a, m->op, d);
+        return;
+    }
+    case K_INCDEC:
+    {
+        if (n != 1 || !is_rm(d)) { bad_operands(a); return; }
+        int size = operand_size(a, d, NULL);
+        if (!size) return;
+        if (d->kind == OP_REG && size == 2)
+        {
+            emit8(a, 0x40 + m->op * 8 + d->reg);
+            return;
+        }
+        emit_seg_prefix(a, d);
+        emit8(a, 0xFE + (size == 2));
+        emit_modrm(a, m->op, d);
+        return;
+    }
+    case K_SHIFT:
+    {
+        if (n != 2 || !is_rm(d)) { bad_operands(a); return; }
+        int size = operand_size(a, d, NULL);
+        if (!size) return;
+        if (s->kind == OP_REG && s->size == 1 && s->reg == 1) // CL
+        {
+            emit_seg_prefix(a, d);
+            emit8(a, 0xD2 + (size == 2));
+            emit_modrm(a, m->op, d);
+        }
+        else if (s->kind == OP_IMM && !s->unknown && s->value == 1)
+        {
+            emit_seg_prefix(a, d);
+            emit8(a, 0xD0 + (size == 2));
+            emit_modrm(a, m->op, d);
+        }
+        else if (s->kind == OP_IMM)
+        {
+            emit_seg_prefix(a, d);
+            emit8(a, 0xC0 + (size == 2));
+            emit_modrm(a, m->op, d);
+            emit8(a, s->value);
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_MOV:
+    {
+        if (n != 2) { bad_operands(a); return; }
+        if (d->kind == OP_SREG && (s->kind == OP_MEM || (s->kind == OP_REG && s->size == 2)))
+        {
+            if (!operand_size(a, d, s)) return;
+            if (d->reg == 1) { asm_error(a, "cannot move into CS"); return; }
+            emit_seg_prefix(a, s);
+            emit8(a, 0x8E);
+            emit_modrm(a, d->reg, s);
+        }
+        else if (s->kind == OP_SREG && (d->kind == OP_MEM || (d->kind == OP_REG && d->size == 2)))
+        {
+            if (!operand_size(a, d, s)) return;
+            emit_seg_prefix(a, d);
+            emit8(a, 0x8C);
+            emit_modrm(a, s->reg, d);
+        }
+        else if (d->kind == OP_REG && s->kind == OP_IMM)
+        {
+            emit8(a, (d->size == 2 ? 0xB8 : 0xB0) + d->reg);
+            if (d->size == 2) emit16(a, s->value);
+            else emit8(a, s->value);
+        }
+        else if (d->kind == OP_MEM && s->kind == OP_IMM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, d);
+            emit8(a, 0xC6 + (size == 2));
+            emit_modrm(a, 0, d);
+            if (size == 2) emit16(a, s->value);
+            else emit8(a, s->value);
+        }
+        else if (d->kind == OP_REG && d->reg == 0 && s->kind == OP_MEM && s->rm < 0)
+        {
+            if (!operand_size(a, d, s)) return;
+            emit_seg_prefix(a, s);
+            emit8(a, 0xA0 + (d->size == 2));
+            emit16(a, s->value);
+        }
+        else if (d->kind == OP_MEM && d->rm < 0 && s->kind == OP_REG && s->reg == 0)
+        {
+            if (!operand_size(a, d, s)) return;
+            emit_seg_prefix(a, d);
+            emit8(a, 0xA2 + (s->size == 2));
+            emit16(a, d->value);
+        }
+        else if (is_rm(d) && s->kind == OP_REG)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, d);
+            emit8(a, 0x88 + (size == 2));
+            emit_modrm(a, s->reg, d);
+        }
+        else if (d->kind == OP_REG && s->kind == OP_MEM)
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, s);
+            emit8(a, 0x8A + (size == 2));
+            emit_modrm(a, d->reg, s);
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_PUSH:
+    case K_POP:
+    {
+        int push = m->kind == K_PUSH;
+        if (n != 1) { bad_operands(a); return; }
+        if (d->kind == OP_REG && d->size == 2)
+        {
+            emit8(a, (push ? 0x50 : 0x58) + d->reg);
+        }
+        else if (d->kind == OP_SREG)
+        {
+            if (!push && d->reg == 1) { asm_error(a, "cannot pop into CS"); return; }
+            emit8(a, (push ? 0x06 : 0x07) | d->reg << 3);
+        }
+        else if (d->kind == OP_MEM && d->size != 1 && d->size != 4)
+        {
+            emit_seg_prefix(a, d);
+            emit8(a, push ? 0xFF : 0x8F);
+            emit_modrm(a, push ? 6 : 0, d);
+        }
+        else if (push && d->kind == OP_IMM)
+        {
+            if (imm_short(a, d))
+            {
+                emit8(a, 0x6A);
+                emit8(a, d->value);
+            }
+            else
+            {
+                emit8(a, 0x68);
+                emit16(a, d->value);
+            }
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_XCHG:
+    {
+        if (n != 2) { bad_operands(a); return; }
+        if (d->kind == OP_REG && s->kind == OP_REG && d->size == 2 && s->size == 2 && (d->reg == 0 || s->reg == 0))
+        {
+            emit8(a, 0x90 + (d->reg ? d->reg : s->reg));
+            return;
+        }
+        if (d->kind == OP_MEM && s->kind == OP_REG)
+        {
+            Operand t = *d;
+            *d = *s;
+            *s = t;
+        }
+        if (d->kind == OP_REG && is_rm(s))
+        {
+            int size = operand_size(a, d, s);
+            if (!size) return;
+            emit_seg_prefix(a, s);
+            emit8(a, 0x86 + (size == 2));
+            if (s->kind == OP_REG) emit_modrm(a, s->reg, d);
+            else emit_modrm(a, d->reg, s);
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_LPTR:
+        if (n != 2 || d->kind != OP_REG || d->size != 2 || s->kind != OP_MEM) { bad_operands(a); return; }
+        emit_seg_prefix(a, s);
+        emit8(a, m->op);
+        emit_modrm(a, d->reg, s);
+        return;
+    case K_JMP:
+    case K_CALL:
+    {
+        int jmp = m->kind == K_JMP;
+        if (n != 1) { bad_operands(a); return; }
+        if (d->kind == OP_FAR)
+        {
+            emit8(a, jmp ? 0xEA : 0x9A);
+            emit16(a, d->value);
+            emit16(a, d->seg_value);
+        }
+        else if (is_rm(d))
+        {
+            int far = d->dist == DIST_FAR || d->size == 4;
+            if (d->kind == OP_REG && (far || d->size != 2)) { bad_operands(a); return; }
+            emit_seg_prefix(a, d);
+            emit8(a, 0xFF);
+            emit_modrm(a, (jmp ? 4 : 2) + far, d);
+        }
+        else if (d->kind == OP_IMM && d->dist != DIST_FAR)
+        {
+            int64_t rel = d->value - (here(a) + 2);
+            int near = !jmp || d->dist == DIST_NEAR ||
+                       (d->dist != DIST_SHORT && grown(a, GROW_WIDE, !d->unknown && (rel < -128 || rel > 127)));
+            if (near)
+            {
+                emit8(a, jmp ? 0xE9 : 0xE8);
+                emit16(a, d->value - (here(a) + 2));
+            }
+            else
+            {
+                check_short(a, d, rel);
+                emit8(a, 0xEB);
+                emit8(a, rel);
+            }
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+    case K_JCC:
+    case K_LOOP:
+    {
+        if (n != 1 || d->kind != OP_IMM || d->dist == DIST_NEAR || d->dist == DIST_FAR) { bad_operands(a); return; }
+        int64_t rel = d->value - (here(a) + 2);
+        check_short(a, d, rel);
+        emit8(a, m->op);
+        emit8(a, rel);
+        return;
+    }
+    case K_IN:
+        if (n != 2 || d->kind != OP_REG || d->reg != 0) { bad_operands(a); return; }
+        if (s->kind == OP_IMM)
+        {
+            emit8(a, 0xE4 + (d->size == 2));
+            emit8(a, s->value);
+        }
+        else if (s->kind == OP_REG && s->size == 2 && s->reg == 2) // DX
+        {
+            emit8(a, 0xEC + (d->size == 2));
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    case K_OUT:
+        if (n != 2 || s->kind != OP_REG || s->reg != 0) { bad_operands(a); return; }
+        if (d->kind == OP_IMM)
+        {
+            emit8(a, 0xE6 + (s->size == 2));
+            emit8(a, d->value);
+        }
+        else if (d->kind == OP_REG && d->size == 2 && d->reg == 2)
+        {
+            emit8(a, 0xEE + (s->size == 2));
+        }
+        else
+        {
+            bad_operands(a);
+        }
+        return;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Statements
+// ---------------------------------------------------------------------------
+
+// db/dw/dd: numbers, expressions and strings (padded to the unit size)
+static void data_directive(Asm *a, const char *p, int unit)
+{
+    if (a->section == SEC_BSS)
+    {
+        asm_error(a, "only reserving space is allowed in .bss");
+        return;
+    }
+    for (;;)
+    {
+        p = skip_space(p);
+        if (!*p) return;
+        const char *after = p;
+        if (*p == '\'' || *p == '"' || *p == '`')
+        {
+            uint8_t tmp[1];
+            long n = read_string(&after, tmp, 0);
+            if (n < 0)
+            {
+                asm_error(a, "unterminated string");
+                return;
+            }
+            const char *next = skip_space(after);
+            if (*next == ',' || !*next)
+            {
+                uint8_t *out = reserve(a, (size_t)((n + unit - 1) / unit * unit));
+                const char *again = p;
+                if (out) read_string(&again, out, (size_t)n);
+                p = next;
+                if (!*p) return;
+                ++p;
+                continue;
+            }
+        }
+        a->unknown = 0;
+        int64_t v = expr_or(a, &p);
+        for (int i = 0; i < unit; ++i) emit8(a, (v >> (8 * i)) & 0xFF);
+        p = skip_space(p);
+        if (!*p) return;
+        if (*p != ',')
+        {
+            asm_error(a, "comma expected after operand");
+            return;
+        }
+        ++p;
+    }
+}
+
+static void set_section(Asm *a, const char *p)
+{
+    char name[NAME_LEN];
+    p = skip_space(p);
+    if (!read_ident(&p, name))
+    {
+        asm_error(a, "section name expected");
+        return;
+    }
+    // attributes such as align= are accepted and ignored
+    if (name_is(name, ".text") || name_is(name, ".code")) a->section = SEC_TEXT;
+    else if (name_is(name, ".data") || name_is(name, ".rodata")) a->section = SEC_DATA;
+    else if (name_is(name, ".bss")) a->section = SEC_BSS;
+    else asm_error(a, "unsupported section `%s' (use .text, .data or .bss)", name);
+}
+
+static void body(Asm *a, const char *p);
+
+// Operands of m at p, then its encoding
+static void instruction(Asm *a, const Keyword *m, const char *p)
+{
+    if (m->kind == K_PREFIX)
+    {
+        emit8(a, m->op);
+        body(a, p);
+        return;
+    }
+    Operand ops[2];
+    int n = 0;
+    p = skip_space(p);
+    while (*p)
+    {
+        if (n == 2)
+        {
+            asm_error(a, "too many operands");
+            return;
+        }
+        if (!parse_operand(a, &p, &ops[n])) return;
+        ++n;
+        p = skip_space(p);
+        if (!*p) break;
+        if (*p != ',')
+        {
+            asm_error(a, "comma, colon or end of line expected");
+            return;
+        }
+        p = skip_space(p + 1);
+        if (!*p)
+        {
+            asm_error(a, "operand expected");
+            return;
+        }
+    }
+    if (a->section == SEC_BSS)
+    {
+        asm_error(a, "only reserving space is allowed in .bss");
+        return;
+    }
+    encode(a, m, ops, n);
+}
+
+// Directive d (D_*) with its arguments at p
+static void directive(Asm *a, int d, const char *word, const char *p)
+{
+    switch (d)
+    {
+    case D_DB:
+    case D_DW:
+    case D_DD:
+        data_directive(a, p, d == D_DB ? 1 : d == D_DW ? 2 : 4);
+        return;
+    case D_RESB:
+    case D_RESW:
+    case D_RESD:
+    {
+        int64_t count = expr_known(a, &p);
+        if (count < 0 || count > OUTPUT_MAX) asm_error(a, "bad reserved size");
+        else if (!a->unknown) reserve(a, (size_t)count * (d == D_RESB ? 1 : d == D_RESW ? 2 : 4));
+        return;
+    }
+    case D_ALIGN:
+    case D_ALIGNB:
+    {
+        int64_t n = expr_known(a, &p);
+        if (a->unknown) return;
+        if (n <= 0 || (n & (n - 1)) || n > 4096)
+        {
+            asm_error(a, "alignment must be a power of two");
+            return;
+        }
+        int64_t pad = (n - (int64_t)a->sec[a->section].size % n) % n;
+        if (d == D_ALIGNB || a->section == SEC_BSS)
+            reserve(a, (size_t)pad);
+        else
+            while (pad-- > 0) emit8(a, 0x90);
+        return;
+    }
+    case D_ORG:
+    {
+        int64_t org = expr_known(a, &p);
+        if (a->unknown) return;
+        if (a->org_seen) asm_error(a, "program origin redefined");
+        else if (org < 0 || org >= OUTPUT_MAX) asm_error(a, "org out of range");
+        else
+        {
+            if (org != a->org) a->changed = 1;
+            a->org = org;
+            a->org_seen = 1;
+        }
+        return;
+    }
+    case D_SECTION:
+        set_section(a, p);
+        return;
+    case D_BITS:
+    {
+        int64_t bits = expr_known(a, &p);
+        if (!a->unknown && bits != 16) asm_error(a, "only 16-bit code is supported");
+        return;
+    }
+    case D_CPU:
+    case D_USE16:
+        return;
+    case D_GLOBAL:
+    case D_EXTERN:
+        asm_error(a, "`%s' has no meaning in a flat binary", word);
+        return;
+    case D_EQU:
+        asm_error(a, "equ needs a label");
+        return;
+    case D_TIMES:
+        asm_error(a, "`times' must start the statement");
+        return;
+    }
+}
+
+// Everything after the label and `times`: a directive or an instruction
+static void body(Asm *a, const char *p)
+{
+    char word[NAME_LEN];
+    p = skip_space(p);
+    if (!*p) return;
+    if (!read_ident(&p, word))
+    {
+        asm_error(a, "parser: instruction expected");
+        return;
+    }
+    const Keyword *k = find_keyword(word);
+    if (k && k->kind <= K_PREFIX)
+    {
+        instruction(a, k, p);
+        return;
+    }
+    if (k && k->kind == K_DIRECTIVE)
+    {
+        directive(a, k->op, word, p);
+        return;
+    }
+    if (k && k->kind == K_SREG)
+    {
+        // segment override as its own prefix, e.g. `es movsb`
+        emit8(a, 0x26 | k->op << 3);
+        body(a, p);
+        return;
+    }
+    asm_error(a, "parser: instruction expected, found `%s'", word);
+}
+
+static void statement(Asm *a, char *line)
+{
+    const char *p = skip_space(line);
+    if (!*p) return;
+    // [bits 16], [org 100h], [section .data]
+    if (*p == '[')
+    {
+        char *close = strrchr(line, ']');
+        if (close && !*skip_space(close + 1))
+        {
+            *close = 0;
+            ++p;
+        }
+    }
+    char word[NAME_LEN];
+    const char *q = p;
+    if (read_ident(&q, word))
+    {
+        const char *after = skip_space(q);
+        int colon = *after == ':';
+        if (colon || !find_keyword(word))
+        {
+            p = colon ? skip_space(after + 1) : after;
+            const char *r = p;
+            char next[NAME_LEN];
+            if (read_ident(&r, next) && name_is(next, "equ"))
+            {
+                int64_t v = expr_known(a, &r);
+                if (*skip_space(r)) asm_error(a, "junk after equ value");
+                define_symbol(a, word, v, -1);
+                return;
+            }
+            if (word[0] != '.' || word[1] == '.')
+            {
+                memcpy(a->scope, word, strlen(word) + 1);
+            }
+            define_symbol(a, word, here(a), a->section);
+        }
+    }
+    p = skip_space(p);
+    q = p;
+    if (read_ident(&q, word) && name_is(word, "times"))
+    {
+        int64_t count = expr_known(a, &q);
+        if (a->unknown) return;
+        if (count < 0)
+        {
+            asm_error(a, "TIMES value %lld is negative", (long long)count);
+            return;
+        }
+        for (int64_t i = 0; i < count && !a->line_failed; ++i)
+        {
+            size_t before = a->sec[a->section].size;
+            body(a, q);
+            if (a->sec[a->section].size == before) break; // nothing emitted, e.g. an error
+        }
+        return;
+    }
+    body(a, p);
+}
+
+// Copy line number a->line without its comment into a->line_buf
+static char *clean_line(Asm *a, const char *src, size_t len)
+{
+    if (len + 1 > a->line_cap)
+    {
+        size_t cap = a->line_cap ? a->line_cap : 256;
+        while (cap < len + 1) cap *= 2;
+        char *buf = realloc(a->line_buf, cap);
+        if (!buf) return NULL;
+        a->line_buf = buf;
+        a->line_cap = cap;
+    }
+    char quote = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        char c = src[i];
+        if (quote)
+        {
+            if (c == quote) quote = 0;
+            else if (quote == '`' && c == '\\' && i + 1 < len) a->line_buf[n++] = src[i++];
+        }
+        else if (c == '\'' || c == '"' || c == '`')
+        {
+            quote = c;
+        }
+        else if (c == ';')
+        {
+            break;
+        }
+        a->line_buf[n++] = src[i];
+    }
+    a->line_buf[n] = 0;
+    return a->line_buf;
+}
+
+static void run_pass(Asm *a, const char *src, size_t len)
+{
+    a->changed = 0;
+    a->failed = 0;
+    a->undefined = 0;
+    a->stmt = 0;
+    a->line = 0;
+    a->section = SEC_TEXT;
+    a->org_seen = 0;
+    a->scope[0] = 0;
+    for (int i = 0; i < SEC_COUNT; ++i)
+    {
+        a->sec[i].size = 0;
+        a->drift[i] = 0;
+    }
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t end = pos;
+        while (end < len && src[end] != '\n') ++end;
+        a->line++;
+        a->line_failed = 0;
+        char *line = clean_line(a, src + pos, end - pos);
+        if (!line)
+        {
+            asm_error(a, "out of memory");
+            return;
+        }
+        if (memchr(src + pos, 0, end - pos)) asm_error(a, "NUL byte in source");
+        else statement(a, line);
+        a->stmt++;
+        pos = end + 1;
+    }
+    // where the sections go next pass
+    int64_t base[SEC_COUNT];
+    base[SEC_TEXT] = a->org;
+    base[SEC_DATA] = (base[SEC_TEXT] + (int64_t)a->sec[SEC_TEXT].size + SECTION_ALIGN - 1) & ~(int64_t)(SECTION_ALIGN - 1);
+    base[SEC_BSS] = (base[SEC_DATA] + (int64_t)a->sec[SEC_DATA].size + SECTION_ALIGN - 1) & ~(int64_t)(SECTION_ALIGN - 1);
+    for (int i = 0; i < SEC_COUNT; ++i)
+    {
+        if (base[i] != a->base[i]) a->changed = 1;
+        a->base[i] = base[i];
+    }
+}
+
+int asm_assemble(const char *src, size_t len, AsmResult *res)
+{
+    memset(res, 0, sizeof(*res));
+    Asm a;
+    memset(&a, 0, sizeof(a));
+    a.res = res;
+    for (a.pass = 1;; a.pass++)
+    {
+        run_pass(&a, src, len);
+        if (a.final) break;
+        // settled, broken or out of passes: one more pass with the final
+        // values runs the checks only that pass makes (short jump range,
+        // undefined symbols) and reports the errors
+        if (!a.changed || a.failed || a.pass >= MAX_PASSES - 1) a.final = 1;
+    }
+    if (!a.failed && a.changed)
+    {
+        a.line = 0;
+        asm_error(&a, "program layout does not settle (symbols depend on their own size)");
+    }
+    if (a.nerrors > MAX_ERRORS)
+    {
+        a.failed = 1;
+        char more[64];
+        int n = snprintf(more, sizeof(more), "%d more errors\n", a.nerrors - MAX_ERRORS);
+        char *errors = realloc(res->errors, res->errors_len + (size_t)n + 1);
+        if (errors)
+        {
+            memcpy(errors + res->errors_len, more, (size_t)n + 1);
+            res->errors = errors;
+            res->errors_len += (size_t)n;
+        }
+    }
+    if (!a.failed)
+    {
+        // .text, then .data at its aligned address; .bss takes no space
+        size_t text = a.sec[SEC_TEXT].size, data = a.sec[SEC_DATA].size;
+        size_t total = data ? (size_t)(a.base[SEC_DATA] - a.base[SEC_TEXT]) + data : text;
+        if (total > OUTPUT_MAX)
+        {
+            a.line = 0;
+            asm_error(&a, "program larger than 64 KiB");
+        }
+        else if (!(res->code = calloc(1, total ? total : 1)))
+        {
+            a.failed = 1;
+        }
+        else
+        {
+            if (text) memcpy(res->code, a.sec[SEC_TEXT].data, text);
+            if (data) memcpy(res->code + (total - data), a.sec[SEC_DATA].data, data);
+            res->size = total;
+        }
+    }
+    for (int i = 0; i < SEC_COUNT; ++i) free(a.sec[i].data);
+    free(a.syms);
+    free(a.grow);
+    free(a.line_buf);
+    if (!res->code)
+    {
+        res->size = 0;
+        return 0;
+    }
+    return 1;
+}
+
+size_t asm_normalize(const char *src, size_t len, char *out)
+{
+    size_t n = 0, kept = 0;    // kept: length up to the last non-empty line
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t end = pos;
+        while (end < len && src[end] != '\n') ++end;
+        if (memchr(src + pos, 0, end - pos))
+        {
+            // keep it whole, it has to fail the same way
+            memcpy(out + n, src + pos, end - pos);
+            n += end - pos;
+            kept = n;
+        }
+        else
+        {
+            // the same split clean_line makes, then the blanks around it
+            char quote = 0;
+            size_t i = pos, stop;
+            for (; i < end; ++i)
+            {
+                char c = src[i];
+                if (quote)
+                {
+                    if (c == quote) quote = 0;
+                    else if (quote == '`' && c == '\\' && i + 1 < end) ++i;
+                }
+                else if (c == '\'' || c == '"' || c == '`')
+                {
+                    quote = c;
+                }
+                else if (c == ';')
+                {
+                    break;
+                }
+            }
+            stop = i;
+            size_t start = pos;
+            while (start < stop && is_blank(src[start])) ++start;
+            // blanks at the end of an unterminated string are part of it
+            while (!quote && stop > start && is_blank(src[stop - 1])) --stop;
+            size_t m = stop - start;
+            memcpy(out + n, src + start, m);
+            n += m;
+            if (m) kept = n;
+        }
+        if (end < len) out[n++] = '\n';
+        pos = end + 1;
+    }
+    return kept;
+}
+
+void asm_result_free(AsmResult *res)
+{
+    free(res->code);
+    free(res->errors);
+    memset(res, 0, sizeof(*res));
+}
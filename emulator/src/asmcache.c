@@ -0,0 +1,348 @@
+#include "../include/asmcache.h"
+#include "../include/log.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Entry value: u8 assembled, u32 first error line, u32 code size, code, then
+// the error messages. A file in the directory holds FILE_MAGIC, u32 key
+// length, u32 value length, key, value.
+//
+// The directory is only read by asm_cache_new, which loads it into memory,
+// and only written by a thread of the cache's own, so the thread that
+// assembles never waits for the disk.
+#define VALUE_HEADER 9
+#define FILE_MAGIC "E86A"
+#define FILE_HEADER 12
+#define FILE_SUFFIX ".e86a"
+
+// An entry waiting for the writer thread
+typedef struct PendingWrite
+{
+    struct PendingWrite *next;
+    size_t key_len, value_len;
+    uint8_t data[];              // key, then value
+} PendingWrite;
+
+struct AsmCache
+{
+    LruCache *lru;
+    char *dir;                   // NULL: memory only
+    uint64_t disk_loaded;
+    atomic_uint_least64_t disk_writes;
+
+    // writer thread, only with a directory
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    PendingWrite *head, *tail;   // guarded by lock
+    size_t pending_bytes;        // guarded by lock
+    size_t max_pending;          // writes beyond this are dropped
+    int stopping;                // guarded by lock
+    int writer_started;
+    int disk_failed;             // writer thread only: a write failed, logged once
+};
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// FNV-1a, names the entry's file
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// dir/<hash>.e86a, or NULL if out of memory
+static char *file_path(const AsmCache *c, const uint8_t *key, size_t key_len, const char *suffix)
+{
+    size_t n = strlen(c->dir) + 32;
+    char *path = malloc(n);
+    if (path)
+        snprintf(path, n, "%s/%016llx" FILE_SUFFIX "%s", c->dir, (unsigned long long)hash_bytes(key, key_len), suffix);
+    return path;
+}
+
+// Load one entry file into the memory cache; files of another ASM_VERSION
+// and damaged ones are skipped
+static void disk_load(AsmCache *c, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return;
+    uint8_t head[FILE_HEADER];
+    if (fread(head, 1, FILE_HEADER, f) == FILE_HEADER && memcmp(head, FILE_MAGIC, 4) == 0 &&
+        get32(head + 4) >= 4 && get32(head + 8) >= VALUE_HEADER)
+    {
+        size_t key_len = get32(head + 4);
+        size_t n = key_len + get32(head + 8);
+        uint8_t *buf = malloc(n + 1);
+        // one byte more, to tell a complete file from a longer one
+        if (buf && fread(buf, 1, n + 1, f) == n && get32(buf + key_len - 4) == ASM_VERSION &&
+            (!buf[key_len] || get32(buf + key_len + 5) == n - key_len - VALUE_HEADER) &&
+            lru_put(c->lru, buf, key_len, buf + key_len, n - key_len))
+            c->disk_loaded++;
+        free(buf);
+    }
+    fclose(f);
+}
+
+static void disk_load_all(AsmCache *c)
+{
+    DIR *d = opendir(c->dir);
+    if (!d)
+    {
+        EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "cannot read the assembly cache directory %s", c->dir);
+        return;
+    }
+    size_t suffix_len = strlen(FILE_SUFFIX);
+    for (struct dirent *e; (e = readdir(d));)
+    {
+        size_t n = strlen(e->d_name);
+        if (n <= suffix_len || strcmp(e->d_name + n - suffix_len, FILE_SUFFIX) != 0)
+            continue;
+        size_t len = strlen(c->dir) + n + 2;
+        char *path = malloc(len);
+        if (!path)
+            break;
+        snprintf(path, len, "%s/%s", c->dir, e->d_name);
+        disk_load(c, path);
+        free(path);
+    }
+    closedir(d);
+}
+
+// Written under a temporary name and renamed, so readers (another server
+// sharing the directory as it starts) never see half a file
+static int disk_put(const AsmCache *c, const uint8_t *key, size_t key_len, const uint8_t *value, size_t value_len)
+{
+    char *path = file_path(c, key, key_len, "");
+    char *tmp = file_path(c, key, key_len, ".tmp");
+    int ok = 0;
+    FILE *f = path && tmp ? fopen(tmp, "wb") : NULL;
+    if (f)
+    {
+        uint8_t head[FILE_HEADER];
+        memcpy(head, FILE_MAGIC, 4);
+        put32(head + 4, (uint32_t)key_len);
+        put32(head + 8, (uint32_t)value_len);
+        ok = fwrite(head, 1, FILE_HEADER, f) == FILE_HEADER && fwrite(key, 1, key_len, f) == key_len &&
+             fwrite(value, 1, value_len, f) == value_len;
+        ok = fclose(f) == 0 && ok;
+        if (ok)
+        {
+            remove(path); // rename does not replace files on Windows
+            ok = rename(tmp, path) == 0;
+        }
+        if (!ok)
+            remove(tmp);
+    }
+    free(path);
+    free(tmp);
+    return ok;
+}
+
+// Writes the queued entries until asm_cache_free, which it waits for to
+// drain the queue
+static void *writer_main(void *arg)
+{
+    AsmCache *c = arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;)
+    {
+        while (!c->head && !c->stopping)
+            pthread_cond_wait(&c->wake, &c->lock);
+        PendingWrite *w = c->head;
+        if (!w)
+            break;
+        c->head = w->next;
+        if (!c->head)
+            c->tail = NULL;
+        c->pending_bytes -= w->key_len + w->value_len;
+        pthread_mutex_unlock(&c->lock);
+
+        if (disk_put(c, w->data, w->key_len, w->data + w->key_len, w->value_len))
+        {
+            atomic_fetch_add(&c->disk_writes, 1);
+        }
+        else if (!c->disk_failed)
+        {
+            c->disk_failed = 1;
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "cannot write to the assembly cache directory %s", c->dir);
+        }
+        free(w);
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Hand an entry to the writer thread. Dropped if the disk has fallen too
+// far behind; it is still in memory and written the next time it is missed.
+static void disk_queue(AsmCache *c, const uint8_t *key, size_t key_len, const uint8_t *value, size_t value_len)
+{
+    PendingWrite *w = malloc(sizeof(*w) + key_len + value_len);
+    if (!w)
+        return;
+    w->next = NULL;
+    w->key_len = key_len;
+    w->value_len = value_len;
+    memcpy(w->data, key, key_len);
+    memcpy(w->data + key_len, value, value_len);
+    pthread_mutex_lock(&c->lock);
+    if (c->pending_bytes + key_len + value_len > c->max_pending)
+    {
+        pthread_mutex_unlock(&c->lock);
+        free(w);
+        return;
+    }
+    if (c->tail)
+        c->tail->next = w;
+    else
+        c->head = w;
+    c->tail = w;
+    c->pending_bytes += key_len + value_len;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
+AsmCache *asm_cache_new(size_t max_bytes, const char *dir)
+{
+    AsmCache *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    atomic_init(&c->disk_writes, 0);
+    if (!(c->lru = lru_new(max_bytes)) || (dir && *dir && !(c->dir = strdup(dir))))
+    {
+        asm_cache_free(c);
+        return NULL;
+    }
+    if (c->dir)
+    {
+        disk_load_all(c);
+        c->max_pending = max_bytes;
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->wake, NULL);
+        if (pthread_create(&c->writer, NULL, writer_main, c) != 0)
+        {
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "no writer thread, the assembly cache stays in memory");
+            pthread_mutex_destroy(&c->lock);
+            pthread_cond_destroy(&c->wake);
+            free(c->dir);
+            c->dir = NULL;
+        }
+        else
+        {
+            c->writer_started = 1;
+        }
+    }
+    return c;
+}
+
+void asm_cache_free(AsmCache *c)
+{
+    if (!c)
+        return;
+    if (c->writer_started)
+    {
+        pthread_mutex_lock(&c->lock);
+        c->stopping = 1;
+        pthread_cond_signal(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->writer, NULL);
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->wake);
+    }
+    lru_free(c->lru);
+    free(c->dir);
+    free(c);
+}
+
+// Fill res from a cached value; 0 if out of memory
+static int unpack(const uint8_t *v, size_t len, AsmResult *res)
+{
+    memset(res, 0, sizeof(*res));
+    size_t size = get32(v + 5);
+    if (v[0])
+    {
+        if (!(res->code = malloc(size ? size : 1)))
+            return 0;
+        memcpy(res->code, v + VALUE_HEADER, size);
+        res->size = size;
+        return 1;
+    }
+    res->error_line = (int)get32(v + 1);
+    res->errors_len = len - VALUE_HEADER;
+    if (!(res->errors = malloc(res->errors_len + 1)))
+        return 0;
+    memcpy(res->errors, v + VALUE_HEADER, res->errors_len);
+    res->errors[res->errors_len] = 0;
+    return 1;
+}
+
+int asm_cache_assemble(AsmCache *c, const char *src, size_t len, AsmResult *res)
+{
+    // the canonical source and ASM_VERSION
+    uint8_t *key = malloc(len + 4);
+    if (!key)
+        return asm_assemble(src, len, res);
+    size_t key_len = asm_normalize(src, len, (char*)key);
+    put32(key + key_len, ASM_VERSION);
+    key_len += 4;
+
+    size_t value_len;
+    const uint8_t *v = lru_get(c->lru, key, key_len, &value_len);
+    if (v)
+    {
+        int ok = unpack(v, value_len, res);
+        free(key);
+        return ok && res->code;
+    }
+    int ok = asm_assemble(src, len, res);
+    if (!ok && !res->errors)
+    {
+        free(key); // out of memory, nothing worth keeping
+        return 0;
+    }
+    size_t body = ok ? res->size : res->errors_len;
+    uint8_t *value = malloc(VALUE_HEADER + body);
+    if (value)
+    {
+        value[0] = (uint8_t)ok;
+        put32(value + 1, (uint32_t)res->error_line);
+        put32(value + 5, ok ? (uint32_t)res->size : 0);
+        memcpy(value + VALUE_HEADER, ok ? (const void*)res->code : (const void*)res->errors, body);
+        lru_put(c->lru, key, key_len, value, VALUE_HEADER + body);
+        if (c->dir)
+            disk_queue(c, key, key_len, value, VALUE_HEADER + body);
+        free(value);
+    }
+    free(key);
+    return ok;
+}
+
+void asm_cache_stats(const AsmCache *c, AsmCacheStats *out)
+{
+    lru_stats(c->lru, &out->mem);
+    out->disk_loaded = c->disk_loaded;
+    out->disk_writes = atomic_load(&c->disk_writes);
+}
@@ -1,28 +1,71 @@
 #include "../include/cpu.h"
 #include "../include/memory.h"
+#include "../include/log.h"
 
 #include <stdio.h>
-#define OUTPUT_SIZE 65536
-char emu_output[OUTPUT_SIZE];
-size_t emu_out_pos = 0;
-static uint16_t override_value = 0;
+#include <string.h>
 
-void emu_putchar(char c)
+void emu_set_output_sink(EmuOutput *out, EmuOutputSink sink, void *ctx)
 {
-    if (emu_out_pos < OUTPUT_SIZE - 1)
+    out->sink = sink;
+    out->sink_ctx = ctx;
+}
+
+void emu_output_reset(EmuOutput *out)
+{
+    out->pos = 0;
+    out->data[0] = 0;
+}
+
+void emu_putchar(EmuOutput *out, char c)
+{
+    // with a sink attached a full buffer is drained instead of truncated
+    if (out->sink && out->pos == EMU_OUTPUT_SIZE - 1)
+        emu_output_flush(out);
+    if (out->pos < EMU_OUTPUT_SIZE - 1)
     {
-        emu_output[emu_out_pos++] = c;
-        emu_output[emu_out_pos] = 0; // keep buffer NUL-terminated
+        out->data[out->pos++] = c;
+        out->data[out->pos] = 0; // keep buffer NUL-terminated
     }
 }
 
-void emu_puts(const char *s)
+void emu_puts(EmuOutput *out, const char *s)
 {
     while (*s)
-        emu_putchar(*s++);
+        emu_putchar(out, *s++);
 }
 
-void emu_output_flush() { emu_output[emu_out_pos] = 0; }
+// Bulk version of emu_putchar for block writes (INT 21h AH=40h on stdout)
+void emu_write(EmuOutput *out, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t room = EMU_OUTPUT_SIZE - 1 - out->pos;
+        if (room == 0)
+        {
+            if (!out->sink)
+                break; // truncate like emu_putchar
+            emu_output_flush(out);
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(out->data + out->pos, data, n);
+        out->pos += n;
+        data += n;
+        len -= n;
+    }
+    out->data[out->pos] = 0;
+}
+
+void emu_output_flush(EmuOutput *out)
+{
+    if (out->sink && out->pos > 0)
+    {
+        out->sink(out->sink_ctx, out->data, out->pos);
+        out->pos = 0;
+    }
+    out->data[out->pos] = 0;
+}
 
 void cpu_init(CPU8086 *cpu)
 {
@@ -32,6 +75,272 @@ void cpu_init(CPU8086 *cpu)
     cpu->flags = 0x0000; // thodangumbo ella flag um clear cheyan
     cpu->cs = 0x0000;    // CS:IP -> FFFF:0000 (just for testing i put 0000)
     cpu->ds = cpu->es = cpu->ss = 0;
+    cpu->input = NULL;
+    cpu->ports = NULL;
+    cpu->dos = NULL;
+    cpu->video = NULL;
+    cpu->rep_prefix = 0;
+    cpu->segment_override = 0;
+    cpu->override_value = 0;
+    cpu->traced_start = 0;
+    cpu->stop_reason = CPU_RUNNING;
+    cpu->exit_code = 0;
+    cpu->bad_opcode = 0;
+    emu_output_reset(&cpu->out);
+    emu_set_output_sink(&cpu->out, NULL, NULL);
+}
+
+// Blocking keyboard read. There is nobody to wait for, so once the scripted
+// input runs out we answer like DOS does at the end of redirected input (^Z).
+static uint8_t kbd_read(CPU8086 *cpu)
+{
+    int c = cpu->input ? input_getc(cpu->input) : INPUT_EOF;
+    return c == INPUT_EOF ? 0x1A : (uint8_t)c;
+}
+
+static int kbd_ready(CPU8086 *cpu)
+{
+    return cpu->input && input_available(cpu->input) > 0;
+}
+
+// DOS function result: CF clear on success, CF set and AX=error code on failure
+static void dos_status(CPU8086 *cpu, int err)
+{
+    if (err)
+    {
+        cpu->flags |= FLAG_CF;
+        cpu->ax = (uint16_t)err;
+    }
+    else
+        cpu->flags &= ~FLAG_CF;
+}
+
+// Guest bytes seg:off..+count as one host pointer, or NULL if they straddle the end of memory
+static uint8_t *guest_span(Memory8086 *mem, uint16_t seg, uint16_t off, uint32_t count)
+{
+    uint32_t phys = ((uint32_t)seg << 4) + off;
+    if (phys + count > MEMORY_SIZE)
+        return NULL;
+    return &mem->data[phys];
+}
+
+// ASCIZ file name at DS:DX
+static void dos_read_path(CPU8086 *cpu, Memory8086 *mem, char *out, size_t size)
+{
+    uint32_t p = ((uint32_t)cpu->ds << 4) + cpu->dx;
+    size_t i = 0;
+    for (; i + 1 < size; ++i)
+    {
+        out[i] = (char)mem_read8(mem, p + i);
+        if (!out[i])
+            break;
+    }
+    out[i] = 0;
+}
+
+// AH=3Fh: read CX bytes from handle BX into DS:DX
+static void dos_read_handle(CPU8086 *cpu, Memory8086 *mem)
+{
+    uint16_t handle = cpu->bx, count = cpu->cx, done = 0;
+    uint32_t dst = ((uint32_t)cpu->ds << 4) + cpu->dx;
+    if (handle <= 2)
+    {
+        // CON: one line of scripted input, Enter arrives as CR LF
+        while (done < count)
+        {
+            int c = cpu->input ? input_getc(cpu->input) : INPUT_EOF;
+            if (c == INPUT_EOF)
+                break;
+            mem_write8(mem, dst + done++, (uint8_t)c);
+            if (c == '\r')
+            {
+                if (done < count)
+                    mem_write8(mem, dst + done++, '\n');
+                break;
+            }
+        }
+    }
+    else if (handle >= DOSFS_FIRST_HANDLE)
+    {
+        if (!cpu->dos)
+        {
+            dos_status(cpu, DOSERR_INVALID_HANDLE);
+            return;
+        }
+        uint8_t *span = guest_span(mem, cpu->ds, cpu->dx, count);
+        int err;
+        if (span)
+        {
+            err = dosfs_read(cpu->dos, handle, span, count, &done);
+            mem_mark_written(mem, dst, done);
+        }
+        else
+        {
+            uint8_t tmp[512];
+            uint16_t n = 0;
+            err = 0;
+            while (!err && done < count)
+            {
+                uint16_t left = count - done;
+                uint16_t want = left < (uint16_t)sizeof(tmp) ? left : (uint16_t)sizeof(tmp);
+                err = dosfs_read(cpu->dos, handle, tmp, want, &n);
+                for (uint16_t i = 0; i < n; ++i)
+                    mem_write8(mem, dst + done + i, tmp[i]);
+                done += n;
+                if (n < want)
+                    break;
+            }
+        }
+        if (err)
+        {
+            dos_status(cpu, err);
+            return;
+        }
+    }
+    // AUX/PRN (3, 4) have nothing to read
+    cpu->ax = done;
+    dos_status(cpu, 0);
+}
+
+// AH=40h: write CX bytes from DS:DX to handle BX
+static void dos_write_handle(CPU8086 *cpu, Memory8086 *mem)
+{
+    uint16_t handle = cpu->bx, count = cpu->cx, done = count;
+    uint8_t *span = guest_span(mem, cpu->ds, cpu->dx, count);
+    uint32_t src = ((uint32_t)cpu->ds << 4) + cpu->dx;
+    if (handle <= 2)
+    {
+        // CON: straight into the output sink
+        if (span)
+            emu_write(&cpu->out, (const char *)span, count);
+        else
+            for (uint16_t i = 0; i < count; ++i)
+                emu_putchar(&cpu->out, (char)mem_read8(mem, src + i));
+    }
+    else if (handle >= DOSFS_FIRST_HANDLE)
+    {
+        if (!cpu->dos)
+        {
+            dos_status(cpu, DOSERR_INVALID_HANDLE);
+            return;
+        }
+        int err;
+        if (span)
+            err = dosfs_write(cpu->dos, handle, span, count, &done);
+        else
+        {
+            uint8_t tmp[512] = { 0 };
+            uint16_t n = 0;
+            done = 0;
+            err = count == 0 ? dosfs_write(cpu->dos, handle, tmp, 0, &n) : 0;
+            while (!err && done < count)
+            {
+                uint16_t left = count - done;
+                uint16_t want = left < (uint16_t)sizeof(tmp) ? left : (uint16_t)sizeof(tmp);
+                for (uint16_t i = 0; i < want; ++i)
+                    tmp[i] = mem_read8(mem, src + done + i);
+                err = dosfs_write(cpu->dos, handle, tmp, want, &n);
+                done += n;
+            }
+        }
+        if (err)
+        {
+            dos_status(cpu, err);
+            return;
+        }
+    }
+    // AUX/PRN (3, 4) swallow everything
+    cpu->ax = done;
+    dos_status(cpu, 0);
+}
+
+// INT 10h. Without a VideoState only teletype output is kept, and it goes
+// to the output buffer like DOS console writes.
+static void bios_video(CPU8086 *cpu, Memory8086 *mem)
+{
+    uint8_t ah = cpu->ax >> 8, al = cpu->ax & 0xFF;
+    uint8_t bl = cpu->bx & 0xFF, bh = cpu->bx >> 8;
+    VideoState *v = cpu->video;
+    if (!v)
+    {
+        if (ah == 0x0E)
+            emu_putchar(&cpu->out, (char)al);
+        else if (ah == 0x0F)
+            cpu->ax = (TEXT_COLS << 8) | 0x03;
+        return;
+    }
+    switch (ah)
+    {
+    case 0x00: // Set mode, bit 7 of AL keeps the screen contents
+        video_set_mode(v, mem, al & 0x7F, !(al & 0x80));
+        break;
+    case 0x01: // Cursor shape (not modelled)
+    case 0x05: // Active page (only page 0 exists)
+        break;
+    case 0x02: // Set cursor to DH,DL
+        video_set_cursor(v, mem, cpu->dx >> 8, cpu->dx & 0xFF);
+        break;
+    case 0x03: // Get cursor: DH,DL and shape in CX
+        cpu->dx = (uint16_t)((v->cursor_row << 8) | v->cursor_col);
+        cpu->cx = 0x0607;
+        break;
+    case 0x06: // Scroll window CH,CL..DH,DL up by AL lines with attribute BH
+    case 0x07: // ... or down; in graphics modes BH is the fill colour
+        if (video_is_graphics(v))
+            video_scroll_gfx(v, mem, ah == 0x06, al, bh, cpu->cx >> 8, cpu->cx & 0xFF,
+                             cpu->dx >> 8, cpu->dx & 0xFF);
+        else
+            video_scroll(mem, ah == 0x06, al, bh, cpu->cx >> 8, cpu->cx & 0xFF,
+                         cpu->dx >> 8, cpu->dx & 0xFF);
+        break;
+    case 0x08: // Read char/attr at the cursor
+        cpu->ax = video_is_graphics(v) ? 0 : video_read_cell(v, mem);
+        break;
+    case 0x09: // Write char AL with attr BL, CX times
+        video_write_chars(v, mem, al, bl, cpu->cx);
+        break;
+    case 0x0A: // Write char AL CX times, attributes untouched
+        video_write_chars(v, mem, al, -1, cpu->cx);
+        break;
+    case 0x0B: // CGA palette
+        video_set_palette(v, bh, bl);
+        break;
+    case 0x0C: // Write pixel AL at CX,DX
+        video_put_pixel(v, mem, cpu->cx, cpu->dx, al);
+        break;
+    case 0x0D: // Read pixel at CX,DX into AL
+        cpu->ax = (cpu->ax & 0xFF00) | video_get_pixel(v, mem, cpu->cx, cpu->dx);
+        break;
+    case 0x0E: // Teletype; the text also goes to the output buffer
+        video_teletype(v, mem, al, -1);
+        emu_putchar(&cpu->out, (char)al);
+        break;
+    case 0x0F: // Get mode: AL mode, AH columns, BH page
+        cpu->ax = (uint16_t)((video_columns(v) << 8) | v->mode);
+        cpu->bx &= 0x00FF;
+        break;
+    case 0x13: // Write string ES:BP, CX chars at DH,DL; AL bit 0 moves the cursor, bit 1 interleaves attributes
+    {
+        uint8_t save_row = v->cursor_row, save_col = v->cursor_col;
+        uint32_t p = ((uint32_t)cpu->es << 4) + cpu->bp;
+        video_set_cursor(v, mem, cpu->dx >> 8, cpu->dx & 0xFF);
+        for (uint16_t i = 0; i < cpu->cx; ++i)
+        {
+            uint8_t ch = mem_read8(mem, p++);
+            int attr = bl;
+            if (al & 0x02)
+                attr = mem_read8(mem, p++);
+            video_teletype(v, mem, ch, attr);
+            emu_putchar(&cpu->out, (char)ch);
+        }
+        if (!(al & 0x01))
+            video_set_cursor(v, mem, save_row, save_col);
+        break;
+    }
+    default:
+        EMU_LOG(LOG_CAT_BIOS, LOG_DEBUG, "INT10 AH=%02X not implemented", ah);
+        break;
+    }
 }
 
 // Decode ModR/M
@@ -68,6 +377,17 @@ static uint32_t calc_ea(CPU8086 *cpu, uint8_t rm, int16_t disp)
     }
 }
 
+// Physical base of the segment a memory operand lives in: the override prefix
+// if one is pending, SS for BP-based addressing, DS otherwise
+static uint32_t ea_segment_base(CPU8086 *cpu, uint8_t mod, uint8_t rm, int overridden)
+{
+    if (overridden)
+        return (uint32_t)cpu->override_value << 4;
+    if (rm == 2 || rm == 3 || (rm == 6 && mod != 0))
+        return (uint32_t)cpu->ss << 4;
+    return (uint32_t)cpu->ds << 4;
+}
+
 // setting the zero flag
 static void set_zf(CPU8086 *cpu, uint16_t result)
 {
@@ -198,17 +518,13 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     uint32_t addr = (cpu->cs << 4) + cpu->ip;
     uint8_t opcode = mem_read8(mem, addr);
     // One-time trace when starting a program at 0000:0100
-    static int traced_start = 0;
-    if (!traced_start && cpu->cs == 0x0000 && cpu->ip == 0x0100)
+    if (LOG_ENABLED(LOG_CAT_CPU, LOG_DEBUG) && !cpu->traced_start && cpu->cs == 0x0000 && cpu->ip == 0x0100)
     {
-        traced_start = 1;
-        fprintf(stderr, "[trace] start bytes at 0000:0100:");
+        cpu->traced_start = 1;
+        char bytes[12 * 3 + 1];
         for (int i = 0; i < 12; ++i)
-        {
-            uint8_t b = mem_read8(mem, addr + i);
-            fprintf(stderr, " %02X", b);
-        }
-        fprintf(stderr, "\n");
+            snprintf(bytes + i * 3, 4, " %02X", mem_read8(mem, addr + i));
+        EMU_LOG(LOG_CAT_CPU, LOG_DEBUG, "start bytes at 0000:0100:%s", bytes);
     }
     uint16_t *reg_table[8] = {
         &cpu->ax,
@@ -231,35 +547,33 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     ((uint8_t *)&cpu->dx) + 1, // DH
     ((uint8_t *)&cpu->bx) + 1, // BH
     };
-    static int rep_prefix = 0;
-    static int segment_override = 0;
 
     // Segment override prefix
     if (opcode == 0x26)
     {
-        segment_override = 1;
-        override_value = cpu->es;
+        cpu->segment_override = 1;
+        cpu->override_value = cpu->es;
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0x2E)
     {
-        segment_override = 1;
-        override_value = cpu->cs;
+        cpu->segment_override = 1;
+        cpu->override_value = cpu->cs;
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0x36)
     {
-        segment_override = 1;
-        override_value = cpu->ss;
+        cpu->segment_override = 1;
+        cpu->override_value = cpu->ss;
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0x3E)
     {
-        segment_override = 1;
-        override_value = cpu->ds;
+        cpu->segment_override = 1;
+        cpu->override_value = cpu->ds;
         cpu->ip += 1;
         return 1;
     }
@@ -267,13 +581,13 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     // REP/REPNZ
     if (opcode == 0xF2)
     {
-        rep_prefix = 2;
+        cpu->rep_prefix = 2;
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0xF3)
     {
-        rep_prefix = 1;
+        cpu->rep_prefix = 1;
         cpu->ip += 1;
         return 1;
     }
@@ -299,81 +613,81 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     // MOVSW
     if (opcode == 0xA5)
     {
-        uint16_t src_seg = segment_override ? override_value : cpu->ds;
+        uint16_t src_seg = cpu->segment_override ? cpu->override_value : cpu->ds;
         uint16_t val = mem_read16(mem, (src_seg << 4) + cpu->si);
         mem_write16(mem, (cpu->es << 4) + cpu->di, val);
         int inc = (cpu->flags & 0x400) ? -2 : 2;
         cpu->si += inc;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // MOVSB
     if (opcode == 0xA4)
     {
-        uint16_t src_seg = segment_override ? override_value : cpu->ds;
+        uint16_t src_seg = cpu->segment_override ? cpu->override_value : cpu->ds;
         uint8_t val = mem_read8(mem, (src_seg << 4) + cpu->si);
         mem_write8(mem, (cpu->es << 4) + cpu->di, val);
         int inc = (cpu->flags & 0x400) ? -1 : 1;
         cpu->si += inc;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // LODSW
     if (opcode == 0xAD)
     {
-        uint16_t src_seg = segment_override ? override_value : cpu->ds;
+        uint16_t src_seg = cpu->segment_override ? cpu->override_value : cpu->ds;
         cpu->ax = mem_read16(mem, (src_seg << 4) + cpu->si);
         int inc = (cpu->flags & 0x400) ? -2 : 2;
         cpu->si += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // LODSB
     if (opcode == 0xAC)
     {
-        uint16_t src_seg = segment_override ? override_value : cpu->ds;
+        uint16_t src_seg = cpu->segment_override ? cpu->override_value : cpu->ds;
         ((uint8_t *)&cpu->ax)[0] = mem_read8(mem, (src_seg << 4) + cpu->si);
         int inc = (cpu->flags & 0x400) ? -1 : 1;
         cpu->si += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // STOSW
@@ -383,15 +697,15 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int inc = (cpu->flags & 0x400) ? -2 : 2;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // STOSB
@@ -401,15 +715,15 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int inc = (cpu->flags & 0x400) ? -1 : 1;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             if (cpu->cx)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // SCASW
@@ -426,20 +740,20 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int inc = (cpu->flags & 0x400) ? -2 : 2;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             int repeat = 0;
-            if (rep_prefix == 1)
+            if (cpu->rep_prefix == 1)
                 repeat = (cpu->flags & FLAG_ZF);
-            else if (rep_prefix == 2)
+            else if (cpu->rep_prefix == 2)
                 repeat = !(cpu->flags & FLAG_ZF);
             if (cpu->cx && repeat)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // SCASB
@@ -456,20 +770,20 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int inc = (cpu->flags & 0x400) ? -1 : 1;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             int repeat = 0;
-            if (rep_prefix == 1)
+            if (cpu->rep_prefix == 1)
                 repeat = (cpu->flags & FLAG_ZF);
-            else if (rep_prefix == 2)
+            else if (cpu->rep_prefix == 2)
                 repeat = !(cpu->flags & FLAG_ZF);
             if (cpu->cx && repeat)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // CMPSW
@@ -488,20 +802,20 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         cpu->si += inc;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             int repeat = 0;
-            if (rep_prefix == 1)
+            if (cpu->rep_prefix == 1)
                 repeat = (cpu->flags & FLAG_ZF);
-            else if (rep_prefix == 2)
+            else if (cpu->rep_prefix == 2)
                 repeat = !(cpu->flags & FLAG_ZF);
             if (cpu->cx && repeat)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // CMPSB
@@ -520,20 +834,20 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         cpu->si += inc;
         cpu->di += inc;
         cpu->ip += 1;
-        if (rep_prefix && cpu->cx)
+        if (cpu->rep_prefix && cpu->cx)
         {
             cpu->cx--;
             int repeat = 0;
-            if (rep_prefix == 1)
+            if (cpu->rep_prefix == 1)
                 repeat = (cpu->flags & FLAG_ZF);
-            else if (rep_prefix == 2)
+            else if (cpu->rep_prefix == 2)
                 repeat = !(cpu->flags & FLAG_ZF);
             if (cpu->cx && repeat)
                 cpu->ip -= 1;
             else
-                rep_prefix = 0;
+                cpu->rep_prefix = 0;
         }
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
     // --- Segment override prefix (stub) ---
@@ -603,13 +917,15 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             switch (ah)
             {
             case 0x0: // Program terminate (DOS)
-                emu_output_flush();
+                emu_output_flush(&cpu->out);
+                cpu->exit_code = 0;
+                cpu->stop_reason = CPU_STOP_EXIT;
                 return 0;
             case 0x2: // Print char in DL
             {
                 uint8_t dl = ((uint8_t *)&cpu->dx)[0];
-                fprintf(stderr, "[debug] INT21 AH=02 DL=0x%02X ('%c')\n", dl, (dl >= 32 && dl < 127) ? (char)dl : '.');
-                emu_putchar(dl);
+                EMU_LOG(LOG_CAT_DOS, LOG_TRACE, "INT21 AH=02 DL=0x%02X ('%c')", dl, (dl >= 32 && dl < 127) ? (char)dl : '.');
+                emu_putchar(&cpu->out, dl);
                 cpu->ip += 2;
                 return 1;
             }
@@ -621,54 +937,174 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                     char ch = mem_read8(mem, str_addr++);
                     if (ch == '$')
                         break;
-                    emu_putchar(ch);
+                    emu_putchar(&cpu->out, ch);
                 }
                 cpu->ip += 2;
                 return 1;
             }
             case 0x1:
-            { // Read char to AL (stub: return 'A')
-                ((uint8_t *)&cpu->ax)[0] = 'A';
+            { // Read char to AL with echo
+                uint8_t ch = kbd_read(cpu);
+                ((uint8_t *)&cpu->ax)[0] = ch;
+                if (ch != 0x1A)
+                    emu_putchar(&cpu->out, ch);
+                cpu->ip += 2;
+                return 1;
+            }
+            case 0x6:
+            { // Direct console I/O: DL=FF reads without waiting, otherwise prints DL
+                uint8_t dl = ((uint8_t *)&cpu->dx)[0];
+                if (dl == 0xFF)
+                {
+                    if (kbd_ready(cpu))
+                    {
+                        ((uint8_t *)&cpu->ax)[0] = kbd_read(cpu);
+                        cpu->flags &= ~FLAG_ZF;
+                    }
+                    else
+                    {
+                        ((uint8_t *)&cpu->ax)[0] = 0;
+                        cpu->flags |= FLAG_ZF;
+                    }
+                }
+                else
+                    emu_putchar(&cpu->out, dl);
+                cpu->ip += 2;
+                return 1;
+            }
+            case 0x7: // Read char to AL without echo
+            case 0x8:
+                ((uint8_t *)&cpu->ax)[0] = kbd_read(cpu);
+                cpu->ip += 2;
+                return 1;
+            case 0xA:
+            { // Buffered line input into DS:DX (max, count, chars..., CR)
+                uint32_t buf_addr = (cpu->ds << 4) + cpu->dx;
+                uint8_t max = mem_read8(mem, buf_addr);
+                uint8_t count = 0;
+                if (max > 0)
+                {
+                    for (;;)
+                    {
+                        uint8_t ch = kbd_read(cpu);
+                        if (ch == '\r' || ch == 0x1A)
+                            break;
+                        if (ch == 0x08)
+                        { // backspace edits the line like the DOS prompt does
+                            if (count > 0)
+                            {
+                                count--;
+                                emu_puts(&cpu->out, "\b \b");
+                            }
+                            continue;
+                        }
+                        if (count + 1 >= max)
+                            continue; // DOS ignores keys past the limit until Enter
+                        mem_write8(mem, buf_addr + 2 + count, ch);
+                        emu_putchar(&cpu->out, ch);
+                        count++;
+                    }
+                    mem_write8(mem, buf_addr + 2 + count, '\r');
+                    emu_putchar(&cpu->out, '\r');
+                }
+                mem_write8(mem, buf_addr + 1, count);
                 cpu->ip += 2;
                 return 1;
             }
-            case 0x3D: // Open file
-                emu_puts("[DOS] INT 21h AH=3Dh: Open file (not implemented)\n");
+            case 0xB: // Check input status: AL=FF if a key is waiting
+                ((uint8_t *)&cpu->ax)[0] = kbd_ready(cpu) ? 0xFF : 0x00;
+                cpu->ip += 2;
+                return 1;
+            case 0x3C: // Create file (CX attributes ignored)
+            {
+                char path[128];
+                uint16_t handle = 0;
+                dos_read_path(cpu, mem, path, sizeof(path));
+                int err = cpu->dos ? dosfs_create(cpu->dos, path, &handle) : DOSERR_PATH_NOT_FOUND;
+                if (!err)
+                    cpu->ax = handle;
+                dos_status(cpu, err);
                 cpu->ip += 2;
                 return 1;
+            }
+            case 0x3D: // Open file, AL = access mode
+            {
+                char path[128];
+                uint16_t handle = 0;
+                dos_read_path(cpu, mem, path, sizeof(path));
+                int err = cpu->dos ? dosfs_open(cpu->dos, path, cpu->ax & 0xFF, &handle) : DOSERR_FILE_NOT_FOUND;
+                if (!err)
+                    cpu->ax = handle;
+                dos_status(cpu, err);
+                cpu->ip += 2;
+                return 1;
+            }
             case 0x3E: // Close file
-                emu_puts("[DOS] INT 21h AH=3Eh: Close file (not implemented)\n");
+            {
+                int err = 0;
+                if (cpu->bx >= DOSFS_FIRST_HANDLE)
+                    err = cpu->dos ? dosfs_close(cpu->dos, cpu->bx) : DOSERR_INVALID_HANDLE;
+                dos_status(cpu, err);
+                cpu->ip += 2;
+                return 1;
+            }
+            case 0x3F: // Read file or device
+                dos_read_handle(cpu, mem);
                 cpu->ip += 2;
                 return 1;
-            case 0x3F: // Read file
-                emu_puts("[DOS] INT 21h AH=3Fh: Read file (not implemented)\n");
+            case 0x40: // Write file or device
+                dos_write_handle(cpu, mem);
                 cpu->ip += 2;
                 return 1;
-            case 0x40: // Write file
-                emu_puts("[DOS] INT 21h AH=40h: Write file (not implemented)\n");
+            case 0x41: // Delete file
+            {
+                char path[128];
+                dos_read_path(cpu, mem, path, sizeof(path));
+                dos_status(cpu, cpu->dos ? dosfs_delete(cpu->dos, path) : DOSERR_FILE_NOT_FOUND);
                 cpu->ip += 2;
                 return 1;
+            }
+            case 0x42: // Seek: AL = origin, CX:DX = offset, new position in DX:AX
+            {
+                uint32_t pos = 0;
+                int err = 0;
+                if (cpu->bx >= DOSFS_FIRST_HANDLE)
+                {
+                    int32_t offset = (int32_t)(((uint32_t)cpu->cx << 16) | cpu->dx);
+                    err = cpu->dos ? dosfs_seek(cpu->dos, cpu->bx, cpu->ax & 0xFF, offset, &pos) : DOSERR_INVALID_HANDLE;
+                }
+                if (!err)
+                {
+                    cpu->ax = pos & 0xFFFF;
+                    cpu->dx = pos >> 16;
+                }
+                dos_status(cpu, err);
+                cpu->ip += 2;
+                return 1;
+            }
             case 0x48: // Allocate memory
-                emu_puts("[DOS] INT 21h AH=48h: Allocate memory (not implemented)\n");
+                emu_puts(&cpu->out, "[DOS] INT 21h AH=48h: Allocate memory (not implemented)\n");
                 cpu->ip += 2;
                 return 1;
             case 0x49: // Free memory
-                emu_puts("[DOS] INT 21h AH=49h: Free memory (not implemented)\n");
+                emu_puts(&cpu->out, "[DOS] INT 21h AH=49h: Free memory (not implemented)\n");
                 cpu->ip += 2;
                 return 1;
             case 0x4A: // Resize memory block
-                emu_puts("[DOS] INT 21h AH=4Ah: Resize memory block (not implemented)\n");
+                emu_puts(&cpu->out, "[DOS] INT 21h AH=4Ah: Resize memory block (not implemented)\n");
                 cpu->ip += 2;
                 return 1;
             case 0x4C: // Exit
-                fprintf(stderr, "[debug] INT21 AH=4C exit\n");
-                emu_output_flush();
+                EMU_LOG(LOG_CAT_DOS, LOG_DEBUG, "INT21 AH=4C exit, code %u", cpu->ax & 0xFF);
+                emu_output_flush(&cpu->out);
+                cpu->exit_code = (uint8_t)(cpu->ax & 0xFF);
+                cpu->stop_reason = CPU_STOP_EXIT;
                 return 0;
             default:
             {
                 char buf[64];
                 snprintf(buf, sizeof(buf), "[DOS] INT 21h AH=%02Xh not implemented\n", ah);
-                emu_puts(buf);
+                emu_puts(&cpu->out, buf);
                 cpu->ip += 2;
                 return 1;
             }
@@ -676,13 +1112,37 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         }
         else if (int_num == 0x10)
         {
-            emu_puts("[BIOS] INT 10h: Video service (not implemented)\n");
+            bios_video(cpu, mem);
             cpu->ip += 2;
             return 1;
         }
         else if (int_num == 0x16)
         {
-            emu_puts("[BIOS] INT 16h: Keyboard service (not implemented)\n");
+            uint8_t ah = (cpu->ax >> 8) & 0xFF;
+            switch (ah)
+            {
+            case 0x00: // Wait for key: AL=ASCII, AH=scan code (not modelled)
+            case 0x10:
+                cpu->ax = kbd_read(cpu);
+                break;
+            case 0x01: // Key available? ZF=0 and AX=key if so, key stays queued
+            case 0x11:
+                if (kbd_ready(cpu))
+                {
+                    cpu->ax = (uint16_t)input_peek(cpu->input);
+                    cpu->flags &= ~FLAG_ZF;
+                }
+                else
+                    cpu->flags |= FLAG_ZF;
+                break;
+            default:
+            {
+                char buf[64];
+                snprintf(buf, sizeof(buf), "[BIOS] INT 16h AH=%02Xh not implemented\n", ah);
+                emu_puts(&cpu->out, buf);
+                break;
+            }
+            }
             cpu->ip += 2;
             return 1;
         }
@@ -750,8 +1210,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
             if (!(mod == 0 && rm == 6))
             {
-                ea = calc_ea(cpu, rm, disp);
+                ea = (uint16_t)calc_ea(cpu, rm, disp);
             }
+            ea += ea_segment_base(cpu, mod, rm, cpu->segment_override);
             if (opcode == 0x89)
             {
                 mem_write16(mem, ea, *reg_table[reg]);
@@ -762,6 +1223,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1145,7 +1607,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             uint8_t src = *reg8_table[reg];
@@ -1394,7 +1856,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip = addr + instr_len - (cpu->cs << 4);
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1405,7 +1867,6 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             if (opcode == 0x88)
@@ -1432,7 +1893,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 disp = mem_read16(mem, addr + 2);
                 instr_len += 2;
             }
-            ea = calc_ea(cpu, rm, disp);
+            if (!(mod == 0 && rm == 6))
+                ea = (uint16_t)calc_ea(cpu, rm, disp);
+            uint32_t seg = ea_segment_base(cpu, mod, rm, cpu->segment_override);
             if (opcode == 0x88)
             {
                 mem_write8(mem, seg + ea, *reg8_table[reg]);
@@ -1444,7 +1907,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1458,7 +1921,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t count = mem_read8(mem, addr + 2) & 0x1F; // only low 5 bits used
         instr_len += 1;
         int is16 = (opcode == 0xC1);
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
 
         if (mod == 3)
         {
@@ -1547,7 +2010,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1560,7 +2023,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int instr_len = 2;
         int is16 = (opcode == 0xD1 || opcode == 0xD3);
         int count = (opcode == 0xD0 || opcode == 0xD1) ? 1 : ((cpu->cx) & 0xFF);
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             if (is16)
@@ -1648,7 +2111,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1659,7 +2122,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             if (opcode == 0x86)
@@ -1709,7 +2172,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1738,7 +2201,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         }
         *reg_table[reg] = calc_ea(cpu, rm, disp);
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -1749,7 +2212,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             if (opcode == 0x84)
@@ -1803,7 +2266,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -2158,7 +2621,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
         uint16_t *seg_regs[4] = {&cpu->es, &cpu->cs, &cpu->ss, &cpu->ds};
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (mod == 3)
         {
             if (opcode == 0x8C)
@@ -2200,7 +2663,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -2214,8 +2677,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     // HLT (0xF4)
     if (opcode == 0xF4)
     {
-        emu_puts("HLT encountered - stopping emulator.\n");
-        emu_output_flush();
+        emu_puts(&cpu->out, "HLT encountered - stopping emulator.\n");
+        emu_output_flush(&cpu->out);
+        cpu->stop_reason = CPU_STOP_HALT;
         return 0;
     }
 
@@ -2340,7 +2804,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         if (reg == 3)
         {
             int instr_len = 2;
-            uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+            uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
             if (opcode == 0xF6)
             {
                 // NEG r/m8
@@ -2399,7 +2863,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 }
             }
             cpu->ip += instr_len;
-            segment_override = 0;
+            cpu->segment_override = 0;
             return 1;
         }
     }
@@ -2657,7 +3121,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             {
                 uint8_t imm8 = mem_read8(mem, addr + instr_len);
                 instr_len += 1;
-                uint8_t old8 = mem_read8(mem, (segment_override ? override_value : cpu->ds) << 4 + ea);
+                uint8_t old8 = mem_read8(mem, (cpu->segment_override ? cpu->override_value : cpu->ds) << 4 + ea);
                 /* perform byte operations similar to register case */
                 uint8_t res8 = 0;
                 switch (reg)
@@ -2766,7 +3230,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 break;
                 }
             }
-            segment_override = 0;
+            cpu->segment_override = 0;
         }
         cpu->ip += instr_len;
         return 1;
@@ -2779,10 +3243,11 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint16_t imm = mem_read16(mem, addr + instr_len);
-        instr_len += 2;
         if (mod == 3)
-            *reg_table[rm] = imm;
+        {
+            *reg_table[rm] = mem_read16(mem, addr + instr_len);
+            instr_len += 2;
+        }
         else
         {
             int16_t disp = 0;
@@ -2803,10 +3268,15 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 instr_len += 2;
             }
             if (!(mod == 0 && rm == 6))
-                ea = calc_ea(cpu, rm, disp);
+                ea = (uint16_t)calc_ea(cpu, rm, disp);
+            ea += ea_segment_base(cpu, mod, rm, cpu->segment_override);
+            // the immediate follows the displacement
+            uint16_t imm = mem_read16(mem, addr + instr_len);
+            instr_len += 2;
             mem_write16(mem, ea, imm);
         }
         cpu->ip += instr_len;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -2817,11 +3287,10 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint8_t imm8 = mem_read8(mem, addr + instr_len);
-        instr_len += 1;
         if (mod == 3)
         {
-            *reg8_table[rm] = imm8;
+            *reg8_table[rm] = mem_read8(mem, addr + instr_len);
+            instr_len += 1;
         }
         else
         {
@@ -2843,53 +3312,112 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 instr_len += 2;
             }
             if (!(mod == 0 && rm == 6))
-                ea = calc_ea(cpu, rm, disp);
+                ea = (uint16_t)calc_ea(cpu, rm, disp);
+            ea += ea_segment_base(cpu, mod, rm, cpu->segment_override);
+            // the immediate follows the displacement
+            uint8_t imm8 = mem_read8(mem, addr + instr_len);
+            instr_len += 1;
             mem_write8(mem, ea, imm8);
         }
         cpu->ip += instr_len;
+        cpu->segment_override = 0;
         return 1;
     }
 
     // --- I/O instructions (IN, OUT) ---
+    if (opcode == 0xE4)
+    { // IN AL, imm8
+        ((uint8_t *)&cpu->ax)[0] = ports_in8(cpu->ports, mem_read8(mem, addr + 1));
+        cpu->ip += 2;
+        return 1;
+    }
+    if (opcode == 0xE5)
+    { // IN AX, imm8
+        cpu->ax = ports_in16(cpu->ports, mem_read8(mem, addr + 1));
+        cpu->ip += 2;
+        return 1;
+    }
+    if (opcode == 0xEC)
+    { // IN AL, DX
+        ((uint8_t *)&cpu->ax)[0] = ports_in8(cpu->ports, cpu->dx);
+        cpu->ip += 1;
+        return 1;
+    }
     if (opcode == 0xED)
     { // IN AX, DX
-        char buf[64];
-        snprintf(buf, sizeof(buf), "IN AX, DX (port %u) not implemented\n", cpu->dx);
-        emu_puts(buf);
+        cpu->ax = ports_in16(cpu->ports, cpu->dx);
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0xE6)
     { // OUT imm8, AL
-        uint8_t port = mem_read8(mem, addr + 1);
-        char buf[64];
-        snprintf(buf, sizeof(buf), "OUT AL, port %u (value %02X) not implemented\n", port, ((uint8_t *)&cpu->ax)[0]);
-        emu_puts(buf);
+        ports_out8(cpu->ports, mem_read8(mem, addr + 1), ((uint8_t *)&cpu->ax)[0]);
         cpu->ip += 2;
         return 1;
     }
     if (opcode == 0xE7)
     { // OUT imm8, AX
-        uint8_t port = mem_read8(mem, addr + 1);
-        char buf[64];
-        snprintf(buf, sizeof(buf), "OUT AX, port %u (value %04X) not implemented\n", port, cpu->ax);
-        emu_puts(buf);
+        ports_out16(cpu->ports, mem_read8(mem, addr + 1), cpu->ax);
         cpu->ip += 2;
         return 1;
     }
     if (opcode == 0xEE)
     { // OUT DX, AL
-        char buf[64];
-        snprintf(buf, sizeof(buf), "OUT DX, AL (port %u, value %02X) not implemented\n", cpu->dx, ((uint8_t *)&cpu->ax)[0]);
-        emu_puts(buf);
+        ports_out8(cpu->ports, cpu->dx, ((uint8_t *)&cpu->ax)[0]);
         cpu->ip += 1;
         return 1;
     }
     if (opcode == 0xEF)
     { // OUT DX, AX
-        char buf[64];
-        snprintf(buf, sizeof(buf), "OUT DX, AX (port %u, value %04X) not implemented\n", cpu->dx, cpu->ax);
-        emu_puts(buf);
+        ports_out16(cpu->ports, cpu->dx, cpu->ax);
+        cpu->ip += 1;
+        return 1;
+    }
+
+    // INSB/INSW (0x6C/0x6D) to ES:DI, OUTSB/OUTSW (0x6E/0x6F) from DS:SI.
+    // A REP prefix runs the whole transfer in one step, and when the buffer is
+    // contiguous in memory it is handed to the device as one block.
+    if (opcode >= 0x6C && opcode <= 0x6F)
+    {
+        int width = (opcode & 1) ? 2 : 1;
+        int is_out = opcode >= 0x6E;
+        uint32_t count = cpu->rep_prefix ? cpu->cx : 1;
+        uint16_t *index = is_out ? &cpu->si : &cpu->di;
+        uint16_t seg = is_out ? (cpu->segment_override ? cpu->override_value : cpu->ds) : cpu->es;
+        uint32_t phys = ((uint32_t)seg << 4) + *index;
+        uint32_t bytes = count * width;
+        int down = (cpu->flags & 0x400) != 0;
+        if (count > 0 && !down && (uint32_t)*index + bytes <= 0x10000 && phys + bytes <= MEMORY_SIZE)
+        {
+            if (is_out)
+                ports_out_block(cpu->ports, cpu->dx, &mem->data[phys], count, width);
+            else
+            {
+                ports_in_block(cpu->ports, cpu->dx, &mem->data[phys], count, width);
+                mem_mark_written(mem, phys, bytes);
+            }
+            *index += bytes;
+        }
+        else
+        {
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                phys = ((uint32_t)seg << 4) + *index;
+                if (is_out && width == 2)
+                    ports_out16(cpu->ports, cpu->dx, mem_read16(mem, phys));
+                else if (is_out)
+                    ports_out8(cpu->ports, cpu->dx, mem_read8(mem, phys));
+                else if (width == 2)
+                    mem_write16(mem, phys, ports_in16(cpu->ports, cpu->dx));
+                else
+                    mem_write8(mem, phys, ports_in8(cpu->ports, cpu->dx));
+                *index += down ? -width : width;
+            }
+        }
+        if (cpu->rep_prefix)
+            cpu->cx = 0;
+        cpu->rep_prefix = 0;
+        cpu->segment_override = 0;
         cpu->ip += 1;
         return 1;
     }
@@ -2902,7 +3430,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         uint8_t mod, reg, rm;
         decode_modrm(modrm, &mod, &reg, &rm);
         int instr_len = 2;
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         int is16 = (opcode == 0xF7);
         uint16_t val16 = 0;
         uint8_t val8 = 0;
@@ -2959,8 +3487,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 uint16_t dividend = ((uint16_t)ah << 8) | al;
                 if (val8 == 0)
                 {
-                    emu_puts("Divide by zero!\n");
-                    emu_output_flush();
+                    emu_puts(&cpu->out, "Divide by zero!\n");
+                    emu_output_flush(&cpu->out);
+                    cpu->stop_reason = CPU_STOP_DIVIDE;
                     return 0;
                 }
                 ((uint8_t *)&cpu->ax)[0] = dividend / val8;
@@ -2973,8 +3502,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 int16_t dividend = ((int16_t)ah << 8) | (uint8_t)al;
                 if (val8 == 0)
                 {
-                    emu_puts("Divide by zero!\n");
-                    emu_output_flush();
+                    emu_puts(&cpu->out, "Divide by zero!\n");
+                    emu_output_flush(&cpu->out);
+                    cpu->stop_reason = CPU_STOP_DIVIDE;
                     return 0;
                 }
                 ((uint8_t *)&cpu->ax)[0] = dividend / (int8_t)val8;
@@ -3002,8 +3532,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 uint32_t dividend = ((uint32_t)cpu->dx << 16) | cpu->ax;
                 if (val16 == 0)
                 {
-                    emu_puts("Divide by zero!\n");
-                    emu_output_flush();
+                    emu_puts(&cpu->out, "Divide by zero!\n");
+                    emu_output_flush(&cpu->out);
+                    cpu->stop_reason = CPU_STOP_DIVIDE;
                     return 0;
                 }
                 cpu->ax = dividend / val16;
@@ -3014,8 +3545,9 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 int32_t dividend = ((int32_t)cpu->dx << 16) | cpu->ax;
                 if (val16 == 0)
                 {
-                    emu_puts("Divide by zero!\n");
-                    emu_output_flush();
+                    emu_puts(&cpu->out, "Divide by zero!\n");
+                    emu_output_flush(&cpu->out);
+                    cpu->stop_reason = CPU_STOP_DIVIDE;
                     return 0;
                 }
                 cpu->ax = dividend / (int16_t)val16;
@@ -3023,7 +3555,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
             }
         }
         cpu->ip += instr_len;
-        segment_override = 0;
+        cpu->segment_override = 0;
         return 1;
     }
 
@@ -3124,7 +3656,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
         int instr_len = 2;
         int is16 = (opcode == 0xD1 || opcode == 0xD3);
         int count = (opcode == 0xD0 || opcode == 0xD1) ? 1 : ((cpu->cx) & 0xFF);
-        uint32_t seg = (segment_override ? override_value : cpu->ds) << 4;
+        uint32_t seg = (cpu->segment_override ? cpu->override_value : cpu->ds) << 4;
         if (reg == 4 || reg == 6)
         { // SAL/SHL or SAR
             if (mod == 3)
@@ -3198,7 +3730,7 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
                 }
             }
             cpu->ip += instr_len;
-            segment_override = 0;
+            cpu->segment_override = 0;
             return 1;
         }
     }
@@ -3297,7 +3829,17 @@ int cpu_step(CPU8086 *cpu, Memory8086 *mem)
     }
     char msg[128];
     snprintf(msg, sizeof(msg), "Unknown or unsupported opcode: %02X at CS:IP=%04X:%04X\n", opcode, cpu->cs, cpu->ip);
-    emu_puts(msg);
-    emu_output_flush();
+    emu_puts(&cpu->out, msg);
+    emu_output_flush(&cpu->out);
+    cpu->bad_opcode = opcode;
+    cpu->stop_reason = CPU_STOP_BAD_OPCODE;
     return 0;
 }
+
+uint64_t cpu_run(CPU8086 *cpu, Memory8086 *mem, uint64_t max_steps)
+{
+    uint64_t n = 0;
+    while (n < max_steps && cpu_step(cpu, mem))
+        ++n;
+    return n;
+}
@@ -0,0 +1,369 @@
+#include "../include/dosfs.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void dosfs_init(DosFs *fs, const char *host_root)
+{
+    memset(fs, 0, sizeof(*fs));
+    if (host_root)
+        snprintf(fs->host_root, sizeof(fs->host_root), "%s", host_root);
+}
+
+void dosfs_free(DosFs *fs)
+{
+    for (uint16_t h = DOSFS_FIRST_HANDLE; h < DOSFS_MAX_HANDLES; ++h)
+        if (fs->handles[h].file)
+            dosfs_close(fs, h);
+    for (size_t i = 0; i < fs->nfiles; ++i)
+    {
+        free(fs->files[i]->data);
+        free(fs->files[i]);
+    }
+    free(fs->files);
+    memset(fs, 0, sizeof(*fs));
+}
+
+// Turn a guest path into the canonical form used as the file key: drive
+// letter dropped, '\' -> '/', upper case. Anything that could escape the
+// sandbox (absolute paths, "..") is rejected.
+static int normalize_name(const char *path, char *out)
+{
+    if (isalpha((unsigned char)path[0]) && path[1] == ':')
+        path += 2;
+    if (path[0] == '\\' || path[0] == '/')
+        return 0;
+    size_t n = 0;
+    for (; *path; ++path)
+    {
+        char c = *path == '\\' ? '/' : (char)toupper((unsigned char)*path);
+        if (n + 1 >= DOSFS_NAME_MAX)
+            return 0;
+        out[n++] = c;
+    }
+    out[n] = 0;
+    if (n == 0 || strstr(out, "..") || strstr(out, "//"))
+        return 0;
+    return 1;
+}
+
+static DosFile *find_file(DosFs *fs, const char *name)
+{
+    for (size_t i = 0; i < fs->nfiles; ++i)
+        if (strcmp(fs->files[i]->name, name) == 0)
+            return fs->files[i];
+    return NULL;
+}
+
+static int file_reserve(DosFile *f, uint32_t size)
+{
+    if (size <= f->cap)
+        return 1;
+    if (size > DOSFS_MAX_FILE_SIZE)
+        return 0;
+    uint32_t cap = f->cap ? f->cap : 512;
+    while (cap < size)
+        cap *= 2;
+    uint8_t *p = realloc(f->data, cap);
+    if (!p)
+        return 0;
+    f->data = p;
+    f->cap = cap;
+    return 1;
+}
+
+static DosFile *new_file(DosFs *fs, const char *name)
+{
+    if (fs->nfiles == fs->cap)
+    {
+        size_t cap = fs->cap ? fs->cap * 2 : 8;
+        DosFile **p = realloc(fs->files, cap * sizeof(*p));
+        if (!p)
+            return NULL;
+        fs->files = p;
+        fs->cap = cap;
+    }
+    DosFile *f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    fs->files[fs->nfiles++] = f;
+    return f;
+}
+
+// Host path for a normalized name. The guest sees upper case names but host
+// directories usually hold lower case ones, so an existing file is looked up
+// under both spellings and new files are created in lower case.
+static void host_path(DosFs *fs, const char *name, char *out, size_t size)
+{
+    char lower[DOSFS_NAME_MAX];
+    size_t i;
+    for (i = 0; name[i]; ++i)
+        lower[i] = (char)tolower((unsigned char)name[i]);
+    lower[i] = 0;
+    snprintf(out, size, "%s/%s", fs->host_root, name);
+    FILE *f = fopen(out, "rb");
+    if (f)
+    {
+        fclose(f);
+        return;
+    }
+    snprintf(out, size, "%s/%s", fs->host_root, lower);
+}
+
+// Load a host file into the file table. A file that cannot be loaded whole
+// is refused: a partial copy would be written back over the host file on
+// close. Returns 0 or a DOSERR_* code.
+static int load_from_host(DosFs *fs, const char *name, DosFile **out)
+{
+    if (!fs->host_root[0])
+        return DOSERR_FILE_NOT_FOUND;
+    char path[sizeof(fs->host_root) + DOSFS_NAME_MAX + 1];
+    host_path(fs, name, path, sizeof(path));
+    FILE *hf = fopen(path, "rb");
+    if (!hf)
+        return DOSERR_FILE_NOT_FOUND;
+    DosFile *f = new_file(fs, name);
+    int err = f ? 0 : DOSERR_INSUFFICIENT_MEMORY;
+    if (f)
+    {
+        uint8_t buf[4096];
+        size_t n;
+        while (!err && (n = fread(buf, 1, sizeof(buf), hf)) > 0)
+        {
+            if (n > DOSFS_MAX_FILE_SIZE - f->len)
+                err = DOSERR_ACCESS_DENIED;
+            else if (!file_reserve(f, f->len + (uint32_t)n))
+                err = DOSERR_INSUFFICIENT_MEMORY;
+            else
+            {
+                memcpy(f->data + f->len, buf, n);
+                f->len += (uint32_t)n;
+            }
+        }
+        if (!err && ferror(hf))
+            err = DOSERR_ACCESS_DENIED;
+        if (err)
+        {
+            // new_file appended it last
+            fs->nfiles--;
+            free(f->data);
+            free(f);
+        }
+    }
+    fclose(hf);
+    *out = err ? NULL : f;
+    return err;
+}
+
+static void write_back(DosFs *fs, DosFile *f)
+{
+    if (!fs->host_root[0] || !f->dirty)
+        return;
+    char path[sizeof(fs->host_root) + DOSFS_NAME_MAX + 1];
+    host_path(fs, f->name, path, sizeof(path));
+    FILE *hf = fopen(path, "wb");
+    if (!hf)
+        return;
+    fwrite(f->data, 1, f->len, hf);
+    fclose(hf);
+    f->dirty = 0;
+}
+
+static int alloc_handle(DosFs *fs, DosFile *f, uint8_t mode, uint16_t *handle)
+{
+    for (uint16_t h = DOSFS_FIRST_HANDLE; h < DOSFS_MAX_HANDLES; ++h)
+    {
+        if (!fs->handles[h].file)
+        {
+            fs->handles[h].file = f;
+            fs->handles[h].pos = 0;
+            fs->handles[h].mode = mode;
+            *handle = h;
+            return 0;
+        }
+    }
+    return DOSERR_TOO_MANY_FILES;
+}
+
+static DosHandle *get_handle(DosFs *fs, uint16_t handle)
+{
+    if (handle < DOSFS_FIRST_HANDLE || handle >= DOSFS_MAX_HANDLES || !fs->handles[handle].file)
+        return NULL;
+    return &fs->handles[handle];
+}
+
+int dosfs_add_file(DosFs *fs, const char *name, const void *data, size_t len)
+{
+    char norm[DOSFS_NAME_MAX];
+    if (!normalize_name(name, norm) || len > DOSFS_MAX_FILE_SIZE)
+        return 0;
+    DosFile *f = find_file(fs, norm);
+    if (!f && !(f = new_file(fs, norm)))
+        return 0;
+    if (!file_reserve(f, (uint32_t)len))
+        return 0;
+    if (len)
+        memcpy(f->data, data, len);
+    f->len = (uint32_t)len;
+    return 1;
+}
+
+int dosfs_valid_name(const char *name)
+{
+    char norm[DOSFS_NAME_MAX];
+    return normalize_name(name, norm);
+}
+
+int dosfs_open(DosFs *fs, const char *path, uint8_t mode, uint16_t *handle)
+{
+    char norm[DOSFS_NAME_MAX];
+    mode &= 0x07; // sharing/inheritance bits are accepted and ignored
+    if (mode > 2)
+        return DOSERR_INVALID_ACCESS;
+    if (!normalize_name(path, norm))
+        return DOSERR_PATH_NOT_FOUND;
+    DosFile *f = find_file(fs, norm);
+    if (!f)
+    {
+        int err = load_from_host(fs, norm, &f);
+        if (err)
+            return err;
+    }
+    return alloc_handle(fs, f, mode, handle);
+}
+
+int dosfs_create(DosFs *fs, const char *path, uint16_t *handle)
+{
+    char norm[DOSFS_NAME_MAX];
+    if (!normalize_name(path, norm))
+        return DOSERR_PATH_NOT_FOUND;
+    DosFile *f = find_file(fs, norm);
+    if (!f && !(f = new_file(fs, norm)))
+        return DOSERR_INSUFFICIENT_MEMORY;
+    f->len = 0; // create truncates an existing file
+    f->dirty = 1;
+    return alloc_handle(fs, f, 2, handle);
+}
+
+int dosfs_close(DosFs *fs, uint16_t handle)
+{
+    DosHandle *h = get_handle(fs, handle);
+    if (!h)
+        return DOSERR_INVALID_HANDLE;
+    DosFile *f = h->file;
+    h->file = NULL;
+    for (uint16_t i = DOSFS_FIRST_HANDLE; i < DOSFS_MAX_HANDLES; ++i)
+        if (fs->handles[i].file == f)
+            return 0; // still open elsewhere, write back on the last close
+    write_back(fs, f);
+    return 0;
+}
+
+int dosfs_read(DosFs *fs, uint16_t handle, uint8_t *dst, uint16_t count, uint16_t *done)
+{
+    DosHandle *h = get_handle(fs, handle);
+    if (!h)
+        return DOSERR_INVALID_HANDLE;
+    if (h->mode == 1)
+        return DOSERR_ACCESS_DENIED;
+    uint32_t avail = h->pos < h->file->len ? h->file->len - h->pos : 0;
+    uint16_t n = avail < count ? (uint16_t)avail : count;
+    if (n)
+        memcpy(dst, h->file->data + h->pos, n);
+    h->pos += n;
+    *done = n;
+    return 0;
+}
+
+int dosfs_write(DosFs *fs, uint16_t handle, const uint8_t *src, uint16_t count, uint16_t *done)
+{
+    DosHandle *h = get_handle(fs, handle);
+    if (!h)
+        return DOSERR_INVALID_HANDLE;
+    if (h->mode == 0)
+        return DOSERR_ACCESS_DENIED;
+    DosFile *f = h->file;
+    *done = 0;
+    if (count == 0)
+    {
+        // a zero-length write truncates (or extends) the file at the position
+        if (!file_reserve(f, h->pos))
+            return DOSERR_INSUFFICIENT_MEMORY;
+        if (h->pos > f->len)
+            memset(f->data + f->len, 0, h->pos - f->len);
+        f->len = h->pos;
+        f->dirty = 1;
+        return 0;
+    }
+    if (!file_reserve(f, h->pos + count))
+        return DOSERR_INSUFFICIENT_MEMORY;
+    if (h->pos > f->len)
+        memset(f->data + f->len, 0, h->pos - f->len);
+    memcpy(f->data + h->pos, src, count);
+    h->pos += count;
+    if (h->pos > f->len)
+        f->len = h->pos;
+    f->dirty = 1;
+    *done = count;
+    return 0;
+}
+
+int dosfs_seek(DosFs *fs, uint16_t handle, uint8_t whence, int32_t offset, uint32_t *new_pos)
+{
+    DosHandle *h = get_handle(fs, handle);
+    if (!h)
+        return DOSERR_INVALID_HANDLE;
+    int64_t base;
+    switch (whence)
+    {
+    case 0:
+        base = 0;
+        break;
+    case 1:
+        base = h->pos;
+        break;
+    case 2:
+        base = h->file->len;
+        break;
+    default:
+        return DOSERR_INVALID_FUNCTION;
+    }
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > DOSFS_MAX_FILE_SIZE)
+        return DOSERR_INVALID_FUNCTION;
+    h->pos = (uint32_t)pos;
+    *new_pos = h->pos;
+    return 0;
+}
+
+int dosfs_delete(DosFs *fs, const char *path)
+{
+    char norm[DOSFS_NAME_MAX];
+    if (!normalize_name(path, norm))
+        return DOSERR_PATH_NOT_FOUND;
+    int found = 0;
+    for (size_t i = 0; i < fs->nfiles; ++i)
+    {
+        DosFile *f = fs->files[i];
+        if (strcmp(f->name, norm) != 0)
+            continue;
+        for (uint16_t h = DOSFS_FIRST_HANDLE; h < DOSFS_MAX_HANDLES; ++h)
+            if (fs->handles[h].file == f)
+                return DOSERR_ACCESS_DENIED;
+        free(f->data);
+        free(f);
+        fs->files[i] = fs->files[--fs->nfiles];
+        found = 1;
+        break;
+    }
+    if (fs->host_root[0])
+    {
+        char path_buf[sizeof(fs->host_root) + DOSFS_NAME_MAX + 1];
+        host_path(fs, norm, path_buf, sizeof(path_buf));
+        if (remove(path_buf) == 0)
+            found = 1;
+    }
+    return found ? 0 : DOSERR_FILE_NOT_FOUND;
+}
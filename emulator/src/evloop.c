@@ -0,0 +1,252 @@
+#include "../include/evloop.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+struct EvLoop {
+    int epfd;
+    int wakefd;
+};
+
+static uint32_t to_epoll(int events)
+{
+    return (events & EV_READ ? EPOLLIN : 0) | (events & EV_WRITE ? EPOLLOUT : 0);
+}
+
+EvLoop *evloop_new(void)
+{
+    EvLoop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (loop->epfd < 0 || loop->wakefd < 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0)
+    {
+        evloop_free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void evloop_free(EvLoop *loop)
+{
+    if (!loop)
+        return;
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    if (loop->wakefd >= 0)
+        close(loop->wakefd);
+    free(loop);
+}
+
+int evloop_add(EvLoop *loop, SOCKET fd, int events, void *data)
+{
+    struct epoll_event ev = {.events = to_epoll(events), .data.ptr = data};
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+int evloop_mod(EvLoop *loop, SOCKET fd, int events, void *data)
+{
+    struct epoll_event ev = {.events = to_epoll(events), .data.ptr = data};
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void evloop_del(EvLoop *loop, SOCKET fd)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int evloop_wait(EvLoop *loop, EvEvent *out, int max, int timeout_ms)
+{
+    struct epoll_event evs[64];
+    if (max > 64)
+        max = 64;
+    int n = epoll_wait(loop->epfd, evs, max, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < n; ++i)
+    {
+        out[i].data = evs[i].data.ptr;
+        out[i].events = (evs[i].events & EPOLLIN ? EV_READ : 0) |
+                        (evs[i].events & EPOLLOUT ? EV_WRITE : 0) |
+                        (evs[i].events & (EPOLLERR | EPOLLHUP) ? EV_ERROR : 0);
+        if (!out[i].data)
+        {
+            uint64_t count;
+            if (read(loop->wakefd, &count, sizeof(count)) < 0)
+            {
+                // EAGAIN: another wait already drained it
+            }
+            out[i].events = EV_READ;
+        }
+    }
+    return n;
+}
+
+void evloop_wake(EvLoop *loop)
+{
+    uint64_t one = 1;
+    if (write(loop->wakefd, &one, sizeof(one)) < 0)
+    {
+        // EAGAIN means the counter is already non-zero, which is enough
+    }
+}
+
+int evloop_set_nonblocking(SOCKET fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+#else
+// Portable fallback: poll() (WSAPoll on Windows) over a flat array. Wakeups
+// go through a UDP socket connected to itself, since WSAPoll only takes
+// sockets.
+#ifdef _WIN32
+#define poll WSAPoll
+typedef int socklen_t;
+#else
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+struct EvLoop {
+    struct pollfd *fds;
+    void **data;
+    size_t count, cap;
+    SOCKET wake;
+};
+
+static short to_poll(int events)
+{
+    return (short)((events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0));
+}
+
+EvLoop *evloop_new(void)
+{
+    EvLoop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    loop->wake = socket(AF_INET, SOCK_DGRAM, 0);
+    if (loop->wake < 0 || bind(loop->wake, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(loop->wake, (struct sockaddr *)&addr, &len) < 0 ||
+        connect(loop->wake, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        !evloop_set_nonblocking(loop->wake) || !evloop_add(loop, loop->wake, EV_READ, NULL))
+    {
+        evloop_free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void evloop_free(EvLoop *loop)
+{
+    if (!loop)
+        return;
+    if (loop->wake >= 0)
+        closesocket(loop->wake);
+    free(loop->fds);
+    free(loop->data);
+    free(loop);
+}
+
+int evloop_add(EvLoop *loop, SOCKET fd, int events, void *data)
+{
+    if (loop->count == loop->cap)
+    {
+        size_t cap = loop->cap ? loop->cap * 2 : 64;
+        struct pollfd *fds = realloc(loop->fds, cap * sizeof(*fds));
+        if (!fds)
+            return 0;
+        loop->fds = fds;
+        void **d = realloc(loop->data, cap * sizeof(*d));
+        if (!d)
+            return 0;
+        loop->data = d;
+        loop->cap = cap;
+    }
+    loop->fds[loop->count].fd = fd;
+    loop->fds[loop->count].events = to_poll(events);
+    loop->fds[loop->count].revents = 0;
+    loop->data[loop->count++] = data;
+    return 1;
+}
+
+int evloop_mod(EvLoop *loop, SOCKET fd, int events, void *data)
+{
+    for (size_t i = 0; i < loop->count; ++i)
+        if (loop->fds[i].fd == fd)
+        {
+            loop->fds[i].events = to_poll(events);
+            loop->data[i] = data;
+            return 1;
+        }
+    return 0;
+}
+
+void evloop_del(EvLoop *loop, SOCKET fd)
+{
+    for (size_t i = 0; i < loop->count; ++i)
+        if (loop->fds[i].fd == fd)
+        {
+            loop->fds[i] = loop->fds[--loop->count];
+            loop->data[i] = loop->data[loop->count];
+            return;
+        }
+}
+
+int evloop_wait(EvLoop *loop, EvEvent *out, int max, int timeout_ms)
+{
+    int n = poll(loop->fds, (unsigned long)loop->count, timeout_ms);
+    if (n <= 0)
+        return n < 0 ? -1 : 0;
+    int got = 0;
+    for (size_t i = 0; i < loop->count && got < max; ++i)
+    {
+        short re = loop->fds[i].revents;
+        if (!re)
+            continue;
+        out[got].data = loop->data[i];
+        out[got].events = (re & POLLIN ? EV_READ : 0) | (re & POLLOUT ? EV_WRITE : 0) |
+                          (re & (POLLERR | POLLHUP | POLLNVAL) ? EV_ERROR : 0);
+        if (!out[got].data)
+        {
+            char buf[64];
+            while (recv(loop->wake, buf, sizeof(buf), 0) > 0)
+            {
+            }
+            out[got].events = EV_READ;
+        }
+        got++;
+    }
+    return got;
+}
+
+void evloop_wake(EvLoop *loop)
+{
+    char b = 1;
+    send(loop->wake, &b, 1, 0);
+}
+
+int evloop_set_nonblocking(SOCKET fd)
+{
+#ifdef _WIN32
+    u_long on = 1;
+    return ioctlsocket(fd, FIONBIO, &on) == 0;
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+#endif
@@ -0,0 +1,209 @@
+#include "../include/expect.h"
+#include "../include/protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_HEADER_SIZE 3 // u8 kind, u16 length
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+const char *expect_validate(const uint8_t *p, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        if (len - pos < ENTRY_HEADER_SIZE) return "truncated assertion";
+        uint8_t kind = p[pos];
+        size_t n = get16(p + pos + 1);
+        const uint8_t *data = p + pos + ENTRY_HEADER_SIZE;
+        if (n > len - pos - ENTRY_HEADER_SIZE) return "truncated assertion";
+        switch (kind)
+        {
+        case EXPECT_OUTPUT_HASH:
+        case EXPECT_MAX_INSTRUCTIONS:
+            if (n != 8) return "bad assertion";
+            break;
+        case EXPECT_OUTPUT_PREFIX:
+            break;
+        case EXPECT_REGISTER:
+            if (n != 5 || data[0] >= EXPECT_REG_COUNT) return "bad register assertion";
+            break;
+        case EXPECT_MEMORY:
+            if (n < 4 || get32(data) >= MEMORY_SIZE || n - 4 > MEMORY_SIZE - get32(data))
+                return "bad memory assertion";
+            break;
+        default:
+            // a check the server does not know must not pass silently
+            return "unknown assertion";
+        }
+        pos += ENTRY_HEADER_SIZE + n;
+    }
+    return NULL;
+}
+
+void expect_init(ExpectSet *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->hash = FNV_OFFSET;
+}
+
+void expect_free(ExpectSet *e)
+{
+    free(e->entries);
+    free(e->head);
+    expect_init(e);
+}
+
+int expect_add(ExpectSet *e, const uint8_t *p, size_t len)
+{
+    if (len == 0) return 1;
+    uint8_t *entries = realloc(e->entries, e->len + len);
+    if (!entries) return 0;
+    e->entries = entries;
+    memcpy(e->entries + e->len, p, len);
+    e->len += len;
+    // keep as much of the output as the longest prefix check needs
+    for (size_t pos = 0; pos < len;)
+    {
+        size_t n = get16(p + pos + 1);
+        if (p[pos] == EXPECT_OUTPUT_PREFIX && n > e->head_cap)
+        {
+            uint8_t *head = realloc(e->head, n);
+            if (!head) return 0;
+            e->head = head;
+            e->head_cap = n;
+        }
+        e->count++;
+        pos += ENTRY_HEADER_SIZE + n;
+    }
+    return 1;
+}
+
+void expect_output(ExpectSet *e, const void *data, size_t len)
+{
+    if (!e->count) return;
+    const uint8_t *p = data;
+    uint64_t h = e->hash;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    e->hash = h;
+    size_t n = e->head_cap - e->head_len < len ? e->head_cap - e->head_len : len;
+    if (n)
+    {
+        memcpy(e->head + e->head_len, p, n);
+        e->head_len += n;
+    }
+}
+
+static uint16_t reg_value(const CPU8086 *cpu, int reg)
+{
+    const uint16_t regs[EXPECT_REG_COUNT] = {
+        cpu->ax, cpu->bx, cpu->cx, cpu->dx, cpu->si, cpu->di, cpu->bp, cpu->sp,
+        cpu->ds, cpu->es, cpu->ss, cpu->flags, cpu->cs, cpu->ip
+    };
+    return regs[reg];
+}
+
+// Offset of the first byte where a and b differ, or n if they agree
+static size_t first_difference(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+void expect_finish(const ExpectSet *e, const CPU8086 *cpu, const Memory8086 *mem,
+                   uint64_t instructions, ExpectResult *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!e->count) return;
+    out->status = CHECK_PASSED;
+    size_t index = 0;
+    for (size_t pos = 0; pos < e->len; ++index)
+    {
+        uint8_t kind = e->entries[pos];
+        size_t n = get16(e->entries + pos + 1);
+        const uint8_t *data = e->entries + pos + ENTRY_HEADER_SIZE;
+        pos += ENTRY_HEADER_SIZE + n;
+        uint32_t where = 0;
+        uint64_t expected = 0, actual = 0;
+        int ok = 1;
+        switch (kind)
+        {
+        case EXPECT_OUTPUT_HASH:
+            expected = get64(data);
+            actual = e->hash;
+            ok = expected == actual;
+            break;
+        case EXPECT_OUTPUT_PREFIX:
+        {
+            size_t have = e->head_len < n ? e->head_len : n;
+            size_t i = first_difference(data, e->head, have);
+            if (i < n)
+            {
+                ok = 0;
+                where = (uint32_t)i;
+                expected = data[i];
+                actual = i < have ? e->head[i] : CHECK_NO_BYTE;
+            }
+            break;
+        }
+        case EXPECT_REGISTER:
+        {
+            uint16_t mask = get16(data + 3);
+            where = data[0];
+            expected = get16(data + 1);
+            actual = reg_value(cpu, data[0]);
+            ok = ((expected ^ actual) & mask) == 0;
+            break;
+        }
+        case EXPECT_MEMORY:
+        {
+            uint32_t addr = get32(data);
+            size_t i = first_difference(data + 4, mem->data + addr, n - 4);
+            if (i < n - 4)
+            {
+                ok = 0;
+                where = addr + (uint32_t)i;
+                expected = data[4 + i];
+                actual = mem->data[addr + i];
+            }
+            break;
+        }
+        case EXPECT_MAX_INSTRUCTIONS:
+            expected = get64(data);
+            actual = instructions;
+            ok = actual <= expected;
+            break;
+        }
+        if (!ok)
+        {
+            out->status = CHECK_FAILED;
+            out->kind = kind;
+            out->index = index < UINT16_MAX ? (uint16_t)index : UINT16_MAX;
+            out->where = where;
+            out->expected = expected;
+            out->actual = actual;
+            return;
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#include "../include/input.h"
+#include <stdlib.h>
+#include <string.h>
+
+void input_init(EmuInput *in)
+{
+    memset(in, 0, sizeof(*in));
+}
+
+void input_free(EmuInput *in)
+{
+    free(in->data);
+    input_init(in);
+}
+
+static int input_reserve(EmuInput *in, size_t extra)
+{
+    if (in->len + extra <= in->cap)
+        return 1;
+    size_t cap = in->cap ? in->cap : 256;
+    while (cap < in->len + extra)
+        cap *= 2;
+    uint8_t *p = realloc(in->data, cap);
+    if (!p)
+        return 0;
+    in->data = p;
+    in->cap = cap;
+    return 1;
+}
+
+int input_append(EmuInput *in, const void *data, size_t len)
+{
+    if (!input_reserve(in, len))
+        return 0;
+    const uint8_t *src = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        uint8_t c = src[i];
+        if (c == '\n')
+        {
+            if (in->pending_cr)
+            {
+                in->pending_cr = 0;
+                continue;
+            }
+            c = '\r';
+        }
+        else
+            in->pending_cr = (c == '\r');
+        in->data[in->len++] = c;
+    }
+    return 1;
+}
+
+int input_append_file(EmuInput *in, FILE *f)
+{
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        if (!input_append(in, buf, n))
+            return 0;
+    }
+    return !ferror(f);
+}
+
+size_t input_available(const EmuInput *in)
+{
+    return in->len - in->pos;
+}
+
+int input_peek(const EmuInput *in)
+{
+    if (in->pos >= in->len)
+        return INPUT_EOF;
+    return in->data[in->pos];
+}
+
+int input_getc(EmuInput *in)
+{
+    if (in->pos >= in->len)
+        return INPUT_EOF;
+    return in->data[in->pos++];
+}
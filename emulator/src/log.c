@@ -0,0 +1,88 @@
+#include "../include/log.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+int emu_log_threshold[LOG_CAT_COUNT] = {LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO};
+static FILE *log_file = NULL;
+
+static const char *cat_names[LOG_CAT_COUNT] = {"cpu", "dos", "bios", "server"};
+static const char *level_names[] = {"error", "warn", "info", "debug", "trace"};
+
+void emu_log_write(int cat, int level, const char *fmt, ...)
+{
+    // format the whole line first so lines from different threads don't interleave
+    char line[512];
+    int n = snprintf(line, sizeof(line), "[%s:%s] ", cat_names[cat], level_names[level]);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - n - 1, fmt, ap);
+    va_end(ap);
+    size_t len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n')
+    {
+        line[len++] = '\n';
+        line[len] = 0;
+    }
+    fputs(line, stderr);
+    if (log_file)
+    {
+        fputs(line, log_file);
+        fflush(log_file);
+    }
+}
+
+static int parse_level(const char *s, size_t len)
+{
+    if (len == 3 && strncmp(s, "off", 3) == 0)
+        return -1;
+    for (int i = 0; i <= LOG_TRACE; ++i)
+        if (strlen(level_names[i]) == len && strncmp(s, level_names[i], len) == 0)
+            return i;
+    return -2;
+}
+
+int emu_log_configure(const char *spec)
+{
+    while (*spec)
+    {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq)
+        {
+            int level = parse_level(eq + 1, len - (eq + 1 - spec));
+            int cat = -1;
+            for (int i = 0; i < LOG_CAT_COUNT; ++i)
+                if ((size_t)(eq - spec) == strlen(cat_names[i]) && strncmp(spec, cat_names[i], eq - spec) == 0)
+                    cat = i;
+            if (cat < 0 || level == -2)
+                return 0;
+            emu_log_threshold[cat] = level;
+        }
+        else
+        {
+            // bare level applies to every category
+            int level = parse_level(spec, len);
+            if (level == -2)
+                return 0;
+            for (int i = 0; i < LOG_CAT_COUNT; ++i)
+                emu_log_threshold[i] = level;
+        }
+        spec += len;
+        if (*spec == ',')
+            spec++;
+    }
+    return 1;
+}
+
+void emu_log_init_from_env(void)
+{
+    const char *spec = getenv("EMU_LOG");
+    if (spec && !emu_log_configure(spec))
+        fprintf(stderr, "ignoring malformed EMU_LOG=%s\n", spec);
+}
+
+void emu_log_set_file(FILE *f)
+{
+    log_file = f;
+}
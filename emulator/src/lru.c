@@ -0,0 +1,187 @@
+#include "../include/lru.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct LruEntry
+{
+    struct LruEntry *chain;      // next in the hash bucket
+    struct LruEntry *prev, *next; // recency list, most recent first
+    uint64_t hash;
+    size_t key_len, value_len;
+    uint8_t data[];              // key, then value
+} LruEntry;
+
+struct LruCache
+{
+    LruEntry **buckets;
+    size_t nbuckets;             // power of two
+    LruEntry *head, *tail;
+    LruStats stats;
+};
+
+// FNV-1a
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static size_t entry_size(const LruEntry *e)
+{
+    return sizeof(*e) + e->key_len + e->value_len;
+}
+
+LruCache *lru_new(size_t max_bytes)
+{
+    LruCache *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->nbuckets = 256;
+    c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+    if (!c->buckets)
+    {
+        free(c);
+        return NULL;
+    }
+    c->stats.max_bytes = max_bytes;
+    return c;
+}
+
+void lru_free(LruCache *c)
+{
+    if (!c)
+        return;
+    for (LruEntry *e = c->head; e;)
+    {
+        LruEntry *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(c->buckets);
+    free(c);
+}
+
+static LruEntry **find_slot(LruCache *c, const void *key, size_t key_len, uint64_t hash)
+{
+    LruEntry **p = &c->buckets[hash & (c->nbuckets - 1)];
+    for (; *p; p = &(*p)->chain)
+        if ((*p)->hash == hash && (*p)->key_len == key_len && memcmp((*p)->data, key, key_len) == 0)
+            break;
+    return p;
+}
+
+static void list_unlink(LruCache *c, LruEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void list_push_front(LruCache *c, LruEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+static void remove_entry(LruCache *c, LruEntry **slot)
+{
+    LruEntry *e = *slot;
+    *slot = e->chain;
+    list_unlink(c, e);
+    c->stats.entries--;
+    c->stats.bytes -= entry_size(e);
+    free(e);
+}
+
+// Double the bucket array once the chains get long; failure just leaves
+// them long
+static void maybe_grow(LruCache *c)
+{
+    if (c->stats.entries < c->nbuckets)
+        return;
+    size_t n = c->nbuckets * 2;
+    LruEntry **b = calloc(n, sizeof(*b));
+    if (!b)
+        return;
+    for (size_t i = 0; i < c->nbuckets; ++i)
+    {
+        for (LruEntry *e = c->buckets[i]; e;)
+        {
+            LruEntry *next = e->chain;
+            e->chain = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = b;
+    c->nbuckets = n;
+}
+
+const void *lru_get(LruCache *c, const void *key, size_t key_len, size_t *value_len)
+{
+    LruEntry *e = *find_slot(c, key, key_len, hash_bytes(key, key_len));
+    if (!e)
+    {
+        c->stats.misses++;
+        return NULL;
+    }
+    c->stats.hits++;
+    list_unlink(c, e);
+    list_push_front(c, e);
+    *value_len = e->value_len;
+    return e->data + e->key_len;
+}
+
+int lru_put(LruCache *c, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+    size_t size = sizeof(LruEntry) + key_len + value_len;
+    if (size > c->stats.max_bytes)
+        return 0;
+    uint64_t hash = hash_bytes(key, key_len);
+    LruEntry **slot = find_slot(c, key, key_len, hash);
+    if (*slot)
+        remove_entry(c, slot);
+    while (c->tail && c->stats.bytes + size > c->stats.max_bytes)
+    {
+        remove_entry(c, find_slot(c, c->tail->data, c->tail->key_len, c->tail->hash));
+        c->stats.evictions++;
+    }
+    LruEntry *e = malloc(size);
+    if (!e)
+        return 0;
+    e->hash = hash;
+    e->key_len = key_len;
+    e->value_len = value_len;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, value, value_len);
+    LruEntry **bucket = &c->buckets[hash & (c->nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    list_push_front(c, e);
+    c->stats.entries++;
+    c->stats.bytes += size;
+    maybe_grow(c);
+    return 1;
+}
+
+void lru_stats(const LruCache *c, LruStats *out)
+{
+    *out = c->stats;
+}
@@ -3,10 +3,48 @@
 #include <string.h>
 #include "../include/cpu.h"
 #include "../include/memory.h"
+#include "../include/log.h"
 #include <stddef.h>
-// emu_output buffer is defined in cpu.c
-extern char emu_output[];
-extern size_t emu_out_pos;
+
+// Fill the scripted keyboard queue from a file ("-" reads stdin)
+static int load_input(EmuInput *in, const char *filename) {
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return 0;
+    }
+    int ok = input_append_file(in, f);
+    if (f != stdin) fclose(f);
+    if (!ok) fprintf(stderr, "Could not read input from %s\n", filename);
+    return ok;
+}
+
+// Final graphics frame: PPM when the name ends in .ppm, otherwise one CGA
+// colour index per pixel
+static int write_frame(VideoState *video, Memory8086 *mem, const char *filename) {
+    if (!video_is_graphics(video)) {
+        fprintf(stderr, "--frame: program did not leave a graphics mode\n");
+        return 0;
+    }
+    FILE *f = fopen(filename, "wb");
+    if (!f) return 0;
+    size_t len = strlen(filename);
+    int ok;
+    if (len > 4 && strcmp(filename + len - 4, ".ppm") == 0) {
+        ok = video_write_ppm(video, mem, f);
+    } else {
+        size_t size = (size_t)video_width(video) * CGA_HEIGHT;
+        uint8_t *pixels = malloc(size);
+        ok = pixels != NULL;
+        if (ok) {
+            video_render_indexed(video, mem, pixels);
+            ok = fwrite(pixels, 1, size, f) == size;
+            free(pixels);
+        }
+    }
+    fclose(f);
+    return ok;
+}
 
 // Loader for .com/.bin files
 int load_bin(Memory8086 *mem, const char *filename, uint16_t load_addr) {
@@ -20,37 +58,85 @@ int load_bin(Memory8086 *mem, const char *filename, uint16_t load_addr) {
     fseek(f, 0, SEEK_SET);
     fread(&mem->data[load_addr], 1, size, f);
     fclose(f);
-    fprintf(stderr, "Loaded %ld bytes to 0x%04X\n", size, load_addr);
+    EMU_LOG(LOG_CAT_CPU, LOG_INFO, "Loaded %ld bytes to 0x%04X", size, load_addr);
     return 1;
 }
 
 int main(int argc, char **argv) {
     CPU8086 cpu;
     Memory8086 mem;
+    EmuInput input;
+    PortBus ports;
+    DosFs dos;
+    VideoState video;
+    int dump_screen = 0;
+    const char *frame_file = NULL;
+    const char *program = NULL;
+    const char *fs_root = NULL;
+    emu_log_init_from_env();
     memset(&mem, 0, sizeof(mem));
     cpu_init(&cpu);
+    input_init(&input);
+    cpu.input = &input;
+    ports_init(&ports);
+    ports_add_debugcon(&ports, &cpu.out);
+    cpu.ports = &ports;
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s program.com\n", argv[0]);
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0) && i + 1 < argc) {
+            if (!load_input(&input, argv[++i])) return 1;
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--fs") == 0) && i + 1 < argc) {
+            fs_root = argv[++i];
+        } else if (strcmp(argv[i], "--screen") == 0) {
+            dump_screen = 1;
+        } else if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc) {
+            frame_file = argv[++i];
+        } else if (!program) {
+            program = argv[i];
+        } else {
+            program = NULL;
+            break;
+        }
+    }
+    if (!program) {
+        fprintf(stderr, "Usage: %s program.com [-i input.txt|-] [-d dos_files_dir] [--screen] [--frame out.ppm|out.raw]\n", argv[0]);
         return 1;
     }
 
+    // DOS file handles only see files inside fs_root (none without -d)
+    dosfs_init(&dos, fs_root);
+    cpu.dos = &dos;
+    video_init(&video, &mem);
+    video_add_cga_ports(&video, &ports);
+    cpu.video = &video;
+
     // Load .com file at 0x100 (typical for DOS .com)
-    if (!load_bin(&mem, argv[1], 0x100)) return 1;
+    if (!load_bin(&mem, program, 0x100)) return 1;
     cpu.cs = 0x0000;
     cpu.ip = 0x0100;
 
-    fprintf(stderr, "8086 Emulator Started\n");
-    fprintf(stderr, "CS:IP = %04X:%04X\n",cpu.cs, cpu.ip);
+    EMU_LOG(LOG_CAT_CPU, LOG_INFO, "8086 Emulator Started");
+    EMU_LOG(LOG_CAT_CPU, LOG_INFO, "CS:IP = %04X:%04X", cpu.cs, cpu.ip);
 
     //HLT allel unknown opcode varunna vare work cheyunna fetch-execute loop
     while(cpu_step(&cpu, &mem)){
         // No per-instruction print; output will be from DOS int 21h, ah=2 only
     }
-    if (emu_out_pos > 0) {
+    if (cpu.out.pos > 0) {
         // print emulator output to stdout
-        fwrite(emu_output, 1, emu_out_pos, stdout);
+        fwrite(cpu.out.data, 1, cpu.out.pos, stdout);
         fflush(stdout);
     }
+    if (dump_screen) {
+        // final contents of the text screen, after the program output
+        printf("\n--- screen ---\n");
+        video_dump_text(&mem, stdout);
+    }
+    if (frame_file && !write_frame(&video, &mem, frame_file)) {
+        fprintf(stderr, "Could not write frame to %s\n", frame_file);
+    }
+    input_free(&input);
+    ports_free(&ports);
+    dosfs_free(&dos);
     return 0;
 }
\ No newline at end of file
@@ -8,8 +8,12 @@ uint8_t mem_read8(Memory8086 *mem, uint32_t addr){
 }
 
 void mem_write8(Memory8086 *mem, uint32_t addr, uint8_t value){
-    if(addr < MEMORY_SIZE)
+    if(addr < MEMORY_SIZE) {
         mem->data[addr] = value;
+        uint32_t off = addr - VRAM_BASE; // wraps to a huge value below the window
+        if (off < VRAM_SIZE)
+            mem->vram_dirty[off >> (VRAM_CHUNK_SHIFT + 5)] |= 1u << ((off >> VRAM_CHUNK_SHIFT) & 31);
+    }
 }
 
 uint16_t mem_read16(Memory8086 *mem, uint32_t addr){
@@ -21,4 +25,18 @@ uint16_t mem_read16(Memory8086 *mem, uint32_t addr){
 void mem_write16(Memory8086 *mem, uint32_t addr, uint16_t value){
     mem_write8(mem, addr, value & 0xFF);
     mem_write8(mem, addr + 1, (value >> 8) & 0xFF);
-}
\ No newline at end of file
+}
+
+void mem_mark_written(Memory8086 *mem, uint32_t addr, uint32_t len){
+    if (len == 0) return;
+    uint32_t start = addr > VRAM_BASE ? addr : VRAM_BASE;
+    uint32_t end = addr + len < VRAM_BASE + VRAM_SIZE ? addr + len : VRAM_BASE + VRAM_SIZE;
+    for (uint32_t a = start; a < end; a += 1u << VRAM_CHUNK_SHIFT) {
+        uint32_t off = a - VRAM_BASE;
+        mem->vram_dirty[off >> (VRAM_CHUNK_SHIFT + 5)] |= 1u << ((off >> VRAM_CHUNK_SHIFT) & 31);
+    }
+    if (start < end) {
+        uint32_t off = end - 1 - VRAM_BASE; // last chunk when the range is unaligned
+        mem->vram_dirty[off >> (VRAM_CHUNK_SHIFT + 5)] |= 1u << ((off >> VRAM_CHUNK_SHIFT) & 31);
+    }
+}
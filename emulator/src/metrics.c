@@ -0,0 +1,111 @@
+#include "../include/metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int bucket_of(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+    while (us && i < METRICS_BUCKETS - 1)
+    {
+        us >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+void histogram_record(Histogram *h, uint64_t ns)
+{
+    metric_add(&h->counts[bucket_of(ns)], 1);
+    metric_add(&h->sum_ns, ns);
+}
+
+void histogram_total_add(HistogramTotal *t, const Histogram *h)
+{
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
+    {
+        uint64_t n = metric_read(&h->counts[i]);
+        t->counts[i] += n;
+        t->count += n;
+    }
+    t->sum_ns += metric_read(&h->sum_ns);
+}
+
+// Upper bound of bucket i in seconds
+static double bucket_limit(int i)
+{
+    return (double)(1ull << i) / 1e6;
+}
+
+double histogram_quantile(const HistogramTotal *t, double q)
+{
+    if (t->count == 0)
+        return 0;
+    double rank = q * (double)t->count;
+    uint64_t below = 0;
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
+    {
+        if (t->counts[i] && (double)(below + t->counts[i]) >= rank)
+        {
+            double lo = i ? bucket_limit(i - 1) : 0;
+            double frac = (rank - (double)below) / (double)t->counts[i];
+            return lo + (bucket_limit(i) - lo) * frac;
+        }
+        below += t->counts[i];
+    }
+    return bucket_limit(METRICS_BUCKETS - 1);
+}
+
+void metrics_text_printf(MetricsText *t, const char *fmt, ...)
+{
+    for (;;)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t room = t->cap - t->len;
+        int n = vsnprintf(t->data ? t->data + t->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < room)
+        {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t cap = t->cap ? t->cap * 2 : 4096;
+        while (cap - t->len <= (size_t)n)
+            cap *= 2;
+        char *p = realloc(t->data, cap);
+        if (!p)
+        {
+            t->failed = 1;
+            return;
+        }
+        t->data = p;
+        t->cap = cap;
+    }
+}
+
+void metrics_text_histogram(MetricsText *t, const char *name, const char *help, const HistogramTotal *h)
+{
+    metrics_text_printf(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; ++i)
+    {
+        cumulative += h->counts[i];
+        metrics_text_printf(t, "%s_bucket{le=\"%g\"} %llu\n", name, bucket_limit(i), (unsigned long long)cumulative);
+    }
+    metrics_text_printf(t, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+    metrics_text_printf(t, "%s_sum %.9f\n%s_count %llu\n", name, (double)h->sum_ns / 1e9, name,
+                        (unsigned long long)h->count);
+    static const struct { const char *suffix; double q; } quantiles[] = {{"p50", 0.5}, {"p95", 0.95}, {"p99", 0.99}};
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+        metrics_text_printf(t, "%s_%s %.9f\n", name, quantiles[i].suffix, histogram_quantile(h, quantiles[i].q));
+}
+
+void metrics_text_free(MetricsText *t)
+{
+    free(t->data);
+    t->data = NULL;
+    t->len = t->cap = 0;
+}
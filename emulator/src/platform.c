@@ -0,0 +1,93 @@
+#include "../include/platform.h"
+
+#ifdef _WIN32
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+uint64_t emu_now_ns(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ull +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+}
+
+void emu_sleep_us(unsigned us)
+{
+    // Sleep() only has millisecond granularity
+    Sleep(us < 1000 ? 1 : us / 1000);
+}
+
+int emu_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+int emu_random_bytes(void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len)
+    {
+        unsigned int r;
+        if (rand_s(&r) != 0)
+            return 0;
+        size_t n = len < sizeof(r) ? len : sizeof(r);
+        memcpy(p, &r, n);
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t emu_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void emu_sleep_us(unsigned us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+int emu_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+int emu_random_bytes(void *buf, size_t len)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    uint8_t *p = buf;
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        len -= (size_t)n;
+    }
+    close(fd);
+    return len == 0;
+}
+#endif
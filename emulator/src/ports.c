@@ -0,0 +1,150 @@
+#include "../include/ports.h"
+#include "../include/cpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+void ports_init(PortBus *bus)
+{
+    memset(bus, 0, sizeof(*bus));
+}
+
+void ports_free(PortBus *bus)
+{
+    for (int i = 0; i < 256; ++i)
+        free(bus->pages[i]);
+    ports_init(bus);
+}
+
+int ports_register(PortBus *bus, uint16_t first, uint32_t count, const PortHandler *handler)
+{
+    for (uint32_t p = first; p < (uint32_t)first + count && p <= 0xFFFF; ++p)
+    {
+        PortHandler **page = &bus->pages[p >> 8];
+        if (!*page && !(*page = calloc(256, sizeof(PortHandler))))
+            return 0;
+        (*page)[p & 0xFF] = *handler;
+    }
+    return 1;
+}
+
+// NULL for unmapped ports (including mapped pages with an empty slot)
+static const PortHandler *lookup(PortBus *bus, uint16_t port)
+{
+    if (!bus)
+        return NULL;
+    PortHandler *page = bus->pages[port >> 8];
+    return page ? &page[port & 0xFF] : NULL;
+}
+
+uint8_t ports_in8(PortBus *bus, uint16_t port)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (h && h->read8)
+        return h->read8(h->dev, port);
+    return 0xFF;
+}
+
+void ports_out8(PortBus *bus, uint16_t port, uint8_t value)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (h && h->write8)
+        h->write8(h->dev, port, value);
+}
+
+uint16_t ports_in16(PortBus *bus, uint16_t port)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (h && h->read16)
+        return h->read16(h->dev, port);
+    return ports_in8(bus, port) | (uint16_t)ports_in8(bus, port + 1) << 8;
+}
+
+void ports_out16(PortBus *bus, uint16_t port, uint16_t value)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (h && h->write16)
+    {
+        h->write16(h->dev, port, value);
+        return;
+    }
+    ports_out8(bus, port, value & 0xFF);
+    ports_out8(bus, port + 1, value >> 8);
+}
+
+void ports_in_block(PortBus *bus, uint16_t port, uint8_t *dst, size_t count, int width)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (h && h->read_block)
+    {
+        h->read_block(h->dev, port, dst, count, width);
+        return;
+    }
+    if (!h)
+    {
+        memset(dst, 0xFF, count * width);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (width == 2)
+        {
+            uint16_t v = ports_in16(bus, port);
+            dst[2 * i] = v & 0xFF;
+            dst[2 * i + 1] = v >> 8;
+        }
+        else
+            dst[i] = ports_in8(bus, port);
+    }
+}
+
+void ports_out_block(PortBus *bus, uint16_t port, const uint8_t *src, size_t count, int width)
+{
+    const PortHandler *h = lookup(bus, port);
+    if (!h)
+        return;
+    if (h->write_block)
+    {
+        h->write_block(h->dev, port, src, count, width);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (width == 2)
+            ports_out16(bus, port, src[2 * i] | (uint16_t)src[2 * i + 1] << 8);
+        else
+            ports_out8(bus, port, src[i]);
+    }
+}
+
+// --- Debug console (port 0xE9) ---
+
+static uint8_t debugcon_read(void *dev, uint16_t port)
+{
+    (void)dev;
+    (void)port;
+    return DEBUGCON_PORT;
+}
+
+static void debugcon_write(void *dev, uint16_t port, uint8_t value)
+{
+    (void)port;
+    emu_putchar((EmuOutput *)dev, (char)value);
+}
+
+static void debugcon_write_block(void *dev, uint16_t port, const uint8_t *src, size_t count, int width)
+{
+    (void)port;
+    // only the low byte of a word write reaches the console
+    for (size_t i = 0; i < count; ++i)
+        emu_putchar((EmuOutput *)dev, (char)src[i * width]);
+}
+
+int ports_add_debugcon(PortBus *bus, EmuOutput *out)
+{
+    PortHandler h = {0};
+    h.dev = out;
+    h.read8 = debugcon_read;
+    h.write8 = debugcon_write;
+    h.write_block = debugcon_write_block;
+    return ports_register(bus, DEBUGCON_PORT, 1, &h);
+}
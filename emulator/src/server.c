@@ -1,61 +1,2661 @@
-#ifdef _WIN32
-#define _WIN32_WINNT 0x0601
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#else
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#define SOCKET int
-#define closesocket close
+#ifdef __linux__
+#define _GNU_SOURCE // F_GET_SEALS
 #endif
+#include "../include/evloop.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../include/asm8086.h"
+#include "../include/asmcache.h"
 #include "../include/cpu.h"
+#include "../include/input.h"
 #include "../include/memory.h"
+#include "../include/log.h"
+#include "../include/lru.h"
+#include "../include/expect.h"
+#include "../include/metrics.h"
+#include "../include/platform.h"
+#include "../include/protocol.h"
+#include "../include/spsc.h"
 
 #define SERVER_PORT 5555
-#define BACKLOG 1
+#define BACKLOG 128
+
+// Network side
+#define READ_CHUNK 65536                  // bytes asked of recv() at a time
+#define REQUEST_MAX (64u * 1024 * 1024)   // largest request accepted on one connection
+#define WRITE_HIGH_WATER (256 * 1024)     // stop draining a stream ring above this much unsent data
+#define MAX_EVENTS 64
+#define MAX_INFLIGHT 64                   // jobs one pipelined connection may have queued or running
+#define MAX_BATCH 1024                    // programs in one MSG_JOB_BATCH
+#define PROGRAM_MAX (0x10000 - 0x100)     // a .COM image loads at 0100h of one segment
+#define EXPECT_SECTION_MAX (1u << 20)     // assertions of one SECTION_EXPECT
+#define SOURCE_MAX (1u << 20)             // assembly source of one SECTION_SOURCE
+#define FLUSH_IOV 64                      // queued buffers handed to one sendmsg()
+#define MAX_PASSED_FDS 64                 // descriptors a Unix socket client may have queued
+#define DEFAULT_UNIX_PATH "/tmp/emu_server.sock"
+#define DEFAULT_INTERACTIVE_QUEUE 256     // programs admitted to a lane and not yet answered
+#define DEFAULT_BATCH_QUEUE 16384
+#define DEFAULT_CLIENT_JOBS 4096          // programs one connection may have admitted
+#define DEFAULT_MAX_SESSIONS 64           // machines kept for MSG_SESSION_*; -S overrides
+#define DEFAULT_SESSION_IDLE_S 300        // a session unused this long is destroyed; -I overrides
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored instead
+#endif
+#endif
+
+// Job limits; -b/-B and -t/-T override them
+#define DEFAULT_BUDGET 1000000000ull     // instructions
+#define MAX_BUDGET 20000000000ull
+#define DEFAULT_TIMEOUT_MS 10000
+#define MAX_TIMEOUT_MS 60000
+#define RUN_SLICE 65536                  // instructions between deadline/output checks
+#define DEFAULT_QUANTUM (2 * RUN_SLICE)  // instructions a job runs before it is requeued; -s overrides
+#define SCHED_LEVELS 4                   // feedback queue levels per lane, the quantum doubles with each
+#define FORK_GRACE_NS 1000000000ull      // fork mode: kill a child this long after its deadline
+#define FORK_POLL_MS 20                   // fork mode: longest wait for a child before checking for MSG_CANCEL
+#define DEFAULT_CACHE_MB 64               // result cache size; -c overrides, 0 disables
+#define DEFAULT_ASM_CACHE_MB 16           // assembly cache size; -a overrides, 0 disables
+#define RATE_WINDOW_NS 5000000000ull      // shortest window the per-second rates cover
+#define METRICS_FILE_INTERVAL_NS 5000000000ull // -m: rewrite the metrics file this often
+
+// Stream mode tuning
+#define STREAM_CHUNK 16384          // max payload of one FRAME_OUTPUT
+#define STREAM_SLOTS 64             // ring capacity (~1 MiB of pending output)
+#define STREAM_HEARTBEAT_NS 100000000ull // 100 ms
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF; p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF; p[3] = (v >> 24) & 0xFF;
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+// One queued frame. The worker fills it in place, the event loop copies it
+// out to the connection.
+typedef struct {
+    uint8_t type;
+    uint32_t len;
+    uint8_t data[STREAM_CHUNK];
+} StreamMsg;
+
+typedef struct Conn Conn;
+typedef struct Batch Batch;
+typedef struct Session Session;
+
+typedef struct Job {
+    CPU8086 cpu;
+    Memory8086 *mem;
+    EmuInput input;
+    PortBus ports;
+    DosFs dos;
+    VideoState video;
+    // owned by the event loop
+    Conn *conn;
+    uint32_t id;            // request id on pipelined connections
+    struct Job *conn_next;  // the connection's jobs in flight
+    struct Job *next_stream; // stream jobs in flight, server-wide
+    struct Job *next;       // pool queue / finished list
+    int stream;             // reply with frames instead of one buffered answer
+    int lane;               // LANE_INTERACTIVE or LANE_BATCH
+    int result_frame;       // JOB_FLAG_RESULT
+    int check_only;         // JOB_FLAG_CHECK_ONLY
+    Batch *batch;           // MSG_JOB_BATCH this job is part of, if any
+    Session *session;       // session whose machine this is, kept after each run
+    uint64_t budget;        // instruction limit, 0 = server default
+    uint32_t timeout_ms;    // wall-clock limit, 0 = server default
+    uint64_t deadline_ns;   // set when the job starts running
+    uint64_t submit_ns;     // handed to the pool
+    // time slicing: the job's feedback queue level, and the totals over all
+    // the quanta it has run so far
+    int level;
+    uint64_t started_ns;    // first quantum, 0 until then
+    uint64_t run_ns;
+    uint64_t slice_start_ns; // quantum in progress, 0 between quanta
+    uint64_t last_beat;     // stream mode: last FRAME_HEARTBEAT
+    // fork mode: the job's sections, loaded by the child into its copy of
+    // the machine image
+    uint8_t *sections;
+    size_t sections_len;
+    // result cache (buffered jobs only)
+    uint8_t *cache_key;
+    size_t cache_key_len;
+    int cached;             // answered from the cache
+    int settled;            // has its result already (cached, assembly error), never runs
+    // MSG_JOB_SHM: the client's shared mapping, output goes to out_off
+    uint8_t *shm;
+    size_t shm_size;
+    uint32_t out_off, out_cap;
+    uint8_t exit_reason;    // EXIT_* once the job has run
+    ExpectSet expect;       // SECTION_EXPECT assertions
+    ExpectResult check;     // their outcome once the job has run
+    uint32_t asm_line;      // SECTION_SOURCE: line of the first assembly error
+    // stream mode only
+    SpscQueue queue;
+    atomic_int notified;    // loop already woken for frames it has not drained
+    atomic_int client_gone; // set by the loop when the connection fails
+    atomic_int cancelled;   // set by the loop for MSG_CANCEL, checked every slice
+    uint64_t instructions;
+    uint64_t output_total;
+    int video_frames;       // JOB_FLAG_VIDEO: send FRAME_VIDEO_TEXT/GFX deltas
+} Job;
+
+// The programs of one MSG_JOB_BATCH. They go through the pool as separate
+// jobs; the worker that finishes the last one hands jobs[0] to the event
+// loop, and jobs[0] stands for the whole batch on the connection.
+struct Batch {
+    Job **jobs;             // request order
+    uint32_t count;
+    atomic_uint remaining;  // jobs not yet run
+};
+
+// A machine kept between MSG_SESSION_* requests. Its job is reused for every
+// run and only freed with the session.
+struct Session {
+    struct Session *next;
+    uint32_t id;
+    uint8_t token[SESSION_TOKEN_SIZE]; // required with the id, so ids cannot be guessed
+    Job *job;
+    int running;            // a MSG_SESSION_RUN is in flight
+    uint64_t last_used_ns;
+};
+
+// Counters of one pool thread, written only by that thread
+typedef struct {
+    _Alignas(64) MetricCounter jobs; // own cache line per worker
+    MetricCounter instructions;
+    MetricCounter busy_ns;
+    MetricCounter preemptions;
+    Histogram queue_time, run_time;
+} WorkerStats;
+
+// Totals at some point in time, for the per-second rates
+typedef struct {
+    uint64_t ns, jobs, instructions, busy_ns;
+} RateSample;
+
+// Queued response bytes, sent in order as the socket accepts them
+typedef struct OutBuf {
+    struct OutBuf *next;
+    size_t len, off;
+    uint8_t data[];
+} OutBuf;
+
+// Priority classes. Workers always take interactive jobs first, and batch
+// jobs only run on the workers not reserved for interactive ones.
+enum { LANE_INTERACTIVE, LANE_BATCH, LANE_COUNT };
+static const char *const lane_names[LANE_COUNT] = { "interactive", "batch" };
+
+// One-shot connections (legacy, E86S, E86J) go READING -> RUNNING ->
+// FLUSHING -> closed. Pipelined ones stay in READING until the client leaves.
+enum { CONN_READING, CONN_RUNNING, CONN_FLUSHING };
 
-static int recv_all(SOCKET sock, void *buf, size_t len) {
-    size_t received = 0;
-    char *p = (char*)buf;
-    while (received < len) {
+struct Conn {
+    SOCKET fd;
+    int state;
+    int dead;              // socket gone; freed once its jobs are done
+    int pipelined;         // E86P handshake done: ID-tagged messages
+    int version;           // pipelined: protocol version agreed on
+    uint8_t *rbuf;         // unprocessed request bytes, NULL while idle
+    size_t rlen, rcap;
+    size_t scan;           // E86J: offset of the first section not yet checked
+    OutBuf *out_head, *out_tail;
+    size_t out_bytes;
+    Job *jobs;             // queued or running
+    int njobs;
+    uint32_t admitted;     // programs in those jobs (a batch counts each one)
+    // one-shot legacy/E86S request: the program is received straight into
+    // the job's guest memory (fork mode: its program section); without a
+    // job the rest of a refused request is read and dropped
+    Job *ingest;
+    uint8_t *ingest_dst;
+    uint32_t ingest_size;
+    size_t ingest_left;
+    int local;             // Unix socket: may pass descriptors
+    int fds[MAX_PASSED_FDS]; // received descriptors, oldest first
+    int nfds;
+    Conn *next_dead;       // freed at the end of the event batch
+};
+
+static struct {
+    EvLoop *loop;
+    SOCKET listen_sock;
+    SOCKET unix_sock;      // -1 when not listening on a Unix socket
+    Job *streaming;
+    Conn *graveyard;
+    // emulation pool: queued jobs in, finished jobs out
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    // one FIFO per lane and level: jobs start at level 0 and move down a
+    // level every time they use up their quantum, and workers take the
+    // lowest non-empty level, so jobs that have run least go first
+    Job *queue_head[LANE_COUNT][SCHED_LEVELS], *queue_tail[LANE_COUNT][SCHED_LEVELS];
+    size_t queued[LANE_COUNT];
+    uint64_t quantum;      // level 0 quantum in instructions, 0 = run to completion
+    int batch_running;     // workers busy with batch lane jobs
+    int batch_workers;     // at most this many at once
+    // admission control, event loop thread only: programs admitted to each
+    // lane and not yet answered, and the limits that trigger busy replies
+    uint32_t lane_jobs[LANE_COUNT], lane_limit[LANE_COUNT];
+    uint32_t client_limit;
+    uint64_t requests_busy[LANE_COUNT];
+    Job *finished, *finished_tail;
+    // jobs answered without the pool, finished after the event batch
+    Job *completed, *completed_tail;
+    // results of deterministic buffered jobs, event loop thread only
+    LruCache *cache;
+    // assembled SECTION_SOURCE, event loop thread only
+    AsmCache *asm_cache;
+    // MSG_SESSION_* machines, event loop thread only
+    Session *sessions;
+    uint32_t sessions_open, max_sessions, next_session_id;
+    uint64_t session_idle_ns;
+    uint64_t sessions_created, sessions_evicted;
+    // job limits
+    uint64_t default_budget, max_budget;
+    uint32_t default_timeout_ms, max_timeout_ms;
+    // fork mode: every job runs in a child of the fork server, forked from a
+    // pre-initialized machine image; fork_fd is the socket to the fork
+    // server, child_fd (in a child) the socket it sends its frames to
+    int fork_mode;
+    Job *image;
+    int fork_fd;
+    pthread_mutex_t fork_lock;
+    atomic_uint_least64_t fork_tokens;
+    int child_fd;
+    // metrics; the plain counters belong to the event loop thread
+    WorkerStats *worker_stats;
+    int workers;
+    uint64_t started_ns;
+    uint64_t jobs_accepted, requests_rejected, requests_cancelled, connections_accepted;
+    size_t connections_open;
+    RateSample rate_old, rate_new;
+    const char *metrics_file;
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .default_budget = DEFAULT_BUDGET,
+    .max_budget = MAX_BUDGET,
+    .default_timeout_ms = DEFAULT_TIMEOUT_MS,
+    .max_timeout_ms = MAX_TIMEOUT_MS,
+    .fork_fd = -1,
+    .fork_lock = PTHREAD_MUTEX_INITIALIZER,
+    .child_fd = -1,
+    .unix_sock = -1,
+    .lane_limit = { DEFAULT_INTERACTIVE_QUEUE, DEFAULT_BATCH_QUEUE },
+    .client_limit = DEFAULT_CLIENT_JOBS,
+    .quantum = DEFAULT_QUANTUM,
+    .max_sessions = DEFAULT_MAX_SESSIONS,
+    .session_idle_ns = DEFAULT_SESSION_IDLE_S * 1000000000ull,
+};
+
+static void job_free(Job *job) {
+    spsc_free(&job->queue);
+    free(job->sections);
+    free(job->cache_key);
+#ifndef _WIN32
+    if (job->shm) munmap(job->shm, job->shm_size);
+#endif
+    input_free(&job->input);
+    expect_free(&job->expect);
+    ports_free(&job->ports);
+    dosfs_free(&job->dos);
+    free(job->mem);
+    free(job);
+}
+
+static void batch_free(Batch *b) {
+    for (uint32_t i = 0; i < b->count; ++i)
+        if (b->jobs[i]) job_free(b->jobs[i]);
+    free(b->jobs);
+    free(b);
+}
+
+// A job without a machine yet
+static Job *job_alloc(void) {
+    Job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    input_init(&job->input);
+    ports_init(&job->ports);
+    dosfs_init(&job->dos, NULL); // jobs only see the files they bring along
+    cpu_init(&job->cpu);
+    expect_init(&job->expect);
+    return job;
+}
+
+// Give the job its own machine, ready to load a program into
+static int job_add_machine(Job *job) {
+    job->mem = calloc(1, sizeof(Memory8086));
+    if (!job->mem) return 0;
+    job->cpu.cs = 0x0000;
+    job->cpu.ip = 0x0100;
+    job->cpu.input = &job->input;
+    if (!ports_add_debugcon(&job->ports, &job->cpu.out)) return 0;
+    job->cpu.ports = &job->ports;
+    job->cpu.dos = &job->dos;
+    video_init(&job->video, job->mem);
+    if (!video_add_cga_ports(&job->video, &job->ports)) return 0;
+    job->cpu.video = &job->video;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Emulation side (pool threads)
+// ---------------------------------------------------------------------------
+
+#ifndef _WIN32
+static StreamMsg child_msg; // fork mode child: the frame being built
+
+// Write one frame to the parent. A failed write means the parent gave up on
+// the job.
+static void child_send(Job *job, const StreamMsg *m) {
+    uint8_t hdr[FRAME_HEADER_SIZE];
+    hdr[0] = m->type;
+    put_le32(hdr + 1, m->len);
+    struct iovec iov[2] = { { hdr, sizeof(hdr) }, { (void*)m->data, m->len } };
+    size_t left = sizeof(hdr) + m->len;
+    while (left > 0) {
+        ssize_t n = writev(server.child_fd, iov, 2);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { atomic_store(&job->client_gone, 1); return; }
+        left -= (size_t)n;
+        for (int i = 0; i < 2; ++i) {
+            size_t k = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (uint8_t*)iov[i].iov_base + k;
+            iov[i].iov_len -= k;
+            n -= (ssize_t)k;
+        }
+    }
+}
+#endif
+
+// Tell the loop there are frames to send, once per drain
+static void stream_notify(Job *job) {
+    if (server.child_fd >= 0) return;
+    if (!atomic_exchange(&job->notified, 1)) evloop_wake(server.loop);
+}
+
+// Reserve a ring slot, waiting for the loop only if the ring is full.
+// Returns NULL once the client is gone so the worker stops producing.
+// A fork mode child builds its frames in child_msg instead.
+static StreamMsg *stream_reserve(Job *job) {
+    StreamMsg *m;
+#ifndef _WIN32
+    if (server.child_fd >= 0) return atomic_load(&job->client_gone) ? NULL : &child_msg;
+#endif
+    while (!(m = spsc_reserve(&job->queue))) {
+        if (atomic_load_explicit(&job->client_gone, memory_order_relaxed)) return NULL;
+        stream_notify(job);
+        emu_sleep_us(50);
+    }
+    return m;
+}
+
+static void stream_publish(Job *job) {
+#ifndef _WIN32
+    if (server.child_fd >= 0) { child_send(job, &child_msg); return; }
+#endif
+    spsc_publish(&job->queue);
+}
+
+// Output sink installed while a stream job runs
+static void stream_sink(void *ctx, const char *data, size_t len) {
+    Job *job = (Job*)ctx;
+    job->output_total += len;
+    expect_output(&job->expect, data, len);
+    while (len > 0) {
+        size_t n = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+        StreamMsg *m = stream_reserve(job);
+        if (!m) return;
+        m->type = FRAME_OUTPUT;
+        m->len = (uint32_t)n;
+        memcpy(m->data, data, n);
+        stream_publish(job);
+        data += n;
+        len -= n;
+    }
+}
+
+// JOB_FLAG_CHECK_ONLY: a buffered reply leaves the output out once the job
+// has passed its assertions
+static int job_omits_output(const Job *job) {
+    return job->check_only && !job->stream && !job->shm && job->check.status == CHECK_PASSED;
+}
+
+// Output bytes a buffered reply carries
+static size_t job_reply_output(const Job *job) {
+    return job_omits_output(job) ? 0 : job->cpu.out.pos;
+}
+
+// Result record (FRAME_RESULT payload), RESULT_SIZE bytes
+static size_t put_result(uint8_t *p, const Job *job, uint32_t output_total) {
+    const CPU8086 *cpu = &job->cpu;
+    put_le64(p, job->instructions);
+    put_le32(p + 8, output_total);
+    p[12] = job->exit_reason;
+    put_le16(p + 13, cpu->cs);
+    put_le16(p + 15, cpu->ip);
+    p[17] = cpu->exit_code;
+    p[18] = cpu->bad_opcode;
+    p[19] = (job->cached ? RESULT_FLAG_CACHED : 0) | (job_omits_output(job) ? RESULT_FLAG_OUTPUT_OMITTED : 0);
+    const uint16_t regs[12] = { cpu->ax, cpu->bx, cpu->cx, cpu->dx, cpu->si, cpu->di,
+                                cpu->bp, cpu->sp, cpu->ds, cpu->es, cpu->ss, cpu->flags };
+    for (int i = 0; i < 12; ++i) put_le16(p + 20 + 2 * i, regs[i]);
+    uint64_t run = job->run_ns;
+    if (job->slice_start_ns) run += emu_now_ns() - job->slice_start_ns;
+    put_le64(p + 44, run);
+    put_le64(p + 52, job->started_ns ? job->started_ns - job->submit_ns : 0);
+    const ExpectResult *chk = &job->check;
+    p[60] = chk->status;
+    p[61] = chk->kind;
+    put_le16(p + 62, chk->index);
+    put_le32(p + 64, chk->where);
+    put_le64(p + 68, chk->expected);
+    put_le64(p + 76, chk->actual);
+    put_le32(p + 84, job->asm_line);
+    return RESULT_SIZE;
+}
+
+// Take the machine state of a result record (not the times, which belong to
+// whoever produced it)
+static void get_result(Job *job, const uint8_t *p) {
+    CPU8086 *cpu = &job->cpu;
+    job->instructions = get_le64(p);
+    job->exit_reason = p[12];
+    cpu->cs = get_le16(p + 13);
+    cpu->ip = get_le16(p + 15);
+    cpu->exit_code = p[17];
+    cpu->bad_opcode = p[18];
+    uint16_t *regs[12] = { &cpu->ax, &cpu->bx, &cpu->cx, &cpu->dx, &cpu->si, &cpu->di,
+                           &cpu->bp, &cpu->sp, &cpu->ds, &cpu->es, &cpu->ss, &cpu->flags };
+    for (int i = 0; i < 12; ++i) *regs[i] = get_le16(p + 20 + 2 * i);
+    ExpectResult *chk = &job->check;
+    chk->status = p[60];
+    chk->kind = p[61];
+    chk->index = get_le16(p + 62);
+    chk->where = get_le32(p + 64);
+    chk->expected = get_le64(p + 68);
+    chk->actual = get_le64(p + 76);
+    job->asm_line = get_le32(p + 84);
+}
+
+static void stream_push_count(Job *job, uint8_t type) {
+    StreamMsg *m = stream_reserve(job);
+    if (!m) return;
+    m->type = type;
+    if (type == FRAME_RESULT) {
+        m->len = (uint32_t)put_result(m->data, job, (uint32_t)job->output_total);
+    } else {
+        put_le64(m->data, job->instructions);
+        m->len = 8;
+    }
+    stream_publish(job);
+}
+
+// Queue the part of the screen changed since the last frame, if any
+static void stream_push_video(Job *job) {
+    StreamMsg *m = stream_reserve(job);
+    if (!m) return;
+    int gfx = video_is_graphics(&job->video);
+    size_t n = gfx ? video_gfx_delta(&job->video, job->mem, m->data, sizeof(m->data))
+                   : video_text_delta(&job->video, job->mem, m->data, sizeof(m->data));
+    if (n == 0) return; // slot stays unpublished and is reused by the next reserve
+    m->type = gfx ? FRAME_VIDEO_GFX : FRAME_VIDEO_TEXT;
+    m->len = (uint32_t)n;
+    stream_publish(job);
+}
+
+// Resolve the job's limits against the server defaults and caps
+static void job_resolve_limits(Job *job) {
+    if (!job->budget) job->budget = server.default_budget;
+    if (job->budget > server.max_budget) job->budget = server.max_budget;
+    if (!job->timeout_ms) job->timeout_ms = server.default_timeout_ms;
+    if (job->timeout_ms > server.max_timeout_ms) job->timeout_ms = server.max_timeout_ms;
+}
+
+static void job_start_clock(Job *job) {
+    job->deadline_ns = emu_now_ns() + (uint64_t)job->timeout_ms * 1000000;
+}
+
+// Run up to RUN_SLICE instructions. Returns 0 once the job is over, with
+// exit_reason set. The clock and the cancel flag are only read between
+// slices, which keeps the per-instruction cost of the limits at one compare.
+static int job_run_slice(Job *job) {
+    if (atomic_load_explicit(&job->cancelled, memory_order_relaxed)) {
+        job->exit_reason = EXIT_CANCELLED;
+    } else {
+        uint64_t left = job->budget - job->instructions;
+        job->instructions += cpu_run(&job->cpu, job->mem, left < RUN_SLICE ? left : RUN_SLICE);
+        switch (job->cpu.stop_reason) {
+        case CPU_STOP_EXIT: job->exit_reason = EXIT_TERMINATED; return 0;
+        case CPU_STOP_HALT: job->exit_reason = EXIT_HALT; return 0;
+        case CPU_STOP_DIVIDE: job->exit_reason = EXIT_DIVIDE_ERROR; return 0;
+        case CPU_STOP_BAD_OPCODE: job->exit_reason = EXIT_BAD_OPCODE; return 0;
+        }
+        if (job->instructions >= job->budget) {
+            job->exit_reason = EXIT_BUDGET;
+        } else if (emu_now_ns() >= job->deadline_ns) {
+            job->exit_reason = EXIT_TIMEOUT;
+        } else {
+            return 1;
+        }
+        // a session run stopping after its instructions is not an error
+        if (job->session && job->exit_reason == EXIT_BUDGET) return 0;
+    }
+    // say why the program was cut off, like the CPU does for HLT
+    char msg[96];
+    if (job->exit_reason == EXIT_BUDGET)
+        snprintf(msg, sizeof(msg), "Instruction budget of %llu exceeded at CS:IP=%04X:%04X\n",
+                 (unsigned long long)job->budget, job->cpu.cs, job->cpu.ip);
+    else if (job->exit_reason == EXIT_TIMEOUT)
+        snprintf(msg, sizeof(msg), "Timeout after %u ms at CS:IP=%04X:%04X\n",
+                 (unsigned)job->timeout_ms, job->cpu.cs, job->cpu.ip);
+    else
+        snprintf(msg, sizeof(msg), "Cancelled at CS:IP=%04X:%04X\n", job->cpu.cs, job->cpu.ip);
+    emu_puts(&job->cpu.out, msg);
+    emu_output_flush(&job->cpu.out);
+    if (job->exit_reason == EXIT_CANCELLED)
+        EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "job %u cancelled at %04X:%04X", job->id, job->cpu.cs, job->cpu.ip);
+    else
+        EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "job %u hit its %s limit at %04X:%04X", job->id,
+                job->exit_reason == EXIT_BUDGET ? "instruction" : "time", job->cpu.cs, job->cpu.ip);
+    return 0;
+}
+
+// Set a job up for its first quantum
+static void job_begin(Job *job) {
+    if (job->stream) emu_set_output_sink(&job->cpu.out, stream_sink, job);
+    job_start_clock(job);
+    job->last_beat = emu_now_ns();
+}
+
+// Run a started job for about quantum instructions (whole slices). Returns
+// 1 if it has to be requeued, 0 once it is over and, in stream mode, its
+// result frame is queued.
+static int job_run(Job *job, uint64_t quantum) {
+    uint64_t stop = quantum > UINT64_MAX - job->instructions ? UINT64_MAX : job->instructions + quantum;
+    while (job_run_slice(job)) {
+        if (job->stream) {
+            emu_output_flush(&job->cpu.out);
+            if (job->video_frames) stream_push_video(job);
+            uint64_t now = emu_now_ns();
+            if (now - job->last_beat >= STREAM_HEARTBEAT_NS) {
+                stream_push_count(job, FRAME_HEARTBEAT);
+                job->last_beat = now;
+            }
+            stream_notify(job);
+            if (atomic_load_explicit(&job->client_gone, memory_order_relaxed)) break;
+        }
+        if (job->instructions >= stop) return 1;
+    }
+    // the assertions see stream output as it goes, buffered output here
+    if (job->stream) {
+        emu_output_flush(&job->cpu.out);
+        if (job->video_frames) stream_push_video(job);
+    } else {
+        expect_output(&job->expect, job->cpu.out.data, job->cpu.out.pos);
+    }
+    expect_finish(&job->expect, &job->cpu, job->mem, job->instructions, &job->check);
+    if (job->stream) stream_push_count(job, FRAME_RESULT);
+    return 0;
+}
+
+static const char *load_job_sections(Job *job, const uint8_t *p, size_t len);
+
+#ifndef _WIN32
+// ---------------------------------------------------------------------------
+// Fork server (fork mode)
+// ---------------------------------------------------------------------------
+//
+// main forks a small process holding the machine image before any cache,
+// socket or thread exists, and every job child is forked from it, not from
+// the server. A child therefore shares no pages with other clients' jobs,
+// sessions or the caches, and forking costs the same however large the
+// server grows. Workers talk to it over server.fork_fd, a stream socket:
+// each message is FORK_MSG_SIZE bytes, u8 FORK_RUN or FORK_KILL and the u64
+// token naming the job. FORK_RUN carries one end of a socketpair; the child
+// reads the job from it (u32 id, u8 video frames, u32 length, sections) and
+// writes its frames back. The fork server reaps its children itself, so it
+// only ever kills one that has not been reaped and its pid cannot have been
+// reused.
+
+#define FORK_RUN 1
+#define FORK_KILL 2
+#define FORK_MSG_SIZE 9
+#define FORK_JOB_HEADER_SIZE 9
+
+typedef struct {
+    uint64_t token;
+    pid_t pid;
+} ForkChild;
+
+static int read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Fork server child: read the job from fd, load it into this process's
+// copy-on-write copy of the machine image and run it, sending every frame
+// back on fd
+static void run_child(int fd) {
+    // keep the fork server's control socket from living on in the child
+    if (dup2(fd, 3) < 0) _exit(1);
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 4, ~0u, 0) != 0)
+#endif
+    {
+        long max = sysconf(_SC_OPEN_MAX);
+        for (long i = 4; i < (max > 0 && max < 65536 ? max : 65536); ++i) close((int)i);
+    }
+    server.child_fd = 3;
+
+    uint8_t hdr[FORK_JOB_HEADER_SIZE];
+    if (!read_all(3, hdr, sizeof(hdr))) _exit(1);
+    size_t len = get_le32(hdr + 5);
+    uint8_t *sections = malloc(len ? len : 1);
+    if (!sections || !read_all(3, sections, len)) _exit(1);
+
+    Job *m = server.image;
+    m->id = get_le32(hdr);
+    m->stream = 1; // the parent gets everything as frames
+    m->slice_start_ns = emu_now_ns();
+    m->video_frames = hdr[4];
+    const char *err = load_job_sections(m, sections, len);
+    job_resolve_limits(m);
+    if (err) {
+        emu_puts(&m->cpu.out, err);
+        m->exit_reason = EXIT_CRASHED;
+        emu_set_output_sink(&m->cpu.out, stream_sink, m);
+        emu_output_flush(&m->cpu.out);
+        stream_push_count(m, FRAME_RESULT);
+        return;
+    }
+    job_begin(m);
+    job_run(m, UINT64_MAX);
+}
+
+// Only there to interrupt the fork server's wait, so it reaps at once
+static void fork_server_sigchld(int sig) {
+    (void)sig;
+}
+
+// Next control message and the descriptor that came with it (-1 if none).
+// Returns 0 once the server has gone, -1 when a child has exited.
+static int fork_server_recv(int ctl, uint8_t *msg, int *fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { msg, FORK_MSG_SIZE };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    *fd = -1;
+    ssize_t n = recvmsg(ctl, &mh, 0);
+    if (n < 0 && errno == EINTR) return -1;
+    if (n <= 0) return 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    // the descriptor comes with the first byte; the rest may follow
+    return read_all(ctl, msg + n, FORK_MSG_SIZE - (size_t)n);
+}
+
+static void fork_server_main(int ctl) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fork_server_sigchld; // no SA_RESTART: recvmsg returns
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    ForkChild *kids = NULL;
+    size_t nkids = 0, cap = 0;
+    for (;;) {
+        uint8_t msg[FORK_MSG_SIZE];
+        int fd;
+        int ok = fork_server_recv(ctl, msg, &fd);
+        // reap before looking anything up, so a pid in the table is never stale
+        pid_t done;
+        while ((done = waitpid(-1, NULL, WNOHANG)) > 0)
+            for (size_t i = 0; i < nkids; ++i)
+                if (kids[i].pid == done) { kids[i] = kids[--nkids]; break; }
+        if (ok < 0) continue;
+        if (!ok) _exit(0);
+        uint64_t token = get_le64(msg + 1);
+        if (msg[0] == FORK_RUN && fd >= 0) {
+            if (nkids == cap) {
+                ForkChild *grown = realloc(kids, (cap ? 2 * cap : 16) * sizeof(*kids));
+                if (grown) { kids = grown; cap = cap ? 2 * cap : 16; }
+            }
+            pid_t pid = nkids < cap ? fork() : -1;
+            if (pid == 0) {
+                close(ctl);
+                signal(SIGCHLD, SIG_DFL);
+                run_child(fd);
+                _exit(0);
+            }
+            if (pid < 0) EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "fork failed: %s", strerror(errno));
+            else kids[nkids++] = (ForkChild){ token, pid };
+            close(fd); // the worker sees EOF if there is no child
+        } else {
+            if (fd >= 0) close(fd);
+            if (msg[0] == FORK_KILL)
+                for (size_t i = 0; i < nkids; ++i)
+                    if (kids[i].token == token) { kill(kids[i].pid, SIGKILL); break; }
+        }
+    }
+}
+
+// Start the fork server. Called from main before anything it should not
+// share with the children exists.
+static int fork_server_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+    pid_t pid = fork();
+    if (pid < 0) { close(sv[0]); close(sv[1]); return 0; }
+    if (pid == 0) {
+        close(sv[0]);
+        // the children log nothing; the server reports what they end with
+        for (int i = 0; i < LOG_CAT_COUNT; ++i) emu_log_threshold[i] = -1;
+        fork_server_main(sv[1]);
+    }
+    close(sv[1]);
+    server.fork_fd = sv[0];
+    // the image lives on in the fork server only
+    job_free(server.image);
+    server.image = NULL;
+    return 1;
+}
+
+// Send a control message, with fd attached unless it is -1. Workers share
+// the socket, so whole messages are written under server.fork_lock.
+static int fork_server_send(uint8_t type, uint64_t token, int fd) {
+    uint8_t msg[FORK_MSG_SIZE];
+    msg[0] = type;
+    put_le64(msg + 1, token);
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { msg, sizeof(msg) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    pthread_mutex_lock(&server.fork_lock);
+    ssize_t n;
+    while ((n = sendmsg(server.fork_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    int ok = n > 0 && write_all(server.fork_fd, msg + n, sizeof(msg) - (size_t)n);
+    pthread_mutex_unlock(&server.fork_lock);
+    return ok;
+}
+
+// Read exactly len bytes from a child of job, giving up at deadline. Returns
+// 1 on success, 0 on EOF or error, -1 at the deadline, -2 once the job is
+// cancelled.
+static int child_read(Job *job, int fd, void *buf, size_t len, uint64_t deadline) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t now = emu_now_ns();
+        if (now >= deadline) return -1;
+        if (atomic_load_explicit(&job->cancelled, memory_order_relaxed)) return -2;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        uint64_t wait_ms = (deadline - now) / 1000000 + 1;
+        int r = poll(&pfd, 1, wait_ms < FORK_POLL_MS ? (int)wait_ms : FORK_POLL_MS);
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) continue;
+        ssize_t n = r < 0 ? -1 : read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Fork mode: have the fork server run the job in a child and turn the frames
+// it sends back into the usual stream frames or buffered result. The worker
+// thread only relays; if the child dies, overruns its deadline or the job is
+// cancelled it is killed and the job ends with EXIT_CRASHED, EXIT_TIMEOUT or
+// EXIT_CANCELLED.
+static void run_forked(Job *job) {
+    int sv[2];
+    uint64_t token = atomic_fetch_add(&server.fork_tokens, 1) + 1;
+    int started = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+        started = fork_server_send(FORK_RUN, token, sv[1]);
+        close(sv[1]);
+        if (!started) close(sv[0]);
+    }
+    if (!started) EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "cannot reach the fork server: %s", strerror(errno));
+
+    job_start_clock(job);
+    uint64_t kill_at = job->deadline_ns + FORK_GRACE_NS;
+    int got_result = 0, status = 0;
+    if (started) {
+        uint8_t hdr[FORK_JOB_HEADER_SIZE];
+        put_le32(hdr, job->id);
+        hdr[4] = (uint8_t)job->video_frames;
+        put_le32(hdr + 5, (uint32_t)job->sections_len);
+        status = write_all(sv[0], hdr, sizeof(hdr)) && write_all(sv[0], job->sections, job->sections_len);
+    }
+    while (status > 0 && !got_result) {
+        uint8_t fhdr[FRAME_HEADER_SIZE];
+        uint8_t buf[STREAM_CHUNK];
+        if ((status = child_read(job, sv[0], fhdr, sizeof(fhdr), kill_at)) <= 0) break;
+        uint32_t len = get_le32(fhdr + 1);
+        if (len > STREAM_CHUNK) { status = 0; break; }
+        StreamMsg *m = job->stream ? stream_reserve(job) : NULL;
+        if (job->stream && !m) break; // client gone
+        uint8_t *data = m ? m->data : buf;
+        if ((status = child_read(job, sv[0], data, len, kill_at)) <= 0) break;
+        if (fhdr[0] == FRAME_OUTPUT) {
+            job->output_total += len;
+            if (!m) emu_write(&job->cpu.out, (const char*)data, len);
+        } else if (fhdr[0] == FRAME_HEARTBEAT && len >= 8) {
+            job->instructions = get_le64(data);
+        } else if (fhdr[0] == FRAME_RESULT && len >= RESULT_SIZE) {
+            get_result(job, data);
+            if (m) len = (uint32_t)put_result(data, job, (uint32_t)job->output_total); // with our own times
+            got_result = 1;
+        }
+        if (m) {
+            m->type = fhdr[0];
+            m->len = len;
+            spsc_publish(&job->queue);
+            stream_notify(job);
+        }
+    }
+    if (started) {
+        if (!got_result) fork_server_send(FORK_KILL, token, -1);
+        close(sv[0]);
+    }
+    if (got_result || atomic_load(&job->client_gone)) return;
+
+    char msg[64];
+    job->exit_reason = status == -2 ? EXIT_CANCELLED : status < 0 ? EXIT_TIMEOUT : EXIT_CRASHED;
+    snprintf(msg, sizeof(msg), status == -2 ? "Cancelled, emulator process killed\n" :
+             status < 0 ? "Timeout, emulator process killed\n" : "Emulator process died\n");
+    EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "job %u: %s", job->id, msg);
+    if (job->stream) {
+        stream_sink(job, msg, strlen(msg));
+        stream_push_count(job, FRAME_RESULT);
+    } else {
+        emu_puts(&job->cpu.out, msg);
+    }
+}
+#endif
+
+// Append a chain of jobs to the queue of their lane and level. Called with
+// the lock held.
+static void pool_enqueue(Job *head, Job *tail, size_t n) {
+    int lane = head->lane, level = head->level;
+    if (server.queue_tail[lane][level]) server.queue_tail[lane][level]->next = head;
+    else server.queue_head[lane][level] = head;
+    server.queue_tail[lane][level] = tail;
+    server.queued[lane] += n;
+}
+
+// First job of the lowest non-empty level, or NULL. Called with the lock held.
+static Job *pool_take_lane(int lane) {
+    for (int level = 0; level < SCHED_LEVELS; ++level) {
+        Job *job = server.queue_head[lane][level];
+        if (!job) continue;
+        server.queue_head[lane][level] = job->next;
+        if (!job->next) server.queue_tail[lane][level] = NULL;
+        server.queued[lane]--;
+        return job;
+    }
+    return NULL;
+}
+
+// Next job for a worker, interactive lane first. Called with the lock held.
+static Job *pool_take(void) {
+    Job *job = pool_take_lane(LANE_INTERACTIVE);
+    if (job || server.batch_running >= server.batch_workers) return job;
+    if ((job = pool_take_lane(LANE_BATCH))) server.batch_running++;
+    return job;
+}
+
+// Instructions the job may run before it goes back to the queue
+static uint64_t job_quantum(const Job *job) {
+    if (!server.quantum || server.quantum > UINT64_MAX >> job->level) return UINT64_MAX;
+    return server.quantum << job->level;
+}
+
+static void *pool_worker(void *arg) {
+    WorkerStats *stats = arg;
+    pthread_mutex_lock(&server.lock);
+    for (;;) {
+        Job *job;
+        while (!(job = pool_take())) pthread_cond_wait(&server.work, &server.lock);
+        pthread_mutex_unlock(&server.lock);
+
+        int more = 0;
+        if (atomic_load_explicit(&job->client_gone, memory_order_relaxed)) {
+            // nobody is waiting for the result
+        } else {
+            uint64_t start = emu_now_ns();
+            uint64_t before = job->instructions;
+            if (!job->started_ns) {
+                job->started_ns = start;
+                histogram_record(&stats->queue_time, start - job->submit_ns);
+                if (!server.fork_mode) job_begin(job);
+            }
+            job->slice_start_ns = start;
+#ifndef _WIN32
+            // a forked child runs to completion
+            if (server.fork_mode) run_forked(job);
+            else
+#endif
+            more = job_run(job, job_quantum(job));
+            uint64_t end = emu_now_ns();
+            job->run_ns += end - start;
+            job->slice_start_ns = 0;
+            metric_add(&stats->instructions, job->instructions - before);
+            metric_add(&stats->busy_ns, end - start);
+            if (more) {
+                metric_add(&stats->preemptions, 1);
+            } else {
+                histogram_record(&stats->run_time, job->run_ns);
+                metric_add(&stats->jobs, 1);
+            }
+        }
+        int lane = job->lane;
+        if (!more && job->batch) job = atomic_fetch_sub(&job->batch->remaining, 1) == 1 ? job->batch->jobs[0] : NULL;
+
+        pthread_mutex_lock(&server.lock);
+        if (lane == LANE_BATCH) {
+            // a worker may be waiting for a free batch slot
+            if (server.batch_running-- == server.batch_workers && server.queued[LANE_BATCH])
+                pthread_cond_signal(&server.work);
+        }
+        if (more) {
+            // used up its quantum: behind everything that has run less
+            if (job->level < SCHED_LEVELS - 1) job->level++;
+            job->next = NULL;
+            pool_enqueue(job, job, 1);
+        } else if (job) {
+            job->next = NULL;
+            if (server.finished_tail) server.finished_tail->next = job;
+            else server.finished = job;
+            server.finished_tail = job;
+            pthread_mutex_unlock(&server.lock);
+            evloop_wake(server.loop);
+            pthread_mutex_lock(&server.lock);
+        }
+    }
+    return NULL;
+}
+
+// Queue the jobs that still have to run under a single lock round trip. They
+// all belong to the same lane and start at level 0.
+static void pool_submit(Job **jobs, size_t n) {
+    Job *head = NULL, *tail = NULL;
+    size_t queued = 0;
+    uint64_t now = emu_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        if (jobs[i]->settled) continue;
+        jobs[i]->next = NULL;
+        jobs[i]->submit_ns = now;
+        if (tail) tail->next = jobs[i];
+        else head = jobs[i];
+        tail = jobs[i];
+        queued++;
+    }
+    if (!queued) return;
+    pthread_mutex_lock(&server.lock);
+    pool_enqueue(head, tail, queued);
+    if (queued == 1) pthread_cond_signal(&server.work);
+    else pthread_cond_broadcast(&server.work);
+    pthread_mutex_unlock(&server.lock);
+}
+
+// ---------------------------------------------------------------------------
+// Request framing
+// ---------------------------------------------------------------------------
+
+// Size limit of one section, or 0 if the section is too large
+static int section_fits(uint8_t tag, uint32_t len) {
+    if (tag == SECTION_PROGRAM) return len <= PROGRAM_MAX;
+    if (tag == SECTION_FILE) return len >= 1 && len <= DOSFS_MAX_FILE_SIZE + 256;
+    if (tag == SECTION_EXPECT) return len <= EXPECT_SECTION_MAX;
+    if (tag == SECTION_SOURCE) return len <= SOURCE_MAX;
+    return len <= REQUEST_MAX;
+}
+
+// Check whether rbuf holds a whole E86J request. Returns its length, 0 if
+// more bytes are needed, or -1 if the request can never be valid.
+static long request_length(Conn *c) {
+    if (c->scan < 5) c->scan = 5; // magic + flags
+    for (;;) {
+        if (c->rlen < c->scan + SECTION_HEADER_SIZE) return 0;
+        uint8_t tag = c->rbuf[c->scan];
+        uint32_t len = get_le32(c->rbuf + c->scan + 1);
+        if (tag == SECTION_END) return (long)(c->scan + SECTION_HEADER_SIZE);
+        if (!section_fits(tag, len)) return -1;
+        size_t end = c->scan + SECTION_HEADER_SIZE + len;
+        if (end > REQUEST_MAX) return -1;
+        if (c->rlen < end) return 0;
+        c->scan = end;
+    }
+}
+
+// Load tagged sections into job. Unknown sections are skipped so older
+// servers keep working with newer clients. Returns NULL on success or the
+// reason the sections were rejected. A job without a machine (fork mode)
+// only has the sections checked and its limits read. SECTION_SOURCE is
+// only checked here; job_create assembles it.
+static const char *load_job_sections(Job *job, const uint8_t *p, size_t len) {
+    size_t pos = 0;
+    int programs = 0;
+    while (pos + SECTION_HEADER_SIZE <= len) {
+        uint8_t tag = p[pos];
+        uint32_t n = get_le32(p + pos + 1);
+        const uint8_t *data = p + pos + SECTION_HEADER_SIZE;
+        if (tag == SECTION_END) return NULL;
+        if (n > len - pos - SECTION_HEADER_SIZE) return "truncated section";
+        if (!section_fits(tag, n)) return tag == SECTION_PROGRAM ? "program too large" : "section too large";
+        pos += SECTION_HEADER_SIZE + n;
+        if (tag == SECTION_PROGRAM || tag == SECTION_SOURCE) {
+            if (++programs > 1) return "more than one program or source section";
+            if (tag == SECTION_PROGRAM && job->mem) memcpy(&job->mem->data[0x100], data, n);
+        } else if (tag == SECTION_INPUT) {
+            if (job->mem && !input_append(&job->input, data, n)) return "out of memory";
+        } else if (tag == SECTION_FILE) {
+            // u8 name length, name, contents
+            char name[DOSFS_NAME_MAX];
+            uint8_t name_len = data[0];
+            if (name_len == 0 || name_len >= sizeof(name) || 1u + name_len > n) return "bad file section";
+            memcpy(name, data + 1, name_len);
+            name[name_len] = 0;
+            if (!dosfs_valid_name(name)) return "bad file section";
+            if (job->mem && !dosfs_add_file(&job->dos, name, data + 1 + name_len, n - 1 - name_len))
+                return "out of memory";
+        } else if (tag == SECTION_BUDGET) {
+            if (n != 8) return "bad budget section";
+            job->budget = get_le64(data);
+        } else if (tag == SECTION_TIMEOUT) {
+            if (n != 4) return "bad timeout section";
+            job->timeout_ms = get_le32(data);
+        } else if (tag == SECTION_EXPECT) {
+            const char *err = expect_validate(data, n);
+            if (err) return err;
+            if (job->mem && !expect_add(&job->expect, data, n)) return "out of memory";
+        }
+    }
+    return "missing end section";
+}
+
+// Result cache key: every section that can change the result except the
+// limits, which are appended in resolved form, plus the core and assembler
+// versions. The sections must have been checked already.
+static uint8_t *job_cache_key(const Job *job, const uint8_t *p, size_t len, size_t *key_len) {
+    uint8_t *key = malloc(len + 16);
+    if (!key) return NULL;
+    size_t n = 0;
+    for (size_t pos = 0; p[pos] != SECTION_END;) {
+        size_t size = SECTION_HEADER_SIZE + get_le32(p + pos + 1);
+        if (p[pos] != SECTION_BUDGET && p[pos] != SECTION_TIMEOUT) {
+            memcpy(key + n, p + pos, size);
+            n += size;
+        }
+        pos += size;
+    }
+    put_le64(key + n, job->budget);
+    put_le32(key + n + 8, EMU_CORE_VERSION);
+    put_le32(key + n + 12, ASM_VERSION);
+    *key_len = n + 16;
+    return key;
+}
+
+// The same key for a job that is a lone program section
+static uint8_t *job_program_cache_key(const Job *job, const uint8_t *prog, uint32_t size, size_t *key_len) {
+    uint8_t *key = malloc(SECTION_HEADER_SIZE + size + 16);
+    if (!key) return NULL;
+    key[0] = SECTION_PROGRAM;
+    put_le32(key + 1, size);
+    memcpy(key + SECTION_HEADER_SIZE, prog, size);
+    put_le64(key + SECTION_HEADER_SIZE + size, job->budget);
+    put_le32(key + SECTION_HEADER_SIZE + size + 8, EMU_CORE_VERSION);
+    put_le32(key + SECTION_HEADER_SIZE + size + 12, ASM_VERSION);
+    *key_len = SECTION_HEADER_SIZE + size + 16;
+    return key;
+}
+
+// Cached result: the result record followed by the output
+static int job_from_cache(Job *job) {
+    size_t len;
+    const uint8_t *v = lru_get(server.cache, job->cache_key, job->cache_key_len, &len);
+    if (!v) return 0;
+    get_result(job, v);
+    emu_write(&job->cpu.out, (const char*)v + RESULT_SIZE, len - RESULT_SIZE);
+    job->cached = 1;
+    job->settled = 1;
+    return 1;
+}
+
+// Remember the result of a finished job if rerunning it would give the
+// same one
+static void job_cache_store(Job *job) {
+    if (!job->cache_key || job->cached) return;
+    if (job->exit_reason == 0 || job->exit_reason == EXIT_TIMEOUT || job->exit_reason == EXIT_CRASHED ||
+        job->exit_reason == EXIT_CANCELLED) return;
+    uint8_t *v = malloc(RESULT_SIZE + job->cpu.out.pos);
+    if (!v) return;
+    put_result(v, job, (uint32_t)job->cpu.out.pos);
+    memcpy(v + RESULT_SIZE, job->cpu.out.data, job->cpu.out.pos);
+    lru_put(server.cache, job->cache_key, job->cache_key_len, v, RESULT_SIZE + job->cpu.out.pos);
+    free(v);
+}
+
+// Assemble the job's SECTION_SOURCE, if any, here on the loop thread: a
+// course-sized program takes microseconds. On success *out is NULL if there
+// was no source, else the sections (*out_len bytes) with a SECTION_PROGRAM
+// in its place. If the source does not assemble the job is settled with
+// EXIT_ASM_ERROR and the messages as its output. Returns 0 if memory ran out.
+static int job_assemble(Job *job, const uint8_t *p, size_t len, uint8_t **out, size_t *out_len) {
+    size_t pos = 0, n = 0;
+    *out = NULL;
+    while (p[pos] != SECTION_SOURCE) {
+        if (p[pos] == SECTION_END) return 1;
+        pos += SECTION_HEADER_SIZE + get_le32(p + pos + 1);
+    }
+    n = get_le32(p + pos + 1);
+    uint64_t start = emu_now_ns();
+    AsmResult res;
+    const char *src = (const char*)p + pos + SECTION_HEADER_SIZE;
+    int ok = server.asm_cache ? asm_cache_assemble(server.asm_cache, src, n, &res) : asm_assemble(src, n, &res);
+    static const char too_large[] = "program too large (over 65280 bytes)\n";
+    int fits = !ok || res.size <= PROGRAM_MAX;
+    if (!ok && !res.errors) {
+        asm_result_free(&res);
+        return 0;
+    }
+    EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "assembled %u source bytes in %llu us: %s", (unsigned)n,
+            (unsigned long long)((emu_now_ns() - start) / 1000), ok ? "ok" : "errors");
+    if (!ok || !fits) {
+        if (ok) emu_write(&job->cpu.out, too_large, sizeof(too_large) - 1);
+        else emu_write(&job->cpu.out, res.errors, res.errors_len);
+        job->exit_reason = EXIT_ASM_ERROR;
+        job->asm_line = (uint32_t)res.error_line;
+        job->settled = 1;
+        asm_result_free(&res);
+        return 1;
+    }
+    size_t rest = len - pos - SECTION_HEADER_SIZE - n;
+    *out_len = pos + SECTION_HEADER_SIZE + res.size + rest;
+    if (!(*out = malloc(*out_len))) {
+        asm_result_free(&res);
+        return 0;
+    }
+    memcpy(*out, p, pos);
+    (*out)[pos] = SECTION_PROGRAM;
+    put_le32(*out + pos + 1, (uint32_t)res.size);
+    memcpy(*out + pos + SECTION_HEADER_SIZE, res.code, res.size);
+    memcpy(*out + pos + SECTION_HEADER_SIZE + res.size, p + pos + SECTION_HEADER_SIZE + n, rest);
+    asm_result_free(&res);
+    return 1;
+}
+
+// Job for a list of sections and JOB_FLAG_* flags. It is answered from the
+// result cache when possible; otherwise source is assembled and the job gets
+// its own machine, or in fork mode keeps the sections for its child.
+static Job *job_create(uint8_t flags, const uint8_t *p, size_t len, const char **err) {
+    Job *job = job_alloc();
+    if (!job) { *err = "out of memory"; return NULL; }
+    job->stream = (flags & JOB_FLAG_STREAM) != 0;
+    job->video_frames = (flags & JOB_FLAG_VIDEO) != 0;
+    job->lane = (flags & JOB_FLAG_LOW_PRIORITY) ? LANE_BATCH : LANE_INTERACTIVE;
+    job->result_frame = (flags & JOB_FLAG_RESULT) != 0;
+    job->check_only = (flags & JOB_FLAG_CHECK_ONLY) != 0;
+    if ((*err = load_job_sections(job, p, len))) {
+        job_free(job);
+        return NULL;
+    }
+    job_resolve_limits(job);
+    *err = "out of memory";
+    if (server.cache && !job->stream) {
+        if (!(job->cache_key = job_cache_key(job, p, len, &job->cache_key_len))) { job_free(job); return NULL; }
+        if (job_from_cache(job)) { *err = NULL; return job; }
+    }
+    uint8_t *assembled;
+    if (!job_assemble(job, p, len, &assembled, &len)) { job_free(job); return NULL; }
+    if (job->settled) { *err = NULL; return job; }
+    if (assembled) p = assembled;
+    if (server.fork_mode) {
+        if (!(job->sections = assembled ? assembled : malloc(len))) { job_free(job); return NULL; }
+        if (!assembled) memcpy(job->sections, p, len);
+        job->sections_len = len;
+    } else if (!job_add_machine(job) || load_job_sections(job, p, len)) {
+        free(assembled);
+        job_free(job);
+        return NULL;
+    } else {
+        free(assembled);
+    }
+    job_resolve_limits(job); // loading read the raw limits again
+    *err = NULL;
+    return job;
+}
+
+// Job for a u8 flags byte followed by sections (E86J body, MSG_JOB payload)
+static Job *job_from_sections(const uint8_t *p, size_t len, const char **err) {
+    if (len < 1) { *err = "empty job"; return NULL; }
+    return job_create(p[0], p + 1, len - 1, err);
+}
+
+// Batch for a MSG_JOB_BATCH payload. On failure err holds the reason.
+static Batch *batch_from_message(const uint8_t *p, size_t len, char *err, size_t err_size) {
+    if (len < 4) { snprintf(err, err_size, "truncated batch"); return NULL; }
+    uint32_t count = get_le32(p) & BATCH_COUNT_MASK;
+    uint8_t flags = (uint8_t)(get_le32(p) >> BATCH_FLAGS_SHIFT);
+    if (flags & ~JOB_FLAG_CHECK_ONLY) { snprintf(err, err_size, "unknown batch flags"); return NULL; }
+    if (count == 0 || count > MAX_BATCH) { snprintf(err, err_size, "batch size must be 1-%d", MAX_BATCH); return NULL; }
+    Batch *b = calloc(1, sizeof(*b));
+    if (!b || !(b->jobs = calloc(count, sizeof(*b->jobs)))) {
+        free(b);
+        snprintf(err, err_size, "out of memory");
+        return NULL;
+    }
+    b->count = count;
+    uint32_t to_run = 0;
+    size_t pos = 4;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (len - pos < 4 || get_le32(p + pos) > len - pos - 4) {
+            snprintf(err, err_size, "program %u: truncated", i);
+            batch_free(b);
+            return NULL;
+        }
+        uint32_t n = get_le32(p + pos);
+        const char *reason = NULL;
+        Job *job = b->jobs[i] = job_create(JOB_FLAG_LOW_PRIORITY | flags, p + pos + 4, n, &reason);
+        if (!job) {
+            snprintf(err, err_size, "program %u: %s", i, reason);
+            batch_free(b);
+            return NULL;
+        }
+        job->batch = b;
+        if (!job->settled) to_run++;
+        pos += 4 + (size_t)n;
+    }
+    atomic_init(&b->remaining, to_run);
+    return b;
+}
+
+// Job for a lone program of size bytes that has yet to arrive (legacy and
+// E86S requests). *dst is where its bytes go: guest memory at 0000:0100, or
+// in fork mode the program section kept for the child.
+static Job *job_for_program(int stream, uint32_t size, uint8_t **dst) {
+    Job *job = job_alloc();
+    if (!job) return NULL;
+    job->stream = stream;
+    job->lane = LANE_INTERACTIVE;
+    job_resolve_limits(job);
+    if (server.fork_mode) {
+        if (!(job->sections = malloc(2 * SECTION_HEADER_SIZE + (size_t)size))) { job_free(job); return NULL; }
+        job->sections_len = 2 * SECTION_HEADER_SIZE + (size_t)size;
+        job->sections[0] = SECTION_PROGRAM;
+        put_le32(job->sections + 1, size);
+        memset(job->sections + SECTION_HEADER_SIZE + size, 0, SECTION_HEADER_SIZE); // SECTION_END
+        *dst = job->sections + SECTION_HEADER_SIZE;
+    } else {
+        if (!job_add_machine(job)) { job_free(job); return NULL; }
+        *dst = &job->mem->data[0x100];
+    }
+    if (stream && !spsc_init(&job->queue, sizeof(StreamMsg), STREAM_SLOTS)) { job_free(job); return NULL; }
+    return job;
+}
+
+// ---------------------------------------------------------------------------
+// Connections (event loop thread only)
+// ---------------------------------------------------------------------------
+
+static int conn_wants_input(const Conn *c) {
+    if (c->dead) return 0;
+    return c->pipelined ? c->njobs < MAX_INFLIGHT : c->state == CONN_READING;
+}
+
+static void conn_update_events(Conn *c) {
+    if (c->dead) return;
+    int events = conn_wants_input(c) ? EV_READ : 0;
+    if (c->out_head) events |= EV_WRITE;
+    evloop_mod(server.loop, c->fd, events, c);
+}
+
+static void conn_retire(Conn *c) {
+    c->next_dead = server.graveyard;
+    server.graveyard = c;
+}
+
+// Drop the socket. The Conn itself lives on until its jobs are done.
+static void conn_close(Conn *c) {
+    if (c->dead) return;
+    c->dead = 1;
+    server.connections_open--;
+    evloop_del(server.loop, c->fd);
+    closesocket(c->fd);
+    for (Job *job = c->jobs; job; job = job->conn_next) {
+        if (job->batch) {
+            // programs still queued are skipped
+            for (uint32_t i = 0; i < job->batch->count; ++i)
+                atomic_store(&job->batch->jobs[i]->client_gone, 1);
+        }
+        atomic_store(&job->client_gone, 1);
+    }
+    if (!c->jobs) conn_retire(c);
+    EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "client done");
+}
+
+static void conn_free(Conn *c) {
+    while (c->out_head) {
+        OutBuf *b = c->out_head;
+        c->out_head = b->next;
+        free(b);
+    }
+    free(c->rbuf);
+    if (c->ingest) job_free(c->ingest);
+#ifndef _WIN32
+    for (int i = 0; i < c->nfds; ++i) close(c->fds[i]);
+#endif
+    free(c);
+}
+
+// Append a len-byte buffer to the send queue for the caller to fill
+static uint8_t *conn_queue_reserve(Conn *c, size_t len) {
+    OutBuf *b = malloc(sizeof(*b) + len);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->len = len;
+    b->off = 0;
+    if (c->out_tail) c->out_tail->next = b;
+    else c->out_head = b;
+    c->out_tail = b;
+    c->out_bytes += b->len;
+    return b->data;
+}
+
+// Append a header and a payload as one queued buffer
+static int conn_queue(Conn *c, const void *hdr, size_t hdr_len, const void *data, size_t len) {
+    uint8_t *p = conn_queue_reserve(c, hdr_len + len);
+    if (!p) return 0;
+    memcpy(p, hdr, hdr_len);
+    if (len) memcpy(p + hdr_len, data, len);
+    return 1;
+}
+
+// Queue one reply frame: the 5-byte header, or the ID-tagged one on
+// pipelined connections
+static int conn_queue_frame(Conn *c, uint32_t id, uint8_t type, const void *data, size_t len) {
+    uint8_t hdr[MSG_HEADER_SIZE];
+    hdr[0] = type;
+    if (!c->pipelined) {
+        put_le32(hdr + 1, (uint32_t)len);
+        return conn_queue(c, hdr, FRAME_HEADER_SIZE, data, len);
+    }
+    put_le32(hdr + 1, id);
+    put_le32(hdr + 5, (uint32_t)len);
+    return conn_queue(c, hdr, MSG_HEADER_SIZE, data, len);
+}
+
+typedef struct {
+    const void *data;
+    size_t len;
+} IoPart;
+
+// Send a reply made of several parts. With nothing queued ahead of it, it
+// goes out straight from where the parts are in one sendmsg(), and only what
+// the socket did not take is copied to the send queue.
+static int conn_send_parts(Conn *c, const IoPart *parts, int n) {
+    size_t total = 0, sent = 0;
+    for (int i = 0; i < n; ++i) total += parts[i].len;
+#ifndef _WIN32
+    if (!c->out_head && !c->dead) {
+        struct iovec iov[8];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        for (int i = 0; i < n && i < 8; ++i) {
+            iov[i].iov_base = (void*)parts[i].data;
+            iov[i].iov_len = parts[i].len;
+            msg.msg_iovlen++;
+        }
+        msg.msg_iov = iov;
+        ssize_t r = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (r > 0) sent = (size_t)r;
+        else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return 0;
+    }
+#endif
+    if (sent == total) return 1;
+    uint8_t *p = conn_queue_reserve(c, total - sent);
+    if (!p) return 0;
+    for (int i = 0; i < n; ++i) {
+        size_t skip = sent < parts[i].len ? sent : parts[i].len;
+        sent -= skip;
+        memcpy(p, (const uint8_t*)parts[i].data + skip, parts[i].len - skip);
+        p += parts[i].len - skip;
+    }
+    return 1;
+}
+
+static void conn_send_error(Conn *c, uint32_t id, const char *reason) {
+    server.requests_rejected++;
+    EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "request %u rejected: %s", id, reason);
+    if (!conn_queue_frame(c, id, FRAME_ERROR, reason, strlen(reason))) conn_close(c);
+}
+
+// Send as much queued output as the socket takes, up to FLUSH_IOV buffers
+// per sendmsg(). Closes the connection on error or once a one-shot reply is
+// fully sent.
+static void conn_flush(Conn *c) {
+    while (c->out_head && !c->dead) {
+        size_t want;
 #ifdef _WIN32
-        int r = recv(sock, p + received, (int)(len - received), 0);
+        want = c->out_head->len - c->out_head->off;
+        int n = send(c->fd, (const char*)c->out_head->data + c->out_head->off, (int)want, 0);
+        if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+        struct iovec iov[FLUSH_IOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        want = 0;
+        for (OutBuf *b = c->out_head; b && msg.msg_iovlen < FLUSH_IOV; b = b->next) {
+            iov[msg.msg_iovlen].iov_base = b->data + b->off;
+            iov[msg.msg_iovlen++].iov_len = b->len - b->off;
+            want += b->len - b->off;
+        }
+        msg.msg_iov = iov;
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+#endif
+        if (n <= 0) {
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "send failed");
+            conn_close(c);
+            return;
+        }
+        c->out_bytes -= (size_t)n;
+        for (size_t left = (size_t)n; left > 0;) {
+            OutBuf *b = c->out_head;
+            size_t rest = b->len - b->off;
+            if (left < rest) { b->off += left; break; }
+            left -= rest;
+            c->out_head = b->next;
+            free(b);
+        }
+        if (!c->out_head) c->out_tail = NULL;
+        if ((size_t)n < want) break; // socket buffer full
+    }
+    if (!c->out_head && c->state == CONN_FLUSHING) { conn_close(c); return; }
+    conn_update_events(c);
+}
+
+// Move published frames from a stream job's ring to its connection. Unless
+// all is set, stop at the high-water mark so a slow client eventually leaves
+// the ring full and the worker waits instead of the server buffering
+// without end.
+static void conn_drain_stream(Job *job, int all) {
+    Conn *c = job->conn;
+    StreamMsg *m;
+    atomic_store(&job->notified, 0);
+    while (!c->dead && (all || c->out_bytes < WRITE_HIGH_WATER) && (m = spsc_peek(&job->queue))) {
+        if (!conn_queue_frame(c, job->id, m->type, m->data, m->len)) conn_close(c);
+        spsc_release(&job->queue);
+    }
+}
+
+// Why n more programs for a lane cannot be queued for this connection, or
+// NULL if they can
+static const char *conn_admit(const Conn *c, int lane, uint32_t n) {
+    if (server.lane_jobs[lane] + n > server.lane_limit[lane])
+        return lane == LANE_BATCH ? "server busy: batch queue full" : "server busy: queue full";
+    if (c->admitted + n > server.client_limit) return "server busy: too many jobs from this connection";
+    return NULL;
+}
+
+// Answer a request that will not run. Pipelined requests get a frame of
+// frame_type with the reason; one-shot ones the reason as output, followed in
+// stream mode by a result with exit_reason (legacy replies have no status).
+// One-shot connections are left for the caller to move on.
+static void conn_refuse(Conn *c, uint32_t id, int stream, uint8_t frame_type, uint8_t exit_reason, const char *reason) {
+    int ok;
+    if (c->pipelined) {
+        ok = conn_queue_frame(c, id, frame_type, reason, strlen(reason));
+    } else if (stream) {
+        uint8_t result[RESULT_SIZE] = {0};
+        put_le32(result + 8, (uint32_t)strlen(reason));
+        result[12] = exit_reason;
+        ok = conn_queue_frame(c, 0, FRAME_OUTPUT, reason, strlen(reason)) &&
+             conn_queue_frame(c, 0, FRAME_RESULT, result, sizeof(result));
+    } else {
+        uint8_t hdr[4];
+        put_le32(hdr, (uint32_t)strlen(reason));
+        ok = conn_queue(c, hdr, sizeof(hdr), reason, strlen(reason));
+    }
+    if (!ok) conn_close(c);
+}
+
+// Turn a request away without queueing it. The connection is not blamed,
+// the client may retry later.
+static void conn_send_busy(Conn *c, uint32_t id, int lane, int stream, const char *reason) {
+    server.requests_busy[lane]++;
+    EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "%s", reason);
+    conn_refuse(c, id, stream, FRAME_BUSY, EXIT_BUSY, reason);
+}
+
+// Programs a job stands for in the admission counts
+static uint32_t job_programs(const Job *job) {
+    return job->batch ? job->batch->count : 1;
+}
+
+static void conn_attach_job(Conn *c, Job *job, uint32_t id) {
+    job->conn = c;
+    job->id = id;
+    job->conn_next = c->jobs;
+    c->jobs = job;
+    c->njobs++;
+    c->admitted += job_programs(job);
+    server.lane_jobs[job->lane] += job_programs(job);
+    if (job->stream) {
+        job->next_stream = server.streaming;
+        server.streaming = job;
+    }
+    server.jobs_accepted += job->batch ? job->batch->count : 1;
+    if (job->batch ? atomic_load(&job->batch->remaining) == 0 : job->settled) {
+        // nothing to run, finish it once the current event batch is done
+        job->next = NULL;
+        if (server.completed_tail) server.completed_tail->next = job;
+        else server.completed = job;
+        server.completed_tail = job;
+    } else if (job->batch) {
+        pool_submit(job->batch->jobs, job->batch->count);
+    } else {
+        pool_submit(&job, 1);
+    }
+}
+
+static void conn_detach_job(Conn *c, Job *job) {
+    for (Job **p = &c->jobs; *p; p = &(*p)->conn_next)
+        if (*p == job) { *p = job->conn_next; break; }
+    c->njobs--;
+    c->admitted -= job_programs(job);
+    server.lane_jobs[job->lane] -= job_programs(job);
+    if (job->stream)
+        for (Job **p = &server.streaming; *p; p = &(*p)->next_stream)
+            if (*p == job) { *p = job->next_stream; break; }
+}
+
+// Drop n processed bytes from the front of rbuf
+static void conn_consume(Conn *c, size_t n) {
+    c->rlen -= n;
+    c->scan = 0;
+    if (c->rlen == 0) {
+        // idle connections keep no buffer
+        free(c->rbuf);
+        c->rbuf = NULL;
+        c->rcap = 0;
+    } else {
+        memmove(c->rbuf, c->rbuf + n, c->rlen);
+    }
+}
+
+// All server metrics in the Prometheus text format (MSG_STATS, -m file).
+// Worker counters are summed on the fly; the per-second rates cover the
+// time since a sample at least RATE_WINDOW_NS old.
+static void server_stats_text(MetricsText *t) {
+    uint64_t now = emu_now_ns();
+    RateSample cur = { now, 0, 0, 0 };
+    HistogramTotal queue_time = {0}, run_time = {0};
+    uint64_t preemptions = 0;
+    for (int i = 0; i < server.workers; ++i) {
+        WorkerStats *w = &server.worker_stats[i];
+        cur.jobs += metric_read(&w->jobs);
+        cur.instructions += metric_read(&w->instructions);
+        cur.busy_ns += metric_read(&w->busy_ns);
+        preemptions += metric_read(&w->preemptions);
+        histogram_total_add(&queue_time, &w->queue_time);
+        histogram_total_add(&run_time, &w->run_time);
+    }
+    if (now - server.rate_new.ns >= RATE_WINDOW_NS) {
+        server.rate_old = server.rate_new;
+        server.rate_new = cur;
+    }
+    const RateSample *base = &server.rate_old;
+    double secs = (double)(now - base->ns) / 1e9;
+    if (secs <= 0) secs = 1;
+    size_t queued[LANE_COUNT];
+    pthread_mutex_lock(&server.lock);
+    memcpy(queued, server.queued, sizeof(queued));
+    pthread_mutex_unlock(&server.lock);
+    LruStats cs = {0};
+    if (server.cache) lru_stats(server.cache, &cs);
+    AsmCacheStats as = {0};
+    if (server.asm_cache) asm_cache_stats(server.asm_cache, &as);
+
+    metrics_text_printf(t, "emu_uptime_seconds %.3f\n", (double)(now - server.started_ns) / 1e9);
+    metrics_text_printf(t, "emu_workers %d\n", server.workers);
+    metrics_text_printf(t, "emu_connections_open %llu\n", (unsigned long long)server.connections_open);
+    metrics_text_printf(t, "emu_connections_total %llu\n", (unsigned long long)server.connections_accepted);
+    metrics_text_printf(t, "emu_requests_rejected_total %llu\n", (unsigned long long)server.requests_rejected);
+    metrics_text_printf(t, "emu_requests_cancelled_total %llu\n", (unsigned long long)server.requests_cancelled);
+    metrics_text_printf(t, "emu_jobs_accepted_total %llu\n", (unsigned long long)server.jobs_accepted);
+    metrics_text_printf(t, "emu_jobs_run_total %llu\n", (unsigned long long)cur.jobs);
+    metrics_text_printf(t, "emu_instructions_total %llu\n", (unsigned long long)cur.instructions);
+    metrics_text_printf(t, "emu_jobs_preempted_total %llu\n", (unsigned long long)preemptions);
+    metrics_text_printf(t, "emu_worker_busy_seconds_total %.6f\n", (double)cur.busy_ns / 1e9);
+    for (int lane = 0; lane < LANE_COUNT; ++lane) {
+        metrics_text_printf(t, "emu_queue_depth{lane=\"%s\"} %llu\n", lane_names[lane], (unsigned long long)queued[lane]);
+        metrics_text_printf(t, "emu_lane_jobs{lane=\"%s\"} %u\n", lane_names[lane], (unsigned)server.lane_jobs[lane]);
+        metrics_text_printf(t, "emu_lane_limit{lane=\"%s\"} %u\n", lane_names[lane], (unsigned)server.lane_limit[lane]);
+        metrics_text_printf(t, "emu_requests_busy_total{lane=\"%s\"} %llu\n", lane_names[lane],
+                            (unsigned long long)server.requests_busy[lane]);
+    }
+    metrics_text_printf(t, "emu_jobs_per_second %.3f\n", (double)(cur.jobs - base->jobs) / secs);
+    metrics_text_printf(t, "emu_instructions_per_second %.0f\n", (double)(cur.instructions - base->instructions) / secs);
+    metrics_text_printf(t, "emu_worker_utilization %.4f\n",
+                        (double)(cur.busy_ns - base->busy_ns) / 1e9 / secs / server.workers);
+    metrics_text_printf(t, "emu_cache_hits_total %llu\n", (unsigned long long)cs.hits);
+    metrics_text_printf(t, "emu_cache_misses_total %llu\n", (unsigned long long)cs.misses);
+    metrics_text_printf(t, "emu_cache_evictions_total %llu\n", (unsigned long long)cs.evictions);
+    metrics_text_printf(t, "emu_cache_entries %llu\n", (unsigned long long)cs.entries);
+    metrics_text_printf(t, "emu_cache_bytes %llu\n", (unsigned long long)cs.bytes);
+    metrics_text_printf(t, "emu_asm_cache_hits_total %llu\n", (unsigned long long)as.mem.hits);
+    metrics_text_printf(t, "emu_asm_cache_misses_total %llu\n", (unsigned long long)as.mem.misses);
+    metrics_text_printf(t, "emu_asm_cache_disk_loaded %llu\n", (unsigned long long)as.disk_loaded);
+    metrics_text_printf(t, "emu_asm_cache_disk_writes_total %llu\n", (unsigned long long)as.disk_writes);
+    metrics_text_printf(t, "emu_asm_cache_entries %llu\n", (unsigned long long)as.mem.entries);
+    metrics_text_printf(t, "emu_asm_cache_bytes %llu\n", (unsigned long long)as.mem.bytes);
+    metrics_text_printf(t, "emu_sessions_open %u\n", (unsigned)server.sessions_open);
+    metrics_text_printf(t, "emu_sessions_created_total %llu\n", (unsigned long long)server.sessions_created);
+    metrics_text_printf(t, "emu_sessions_evicted_total %llu\n", (unsigned long long)server.sessions_evicted);
+    metrics_text_histogram(t, "emu_job_queue_seconds", "Time jobs waited for a worker", &queue_time);
+    metrics_text_histogram(t, "emu_job_run_seconds", "Time jobs spent running", &run_time);
+}
+
+// -m: replace the metrics file, for a textfile collector to pick up
+static void write_metrics_file(void) {
+    MetricsText t = {0};
+    server_stats_text(&t);
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", server.metrics_file);
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        fwrite(t.data, 1, t.len, f);
+        if (fclose(f) == 0) rename(tmp, server.metrics_file);
+    } else {
+        EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "cannot write %s", tmp);
+    }
+    metrics_text_free(&t);
+}
+
+#ifndef _WIN32
+// Whether the file behind fd can no longer shrink. The mapping is used long
+// after its size was checked, and a client truncating it meanwhile would
+// otherwise make the server's next access to it fault (SIGBUS).
+static int shm_size_sealed(int fd) {
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals >= 0 && (seals & F_SEAL_SHRINK);
 #else
-        ssize_t r = recv(sock, p + received, len - received, 0);
+    (void)fd;
+    return 0; // no seals here, so no shared memory jobs
+#endif
+}
+
+// MSG_JOB_SHM: map the descriptor that came with the message, copy the
+// program out of it and remember where the output goes
+static void conn_handle_shm_job(Conn *c, uint32_t id, const uint8_t *p, size_t len) {
+    if (c->nfds == 0) { conn_send_error(c, id, "no shared memory descriptor"); return; }
+    int fd = c->fds[0];
+    memmove(c->fds, c->fds + 1, (size_t)--c->nfds * sizeof(c->fds[0]));
+    int lane = len && (p[0] & JOB_FLAG_LOW_PRIORITY) ? LANE_BATCH : LANE_INTERACTIVE;
+    const char *busy = conn_admit(c, lane, 1);
+    if (busy) {
+        close(fd);
+        conn_send_busy(c, id, lane, 0, busy);
+        return;
+    }
+    if (!shm_size_sealed(fd)) {
+        close(fd);
+        conn_send_error(c, id, "shared memory must be a memfd sealed with F_SEAL_SHRINK");
+        return;
+    }
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    if (len >= SHM_JOB_HEADER_SIZE && fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { conn_send_error(c, id, "bad shared memory job"); return; }
+    size_t size = (size_t)st.st_size;
+    uint64_t prog_off = get_le32(p + 1), prog_len = get_le32(p + 5);
+    uint64_t out_off = get_le32(p + 9), out_cap = get_le32(p + 13);
+    if ((p[0] & JOB_FLAG_STREAM) || prog_off + prog_len > size || out_off + out_cap > size ||
+        !section_fits(SECTION_PROGRAM, (uint32_t)prog_len)) {
+        munmap(map, size);
+        conn_send_error(c, id, "bad shared memory job");
+        return;
+    }
+    // the program as the first section, followed by the client's
+    size_t rest = len - SHM_JOB_HEADER_SIZE;
+    uint8_t *sections = malloc(SECTION_HEADER_SIZE + prog_len + rest);
+    const char *err = "out of memory";
+    Job *job = NULL;
+    if (sections) {
+        sections[0] = SECTION_PROGRAM;
+        put_le32(sections + 1, (uint32_t)prog_len);
+        memcpy(sections + SECTION_HEADER_SIZE, map + prog_off, prog_len);
+        memcpy(sections + SECTION_HEADER_SIZE + prog_len, p + SHM_JOB_HEADER_SIZE, rest);
+        job = job_create(p[0], sections, SECTION_HEADER_SIZE + prog_len + rest, &err);
+        free(sections);
+    }
+    if (!job) {
+        munmap(map, size);
+        conn_send_error(c, id, err);
+        return;
+    }
+    job->shm = map;
+    job->shm_size = size;
+    job->out_off = (uint32_t)out_off;
+    job->out_cap = (uint32_t)out_cap;
+    conn_attach_job(c, job, id);
+}
 #endif
-        if (r <= 0) return 0;
-        received += r;
+
+// ---------------------------------------------------------------------------
+// Sessions (event loop thread only)
+// ---------------------------------------------------------------------------
+
+// A machine for a session, loaded with the sections if there are any (len 0
+// for an empty one). Returns NULL with the reason in *err; a source that
+// does not assemble gives a settled job whose output holds the messages.
+static Job *session_machine(const uint8_t *p, size_t len, const char **err) {
+    Job *job = job_alloc();
+    *err = "out of memory";
+    if (!job) return NULL;
+    uint8_t *assembled = NULL;
+    if (len) {
+        if ((*err = load_job_sections(job, p, len))) { job_free(job); return NULL; }
+        *err = "sessions take no assertions";
+        if (job->expect.count) { job_free(job); return NULL; }
+        *err = "out of memory";
+        if (!job_assemble(job, p, len, &assembled, &len)) { job_free(job); return NULL; }
+        if (job->settled) return job;
+        if (assembled) p = assembled;
+    }
+    if (!job_add_machine(job) || (len && load_job_sections(job, p, len))) {
+        free(assembled);
+        job_free(job);
+        return NULL;
+    }
+    free(assembled);
+    *err = NULL;
+    return job;
+}
+
+static void session_free(Session *s) {
+    for (Session **p = &server.sessions; *p; p = &(*p)->next)
+        if (*p == s) { *p = s->next; break; }
+    server.sessions_open--;
+    job_free(s->job);
+    free(s);
+}
+
+// Compares every byte, so the time taken says nothing about the token
+static int session_token_matches(const Session *s, const uint8_t *token) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < SESSION_TOKEN_SIZE; ++i) diff |= s->token[i] ^ token[i];
+    return diff == 0;
+}
+
+// Destroy the sessions nobody has used for server.session_idle_ns
+static void sessions_evict_idle(uint64_t now) {
+    for (Session *s = server.sessions, *next; s; s = next) {
+        next = s->next;
+        if (s->running || now - s->last_used_ns < server.session_idle_ns) continue;
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "session %u idle, destroyed", s->id);
+        server.sessions_evicted++;
+        session_free(s);
+    }
+}
+
+// FRAME_SESSION: the session id, then len bytes of data
+static void conn_send_session(Conn *c, uint32_t id, uint32_t session, const void *data, size_t len) {
+    uint8_t hdr[MSG_HEADER_SIZE + 4];
+    hdr[0] = FRAME_SESSION;
+    put_le32(hdr + 1, id);
+    put_le32(hdr + 5, (uint32_t)(4 + len));
+    put_le32(hdr + 9, session);
+    IoPart parts[2] = { { hdr, sizeof(hdr) }, { data, len } };
+    if (!conn_send_parts(c, parts, len ? 2 : 1)) conn_close(c);
+}
+
+static void conn_send_session_regs(Conn *c, uint32_t id, const Session *s) {
+    const CPU8086 *cpu = &s->job->cpu;
+    const uint16_t regs[EXPECT_REG_COUNT] = { cpu->ax, cpu->bx, cpu->cx, cpu->dx, cpu->si, cpu->di, cpu->bp,
+                                              cpu->sp, cpu->ds, cpu->es, cpu->ss, cpu->flags, cpu->cs, cpu->ip };
+    uint8_t data[2 * EXPECT_REG_COUNT + 1];
+    for (int i = 0; i < EXPECT_REG_COUNT; ++i) put_le16(data + 2 * i, regs[i]);
+    data[2 * EXPECT_REG_COUNT] = cpu->stop_reason != CPU_RUNNING ? s->job->exit_reason : 0;
+    conn_send_session(c, id, s->id, data, sizeof(data));
+}
+
+// Queue a session's machine for n more instructions, like a buffered
+// MSG_JOB. The job is reused, so everything a run leaves behind but the
+// machine state is reset first.
+static void session_run(Conn *c, uint32_t id, Session *s, uint64_t n, uint32_t timeout_ms) {
+    Job *job = s->job;
+    job->budget = n;
+    job->timeout_ms = timeout_ms;
+    job_resolve_limits(job);
+    job->instructions = 0;
+    job->level = 0;
+    job->started_ns = 0;
+    job->run_ns = 0;
+    emu_output_reset(&job->cpu.out);
+    atomic_store(&job->client_gone, 0);
+    atomic_store(&job->cancelled, 0);
+    // a machine that has stopped answers at once with how it stopped
+    job->settled = job->cpu.stop_reason != CPU_RUNNING;
+    if (!job->settled) job->exit_reason = 0;
+    s->running = 1;
+    conn_attach_job(c, job, id);
+}
+
+static void conn_handle_session(Conn *c, uint8_t type, uint32_t id, const uint8_t *p, size_t len) {
+    if (server.fork_mode) { conn_send_error(c, id, "sessions are not available in fork mode"); return; }
+    if (type == MSG_SESSION_CREATE) {
+        if (server.sessions_open >= server.max_sessions) {
+            conn_refuse(c, id, 0, FRAME_BUSY, EXIT_BUSY, "server busy: too many sessions");
+            return;
+        }
+        const char *err = "out of memory";
+        Session *s = calloc(1, sizeof(*s));
+        if (s && !emu_random_bytes(s->token, sizeof(s->token))) {
+            free(s);
+            s = NULL;
+            err = "no random source for the session token";
+        }
+        Job *job = s ? session_machine(p, len, &err) : NULL;
+        if (!job || job->settled) {
+            conn_send_error(c, id, job ? job->cpu.out.data : err);
+            if (job) job_free(job);
+            free(s);
+            return;
+        }
+        s->id = ++server.next_session_id;
+        s->job = job;
+        job->session = s;
+        s->last_used_ns = emu_now_ns();
+        s->next = server.sessions;
+        server.sessions = s;
+        server.sessions_open++;
+        server.sessions_created++;
+        conn_send_session(c, id, s->id, s->token, sizeof(s->token));
+        return;
+    }
+    Session *s = NULL;
+    if (len >= 4 + SESSION_TOKEN_SIZE) {
+        for (s = server.sessions; s && s->id != get_le32(p); s = s->next) {}
+        if (s && !session_token_matches(s, p + 4)) s = NULL;
+    }
+    if (!s) { conn_send_error(c, id, "no such session"); return; }
+    if (s->running) { conn_send_error(c, id, "session is running"); return; }
+    s->last_used_ns = emu_now_ns();
+    p += 4 + SESSION_TOKEN_SIZE;
+    len -= 4 + SESSION_TOKEN_SIZE;
+    Job *job = s->job;
+    switch (type) {
+    case MSG_SESSION_LOAD: {
+        const char *err;
+        Job *fresh = session_machine(p, len, &err);
+        if (!fresh || fresh->settled) {
+            conn_send_error(c, id, fresh ? fresh->cpu.out.data : err);
+            if (fresh) job_free(fresh);
+            return;
+        }
+        job_free(job);
+        s->job = fresh;
+        fresh->session = s;
+        conn_send_session(c, id, s->id, NULL, 0);
+        return;
+    }
+    case MSG_SESSION_RUN: {
+        if (len != 12) { conn_send_error(c, id, "bad session run"); return; }
+        const char *busy = conn_admit(c, LANE_INTERACTIVE, 1);
+        if (busy) { conn_send_busy(c, id, LANE_INTERACTIVE, 0, busy); return; }
+        session_run(c, id, s, get_le64(p), get_le32(p + 8));
+        return;
+    }
+    case MSG_SESSION_GET_REGS:
+        conn_send_session_regs(c, id, s);
+        return;
+    case MSG_SESSION_SET_REGS: {
+        if (len % 3) { conn_send_error(c, id, "bad register list"); return; }
+        for (size_t i = 0; i < len; i += 3)
+            if (p[i] >= EXPECT_REG_COUNT) { conn_send_error(c, id, "bad register list"); return; }
+        CPU8086 *cpu = &job->cpu;
+        uint16_t *regs[EXPECT_REG_COUNT] = { &cpu->ax, &cpu->bx, &cpu->cx, &cpu->dx, &cpu->si, &cpu->di, &cpu->bp,
+                                             &cpu->sp, &cpu->ds, &cpu->es, &cpu->ss, &cpu->flags, &cpu->cs, &cpu->ip };
+        for (size_t i = 0; i < len; i += 3) *regs[p[i]] = get_le16(p + i + 1);
+        cpu->stop_reason = CPU_RUNNING;
+        job->exit_reason = 0;
+        conn_send_session_regs(c, id, s);
+        return;
+    }
+    case MSG_SESSION_READ:
+    case MSG_SESSION_WRITE: {
+        uint32_t addr = len >= 4 ? get_le32(p) : MEMORY_SIZE;
+        size_t n = type == MSG_SESSION_READ ? (len == 8 ? get_le32(p + 4) : MEMORY_SIZE + 1) : len - 4;
+        if (addr >= MEMORY_SIZE || n > MEMORY_SIZE - addr) { conn_send_error(c, id, "bad memory range"); return; }
+        if (type == MSG_SESSION_READ) {
+            conn_send_session(c, id, s->id, job->mem->data + addr, n);
+            return;
+        }
+        memcpy(job->mem->data + addr, p + 4, n);
+        mem_mark_written(job->mem, addr, (uint32_t)n);
+        conn_send_session(c, id, s->id, NULL, 0);
+        return;
     }
+    case MSG_SESSION_FRAME: {
+        if (len != 1 || p[0] > SESSION_FRAME_PPM) { conn_send_error(c, id, "bad frame format"); return; }
+        if (!video_is_graphics(&job->video)) { conn_send_error(c, id, "not in a graphics mode"); return; }
+        size_t n;
+        uint8_t *frame;
+        if (p[0] == SESSION_FRAME_PPM) {
+            frame = video_render_ppm(&job->video, job->mem, &n);
+        } else {
+            uint16_t width = (uint16_t)video_width(&job->video);
+            n = 4 + (size_t)width * CGA_HEIGHT;
+            frame = malloc(n);
+            if (frame) {
+                put_le16(frame, width);
+                put_le16(frame + 2, CGA_HEIGHT);
+                video_render_indexed(&job->video, job->mem, frame + 4);
+            }
+        }
+        if (!frame) { conn_send_error(c, id, "out of memory"); return; }
+        conn_send_session(c, id, s->id, frame, n);
+        free(frame);
+        return;
+    }
+    case MSG_SESSION_DESTROY: {
+        uint32_t session = s->id;
+        session_free(s);
+        conn_send_session(c, id, session, NULL, 0);
+        return;
+    }
+    }
+}
+
+static void conn_handle_message(Conn *c, uint8_t type, uint32_t id, const uint8_t *p, size_t len) {
+    // overload check before any machine is built for the request
+    int lane = LANE_BATCH;
+    uint32_t programs = 1;
+    if (type == MSG_JOB && len) lane = (p[0] & JOB_FLAG_LOW_PRIORITY) ? LANE_BATCH : LANE_INTERACTIVE;
+    if (type == MSG_JOB_BATCH && len >= 4 && (get_le32(p) & BATCH_COUNT_MASK) <= MAX_BATCH)
+        programs = get_le32(p) & BATCH_COUNT_MASK;
+    const char *busy = type == MSG_JOB || type == MSG_JOB_BATCH ? conn_admit(c, lane, programs) : NULL;
+    if (busy) {
+        conn_send_busy(c, id, lane, 0, busy);
+        return;
+    }
+    if (type == MSG_JOB) {
+        const char *err = NULL;
+        Job *job = job_from_sections(p, len, &err);
+        if (!job || (job->stream && !spsc_init(&job->queue, sizeof(StreamMsg), STREAM_SLOTS))) {
+            if (job) { job_free(job); err = "out of memory"; }
+            conn_send_error(c, id, err);
+            return;
+        }
+        conn_attach_job(c, job, id);
+        return;
+    }
+    if (type == MSG_JOB_BATCH) {
+        char err[64];
+        Batch *b = batch_from_message(p, len, err, sizeof(err));
+        if (!b) { conn_send_error(c, id, err); return; }
+        conn_attach_job(c, b->jobs[0], id);
+        return;
+    }
+#ifndef _WIN32
+    if (type == MSG_JOB_SHM) {
+        conn_handle_shm_job(c, id, p, len);
+        return;
+    }
+#endif
+    if ((type >= MSG_SESSION_CREATE && type <= MSG_SESSION_DESTROY) || type == MSG_SESSION_FRAME) {
+        conn_handle_session(c, type, id, p, len);
+        return;
+    }
+    if (type == MSG_CANCEL) {
+        Job *job = NULL;
+        if (len == 4)
+            for (job = c->jobs; job && job->id != get_le32(p); job = job->conn_next) {}
+        if (!job) { conn_send_error(c, id, "no job with that id in flight"); return; }
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "request %u cancelled", job->id);
+        server.requests_cancelled++;
+        if (job->batch)
+            for (uint32_t i = 0; i < job->batch->count; ++i) atomic_store(&job->batch->jobs[i]->cancelled, 1);
+        atomic_store(&job->cancelled, 1);
+        return;
+    }
+    if (type == MSG_STATS) {
+        MetricsText t = {0};
+        server_stats_text(&t);
+        if (t.failed || !conn_queue_frame(c, id, FRAME_STATS, t.data, t.len)) conn_close(c);
+        metrics_text_free(&t);
+        return;
+    }
+    conn_send_error(c, id, "unknown message type");
+}
+
+// n more bytes of an ingested program have arrived at c->ingest_dst. Once
+// they are all there the job is looked up in the cache and queued, or for a
+// refused request the connection answers and closes.
+static void conn_ingest_advance(Conn *c, size_t n) {
+    c->ingest_left -= n;
+    if (c->ingest_dst) c->ingest_dst += n;
+    if (c->ingest_left) return;
+    Job *job = c->ingest;
+    c->ingest = NULL;
+    if (!job) {
+        c->state = CONN_FLUSHING;
+        return;
+    }
+    const uint8_t *prog = c->ingest_dst - c->ingest_size;
+    if (server.cache && !job->stream) {
+        job->cache_key = job_program_cache_key(job, prog, c->ingest_size, &job->cache_key_len);
+        if (job->cache_key) job_from_cache(job);
+    }
+    c->state = CONN_RUNNING;
+    conn_attach_job(c, job, 0);
+}
+
+// Legacy and E86S requests: as soon as the program length is known, build
+// the job and have the program received straight into its memory. A
+// program that is too large, or arrives while the server is busy, is read
+// and dropped so the reason reaches the client before the connection
+// closes. Returns 0 if the length has not arrived yet.
+static int conn_begin_program(Conn *c) {
+    int stream = get_le32(c->rbuf) == EMU_STREAM_MAGIC;
+    size_t hdr = stream ? 8 : 4;
+    if (c->rlen < hdr) return 0;
+    uint32_t size = get_le32(c->rbuf + hdr - 4);
+    conn_consume(c, hdr);
+    char reason[96];
+    const char *busy;
+    uint8_t *dst = NULL;
+    Job *job = NULL;
+    if (size > PROGRAM_MAX) {
+        snprintf(reason, sizeof(reason), "program too large: %u bytes, at most %u\n", (unsigned)size, (unsigned)PROGRAM_MAX);
+        EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "%s", reason);
+        server.requests_rejected++;
+        conn_refuse(c, 0, stream, FRAME_ERROR, EXIT_REJECTED, reason);
+    } else if ((busy = conn_admit(c, LANE_INTERACTIVE, 1))) {
+        conn_send_busy(c, 0, LANE_INTERACTIVE, stream, busy);
+    } else if (!(job = job_for_program(stream, size, &dst))) {
+        server.requests_rejected++;
+        conn_refuse(c, 0, stream, FRAME_ERROR, EXIT_REJECTED, "out of memory");
+    }
+    if (c->dead) {
+        if (job) job_free(job);
+        return 1;
+    }
+    c->ingest = job;
+    c->ingest_dst = dst;
+    c->ingest_size = size;
+    c->ingest_left = size;
+    // whatever came with the header; the rest is received in place
+    size_t have = c->rlen < size ? c->rlen : size;
+    if (dst && have) memcpy(dst, c->rbuf, have);
+    if (have) conn_consume(c, have);
+    if (have || !size) conn_ingest_advance(c, have);
     return 1;
 }
 
-static int send_all(SOCKET sock, const void *buf, size_t len) {
-    size_t sent = 0;
-    const char *p = (const char*)buf;
-    while (sent < len) {
+// Act on every complete request in rbuf
+static void conn_process_input(Conn *c) {
+    while (conn_wants_input(c)) {
+        if (c->pipelined) {
+            if (c->rlen < MSG_HEADER_SIZE) break;
+            uint32_t len = get_le32(c->rbuf + 5);
+            if (len > REQUEST_MAX) {
+                EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "message too large (%u bytes)", len);
+                conn_close(c);
+                return;
+            }
+            if (c->rlen < MSG_HEADER_SIZE + (size_t)len) break;
+            conn_handle_message(c, c->rbuf[0], get_le32(c->rbuf + 1), c->rbuf + MSG_HEADER_SIZE, len);
+            conn_consume(c, MSG_HEADER_SIZE + (size_t)len);
+            continue;
+        }
+        if (c->rlen >= 4 && get_le32(c->rbuf) == EMU_PIPE_MAGIC) {
+            if (c->rlen < 6) break;
+            uint16_t version = (uint16_t)(c->rbuf[4] | c->rbuf[5] << 8);
+            if (version == 0) { conn_close(c); return; }
+            c->version = version < EMU_PROTOCOL_VERSION ? version : EMU_PROTOCOL_VERSION;
+            uint8_t hello[6];
+            put_le32(hello, EMU_PIPE_MAGIC);
+            put_le16(hello + 4, (uint16_t)c->version);
+            if (!conn_queue(c, hello, sizeof(hello), NULL, 0)) { conn_close(c); return; }
+            c->pipelined = 1;
+            conn_consume(c, 6);
+            EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "pipelined connection, client version %u", version);
+            continue;
+        }
+        if (c->rlen < 4) break;
+        if (get_le32(c->rbuf) != EMU_JOB_MAGIC) {
+            if (!conn_begin_program(c)) break;
+            continue;
+        }
+        if (c->rlen < 5) break;
+        long len = request_length(c);
+        uint8_t flags = c->rbuf[4];
+        int stream = (flags & JOB_FLAG_STREAM) != 0;
+        if (len < 0 || (len == 0 && c->rlen >= REQUEST_MAX)) {
+            // the rest of the request cannot be told apart from what follows
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "bad request");
+            server.requests_rejected++;
+            conn_refuse(c, 0, stream, FRAME_ERROR, EXIT_REJECTED, "bad request: section too large or malformed");
+            c->state = CONN_FLUSHING;
+            break;
+        }
+        if (len == 0) break;
+        int lane = (flags & JOB_FLAG_LOW_PRIORITY) ? LANE_BATCH : LANE_INTERACTIVE;
+        const char *busy = conn_admit(c, lane, 1);
+        if (busy) {
+            conn_consume(c, (size_t)len);
+            conn_send_busy(c, 0, lane, stream, busy);
+            c->state = CONN_FLUSHING;
+            break;
+        }
+        const char *err = NULL;
+        Job *job = job_from_sections(c->rbuf + 4, (size_t)len - 4, &err);
+        conn_consume(c, (size_t)len);
+        if (job && job->stream && !spsc_init(&job->queue, sizeof(StreamMsg), STREAM_SLOTS)) {
+            job_free(job);
+            job = NULL;
+            err = "out of memory";
+        }
+        if (!job) {
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "failed read job: %s", err);
+            server.requests_rejected++;
+            conn_refuse(c, 0, stream, FRAME_ERROR, EXIT_REJECTED, err);
+            c->state = CONN_FLUSHING;
+            break;
+        }
+        c->state = CONN_RUNNING;
+        conn_attach_job(c, job, 0);
+    }
+    conn_flush(c);
+}
+
+#ifndef _WIN32
+// recv() for Unix socket clients, also queueing any descriptors passed
+// along; beyond MAX_PASSED_FDS they are closed
+static ssize_t conn_recv_fds(Conn *c, void *buf, size_t len) {
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(8 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t n = recvmsg(c->fd, &msg, 0);
+#endif
+    if (n < 0) return n;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (c->nfds < MAX_PASSED_FDS) c->fds[c->nfds++] = fd;
+            else close(fd);
+        }
+    }
+    return n;
+}
+#endif
+
+static void conn_on_readable(Conn *c) {
+    while (conn_wants_input(c)) {
+        if (c->ingest_left && c->ingest_dst) {
+            // straight into guest memory
 #ifdef _WIN32
-        int s = send(sock, p + sent, (int)(len - sent), 0);
+            int n = recv(c->fd, (char*)c->ingest_dst, (int)c->ingest_left, 0);
+            if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK) return;
 #else
-        ssize_t s = send(sock, p + sent, len - sent, 0);
+            ssize_t n = recv(c->fd, c->ingest_dst, c->ingest_left, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+#endif
+            if (n <= 0) {
+                EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "connection closed mid-request");
+                conn_close(c);
+                return;
+            }
+            conn_ingest_advance(c, (size_t)n);
+            if (!c->ingest_left) conn_flush(c);
+            continue;
+        }
+        if (c->rcap - c->rlen < READ_CHUNK) {
+            size_t cap = c->rcap ? c->rcap * 2 : READ_CHUNK;
+            while (cap - c->rlen < READ_CHUNK) cap *= 2;
+            uint8_t *p = realloc(c->rbuf, cap);
+            if (!p) { conn_close(c); return; }
+            c->rbuf = p;
+            c->rcap = cap;
+        }
+#ifdef _WIN32
+        int n = recv(c->fd, (char*)c->rbuf + c->rlen, (int)(c->rcap - c->rlen), 0);
+        if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK) return;
+#else
+        ssize_t n = c->local ? conn_recv_fds(c, c->rbuf + c->rlen, c->rcap - c->rlen)
+                             : recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+#endif
+        if (n <= 0) {
+            if (n < 0 || c->rlen > 0) EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "connection closed mid-request");
+            conn_close(c);
+            return;
+        }
+        if (c->ingest_left) {
+            // dropping the rest of a refused program
+            size_t drop = (size_t)n < c->ingest_left ? (size_t)n : c->ingest_left;
+            conn_ingest_advance(c, drop);
+            if (c->ingest_left) continue;
+            conn_flush(c);
+            return;
+        }
+        c->rlen += (size_t)n;
+        conn_process_input(c);
+    }
+}
+
+// Queue the FRAME_BATCH_RESULT for a finished batch, built in place
+static int conn_queue_batch_result(Conn *c, uint32_t id, const Batch *b) {
+    size_t entry = c->version >= 2 ? RESULT_SIZE : 17;
+    size_t len = 4;
+    for (uint32_t i = 0; i < b->count; ++i) len += entry + job_reply_output(b->jobs[i]);
+    uint8_t *p = conn_queue_reserve(c, MSG_HEADER_SIZE + len);
+    if (!p) return 0;
+    p[0] = FRAME_BATCH_RESULT;
+    put_le32(p + 1, id);
+    put_le32(p + 5, (uint32_t)len);
+    p += MSG_HEADER_SIZE;
+    put_le32(p, b->count);
+    p += 4;
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const Job *job = b->jobs[i];
+        size_t out = job_reply_output(job);
+        if (c->version >= 2) {
+            put_result(p, job, (uint32_t)job->cpu.out.pos);
+            memcpy(p + RESULT_SIZE, job->cpu.out.data, out);
+            p += RESULT_SIZE + out;
+            continue;
+        }
+        p[0] = job->exit_reason;
+        put_le64(p + 1, job->instructions);
+        p[9] = job->cpu.cs & 0xFF; p[10] = job->cpu.cs >> 8;
+        p[11] = job->cpu.ip & 0xFF; p[12] = job->cpu.ip >> 8;
+        put_le32(p + 13, (uint32_t)out);
+        memcpy(p + 17, job->cpu.out.data, out);
+        p += 17 + out;
+    }
+    return 1;
+}
+
+// Reply for a job the pool has finished
+static void conn_finish_job(Job *job) {
+    Conn *c = job->conn;
+    conn_detach_job(c, job);
+    if (server.cache) {
+        if (job->batch)
+            for (uint32_t i = 0; i < job->batch->count; ++i) job_cache_store(job->batch->jobs[i]);
+        else
+            job_cache_store(job);
+    }
+    if (job->batch) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "batch of %u programs done", job->batch->count);
+        if (!c->dead && !conn_queue_batch_result(c, job->id, job->batch)) conn_close(c);
+    } else if (!c->dead && job->stream && job->settled) {
+        // never ran (assembly error): the messages and the result
+        uint8_t result[RESULT_SIZE];
+        put_result(result, job, (uint32_t)job->cpu.out.pos);
+        if (!conn_queue_frame(c, job->id, FRAME_OUTPUT, job->cpu.out.data, job->cpu.out.pos) ||
+            !conn_queue_frame(c, job->id, FRAME_RESULT, result, sizeof(result)))
+            conn_close(c);
+    } else if (!c->dead && job->stream) {
+        conn_drain_stream(job, 1);
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "stream job done: %llu instructions, %llu output bytes",
+                (unsigned long long)job->instructions, (unsigned long long)job->output_total);
+#ifndef _WIN32
+    } else if (!c->dead && job->shm) {
+        // output straight into the client's memory, only the result on the wire
+        uint32_t n = job->cpu.out.pos < job->out_cap ? (uint32_t)job->cpu.out.pos : job->out_cap;
+        memcpy(job->shm + job->out_off, job->cpu.out.data, n);
+        uint8_t result[RESULT_SIZE];
+        put_result(result, job, n);
+        if (!conn_queue_frame(c, job->id, FRAME_RESULT, result, sizeof(result))) conn_close(c);
 #endif
-        if (s <= 0) return 0;
-        sent += s;
+    } else if (!c->dead && c->pipelined) {
+        // whole output in one frame, then the usual result, in one send
+        size_t out = job_reply_output(job);
+        uint8_t out_hdr[MSG_HEADER_SIZE], res[MSG_HEADER_SIZE + RESULT_SIZE];
+        out_hdr[0] = FRAME_OUTPUT;
+        put_le32(out_hdr + 1, job->id);
+        put_le32(out_hdr + 5, (uint32_t)out);
+        res[0] = FRAME_RESULT;
+        put_le32(res + 1, job->id);
+        put_le32(res + 5, RESULT_SIZE);
+        put_result(res + MSG_HEADER_SIZE, job, (uint32_t)job->cpu.out.pos);
+        IoPart parts[3] = { { out_hdr, sizeof(out_hdr) }, { job->cpu.out.data, out }, { res, sizeof(res) } };
+        if (!out ? !conn_send_parts(c, parts + 2, 1) : !conn_send_parts(c, parts, 3)) conn_close(c);
+    } else if (!c->dead) {
+        // u32 length and output, plus the result frame if asked for
+        size_t out = job_reply_output(job);
+        uint8_t hdr[4], res[FRAME_HEADER_SIZE + RESULT_SIZE];
+        put_le32(hdr, (uint32_t)out);
+        res[0] = FRAME_RESULT;
+        put_le32(res + 1, RESULT_SIZE);
+        put_result(res + FRAME_HEADER_SIZE, job, (uint32_t)job->cpu.out.pos);
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "output %u bytes", (unsigned)job->cpu.out.pos);
+        IoPart parts[3] = { { hdr, sizeof(hdr) }, { job->cpu.out.data, out }, { res, sizeof(res) } };
+        if (!conn_send_parts(c, parts, job->result_frame ? 3 : 2)) conn_close(c);
+    }
+    if (job->batch) {
+        batch_free(job->batch);
+    } else if (job->session) {
+        job->session->running = 0;
+        job->session->last_used_ns = emu_now_ns();
+    } else {
+        job_free(job);
+    }
+    if (c->dead) {
+        if (!c->jobs) conn_retire(c);
+        return;
+    }
+    if (!c->pipelined) c->state = CONN_FLUSHING;
+    // a pipelined connection may have requests waiting for a free slot
+    conn_process_input(c);
+}
+
+static void accept_clients(SOCKET listen_sock) {
+    for (;;) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        SOCKET fd = accept(listen_sock, (struct sockaddr*)&client_addr, &client_len);
+        if (fd < 0) return; // EAGAIN, or an aborted connection
+        Conn *c = calloc(1, sizeof(*c));
+        if (!c || !evloop_set_nonblocking(fd) || !evloop_add(server.loop, fd, EV_READ, c)) {
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "failed to register client");
+            free(c);
+            closesocket(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->local = listen_sock == server.unix_sock;
+        server.connections_accepted++;
+        server.connections_open++;
+        EMU_LOG(LOG_CAT_SERVER, LOG_DEBUG, "client connected");
+    }
+}
+
+// Wakeup from the pool: finished jobs and new stream frames
+static void handle_wakeup(void) {
+    pthread_mutex_lock(&server.lock);
+    Job *done = server.finished;
+    server.finished = server.finished_tail = NULL;
+    pthread_mutex_unlock(&server.lock);
+    while (done) {
+        Job *next = done->next;
+        conn_finish_job(done);
+        done = next;
+    }
+    // closing a connection leaves this list alone, finishing a job does not
+    // happen in here, so it is safe to walk while flushing
+    for (Job *job = server.streaming; job; job = job->next_stream) {
+        if (job->conn->dead || !atomic_load(&job->notified)) continue;
+        conn_drain_stream(job, 0);
+        conn_flush(job->conn);
+    }
+}
+
+static void conn_on_writable(Conn *c) {
+    for (Job *job = c->jobs; job && !c->dead; job = job->conn_next)
+        if (job->stream) conn_drain_stream(job, 0);
+    conn_flush(c);
+}
+
+#ifndef _WIN32
+// Listen on the Unix socket at path. A socket file nobody answers on is left
+// over from a previous run and replaced; one that answers belongs to a
+// running server and is left alone. Returns 0 with errno set on failure.
+static int unix_listen(const char *path) {
+    struct sockaddr_un ua;
+    memset(&ua, 0, sizeof(ua));
+    ua.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(ua.sun_path)) { errno = ENAMETOOLONG; return 0; }
+    strcpy(ua.sun_path, path);
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr*)&ua, sizeof(ua)) == 0) {
+        close(probe);
+        errno = EADDRINUSE;
+        return 0;
+    }
+    int stale = probe >= 0 && errno == ECONNREFUSED;
+    if (probe >= 0) close(probe);
+    if (stale) unlink(path);
+    server.unix_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.unix_sock < 0) return 0;
+    if (bind(server.unix_sock, (struct sockaddr*)&ua, sizeof(ua)) < 0 || listen(server.unix_sock, BACKLOG) < 0 ||
+        !evloop_set_nonblocking(server.unix_sock) ||
+        !evloop_add(server.loop, server.unix_sock, EV_READ, &server.unix_sock)) {
+        int err = errno;
+        close(server.unix_sock);
+        server.unix_sock = -1;
+        errno = err;
+        return 0;
     }
     return 1;
 }
+#endif
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-b budget] [-B max-budget] [-t timeout-ms] [-T max-timeout-ms] [-c cache-mb] [-m metrics-file] [-u socket-path]\n"
+                    "          [-a asm-cache-mb] [-A asm-cache-dir] [-q interactive-queue] [-Q batch-queue] [-C client-jobs] [-r reserved-workers]\n"
+                    "          [-s slice-instructions] [-S sessions] [-I session-idle-s] [--fork]\n"
+                    "  budgets are instruction counts; a job's own limits are capped at the maximums\n"
+                    "  -c sets the result cache size in MiB (default %d, 0 disables it)\n"
+                    "  -a sets the assembly cache size in MiB (default %d, 0 disables it), -A also keeps\n"
+                    "  assembled programs as files in asm-cache-dir, which must exist, across restarts\n"
+                    "  -m rewrites metrics-file with the server counters every 5 seconds\n"
+                    "  -q/-Q bound the programs waiting or running in each lane (default %d/%d), -C those of\n"
+                    "  one connection (default %d); beyond that requests get an immediate busy reply\n"
+                    "  -r keeps workers for interactive jobs only (default 1 with two or more workers)\n"
+                    "  -s sets the instructions a job runs before yielding its worker (default %d, doubling\n"
+                    "  for each slice it has used up; 0 runs jobs to completion)\n"
+                    "  -S bounds the sessions kept (default %d), -I destroys those idle this many seconds\n"
+                    "  (default %d)\n"
+                    "  -u also listens on a Unix socket (default %s, \"\" for none)\n"
+                    "  --fork runs every job in its own process, forked from a pre-initialized machine\n", prog, DEFAULT_CACHE_MB, DEFAULT_ASM_CACHE_MB,
+            DEFAULT_INTERACTIVE_QUEUE, DEFAULT_BATCH_QUEUE, DEFAULT_CLIENT_JOBS, DEFAULT_QUANTUM,
+            DEFAULT_MAX_SESSIONS, DEFAULT_SESSION_IDLE_S,
+#ifdef _WIN32
+            "none"
+#else
+            DEFAULT_UNIX_PATH
+#endif
+            );
+}
 
-int main(void) {
+int main(int argc, char **argv) {
+    emu_log_init_from_env();
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    int workers = emu_cpu_count();
+    long cache_mb = DEFAULT_CACHE_MB;
+    long asm_cache_mb = DEFAULT_ASM_CACHE_MB;
+    const char *asm_cache_dir = NULL;
+    int reserved = -1;
+#ifndef _WIN32
+    const char *unix_path = DEFAULT_UNIX_PATH;
+#ifndef _WIN32
+    int unix_path_given = 0; // -u: failing to listen there is fatal
+#endif
+#endif
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cache_mb = atol(argv[++i]);
+            if (cache_mb < 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            asm_cache_mb = atol(argv[++i]);
+            if (asm_cache_mb < 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+            asm_cache_dir = argv[++i];
+#ifndef _WIN32
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+            unix_path_given = 1;
+#endif
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            server.lane_limit[LANE_INTERACTIVE] = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-Q") == 0 && i + 1 < argc) {
+            server.lane_limit[LANE_BATCH] = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            server.client_limit = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            server.quantum = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            server.max_sessions = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            server.session_idle_ns = strtoull(argv[++i], NULL, 10) * 1000000000ull;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            reserved = atoi(argv[++i]);
+            if (reserved < 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            server.metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            server.default_budget = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            server.max_budget = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            server.default_timeout_ms = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            server.max_timeout_ms = (uint32_t)strtoul(argv[++i], NULL, 10);
+#ifndef _WIN32
+        } else if (strcmp(argv[i], "--fork") == 0) {
+            server.fork_mode = 1;
+#endif
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!server.default_budget || !server.max_budget || !server.default_timeout_ms || !server.max_timeout_ms) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!server.lane_limit[LANE_INTERACTIVE] || !server.lane_limit[LANE_BATCH] || !server.client_limit) {
+        usage(argv[0]);
+        return 1;
+    }
+    // batch work may use every worker but the reserved ones, and always at
+    // least one
+    if (reserved < 0) reserved = workers > 1;
+    server.batch_workers = workers - reserved < 1 ? 1 : workers - reserved;
+    if (server.default_budget > server.max_budget) server.default_budget = server.max_budget;
+    if (server.default_timeout_ms > server.max_timeout_ms) server.default_timeout_ms = server.max_timeout_ms;
+#ifndef _WIN32
+    // built before any thread, cache or socket exists and handed to the fork
+    // server, so every child starts from the same pages and nothing else
+    if (server.fork_mode && (!(server.image = job_alloc()) || !job_add_machine(server.image))) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to build the machine image");
+        return 1;
+    }
+    if (server.fork_mode && !fork_server_start()) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to start the fork server: %s", strerror(errno));
+        return 1;
+    }
+#endif
+    if (cache_mb > 0 && !(server.cache = lru_new((size_t)cache_mb << 20))) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to allocate the result cache");
+        return 1;
+    }
+    if (asm_cache_mb > 0 && !(server.asm_cache = asm_cache_new((size_t)asm_cache_mb << 20, asm_cache_dir))) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to allocate the assembly cache");
+        return 1;
+    }
 #ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
-        fprintf(stderr, "WSAStartup failed\n");
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "WSAStartup failed");
         return 1;
     }
 #endif
@@ -83,89 +2683,98 @@ int main(void) {
     if (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
     if (listen(listen_sock, BACKLOG) < 0) { perror("listen"); return 1; }
 
-    fprintf(stderr, "emu_server listening on port %d\n", SERVER_PORT);
     FILE *logfile = fopen("emu_server.log", "w");
-    fprintf(logfile, "emu_server listening on port %d\n", SERVER_PORT);
-
-    for (;;) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        SOCKET client = accept(listen_sock, (struct sockaddr*)&client_addr, (socklen_t*)&client_len);
-        if (client < 0) { perror("accept"); break; }
-        fprintf(stderr, "client connected\n");
+    if (logfile) emu_log_set_file(logfile);
 
-        // Read 4-byte little-endian size
-        uint32_t size = 0;
-        if (!recv_all(client, &size, sizeof(size))) { fprintf(stderr, "failed read size\n");
-#ifdef _WIN32
-            closesocket(client);
-#else
-            close(client);
+    server.listen_sock = listen_sock;
+    server.loop = evloop_new();
+    if (!server.loop || !evloop_set_nonblocking(listen_sock) ||
+        !evloop_add(server.loop, listen_sock, EV_READ, &server.listen_sock)) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to set up the event loop");
+        return 1;
+    }
+#ifndef _WIN32
+    // Local clients skip the TCP stack, and may pass shared memory. Only a
+    // socket asked for with -u is worth failing over; the default one is a
+    // convenience that another instance or user may hold.
+    if (unix_path[0]) {
+        if (unix_listen(unix_path)) {
+            EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "also listening on %s", unix_path);
+        } else if (unix_path_given) {
+            perror(unix_path);
+            return 1;
+        } else {
+            EMU_LOG(LOG_CAT_SERVER, LOG_WARN, "not listening on %s (%s), TCP only", unix_path, strerror(errno));
+        }
+    }
 #endif
-            continue;
+
+    server.started_ns = server.rate_old.ns = server.rate_new.ns = emu_now_ns();
+    server.workers = workers;
+    // one spare element to round the array up to a cache line boundary
+    void *stats_mem = calloc((size_t)workers + 1, sizeof(WorkerStats));
+    if (!stats_mem) {
+        EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "out of memory");
+        return 1;
+    }
+    server.worker_stats = (WorkerStats*)(((uintptr_t)stats_mem + 63) & ~(uintptr_t)63);
+    for (int i = 0; i < workers; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, pool_worker, &server.worker_stats[i]) != 0) {
+            EMU_LOG(LOG_CAT_SERVER, LOG_ERROR, "failed to start worker %d", i);
+            return 1;
         }
+        pthread_detach(t);
+    }
+    EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "emu_server listening on port %d with %d workers%s", SERVER_PORT, workers,
+            server.fork_mode ? ", one process per job" : "");
+    EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "batch jobs use up to %d workers; queues %u interactive, %u batch, %u per connection",
+            server.batch_workers, (unsigned)server.lane_limit[LANE_INTERACTIVE],
+            (unsigned)server.lane_limit[LANE_BATCH], (unsigned)server.client_limit);
+    EMU_LOG(LOG_CAT_SERVER, LOG_INFO, "job limits: %llu instructions (max %llu), %u ms (max %u ms)",
+            (unsigned long long)server.default_budget, (unsigned long long)server.max_budget,
+            (unsigned)server.default_timeout_ms, (unsigned)server.max_timeout_ms);
 
-        // Limit size to 64KB - 256 for safety
-        if (size > 65536) size = 65536;
-        uint8_t *buf = malloc(size);
-        if (!buf) { fprintf(stderr, "alloc failed\n");
-#ifdef _WIN32
-            closesocket(client);
-#else
-            close(client);
-#endif
-            continue;
+    EvEvent events[MAX_EVENTS];
+    uint64_t metrics_written = 0;
+    for (;;) {
+        // a timer tick while there is a metrics file to write or sessions that may go idle
+        int n = evloop_wait(server.loop, events, MAX_EVENTS, server.metrics_file || server.sessions ? 1000 : -1);
+        if (n < 0) { perror("evloop_wait"); break; }
+        if (server.metrics_file && emu_now_ns() - metrics_written >= METRICS_FILE_INTERVAL_NS) {
+            write_metrics_file();
+            metrics_written = emu_now_ns();
         }
-        if (!recv_all(client, buf, size)) { fprintf(stderr, "failed read payload\n"); free(buf);
-#ifdef _WIN32
-            closesocket(client);
-#else
-            close(client);
-#endif
-            continue;
+        if (server.sessions) sessions_evict_idle(emu_now_ns());
+        for (int i = 0; i < n; ++i) {
+            void *data = events[i].data;
+            if (!data) { handle_wakeup(); continue; }
+            if (data == &server.listen_sock) { accept_clients(server.listen_sock); continue; }
+            if (data == &server.unix_sock) { accept_clients(server.unix_sock); continue; }
+            Conn *c = (Conn*)data;
+            if (c->dead) continue;
+            if (events[i].events & EV_READ) conn_on_readable(c);
+            if (!c->dead && (events[i].events & EV_WRITE)) conn_on_writable(c);
+            // hangup with nothing left to read
+            if (!c->dead && (events[i].events & EV_ERROR) && !(events[i].events & EV_READ)) conn_close(c);
         }
-
-        // Setup memory and cpu
-        Memory8086 mem;
-        memset(&mem, 0, sizeof(mem));
-        CPU8086 cpu;
-        cpu_init(&cpu);
-
-        // Load into 0x100
-        if (size > 0) memcpy(&mem.data[0x100], buf, size);
-        free(buf);
-
-        cpu.cs = 0x0000;
-        cpu.ip = 0x0100;
-
-        // Reset output buffer
-        emu_out_pos = 0; emu_output[0] = 0;
-
-        // Run until exit
-        while (cpu_step(&cpu, &mem)) {}
-    // Debug: report output length to server stderr
-    fprintf(stderr, "emu_out_pos=%u\n", (unsigned)emu_out_pos);
-
-    // Send back output length (4 bytes LE) then output
-        uint32_t out_len = (uint32_t)emu_out_pos;
-        if (!send_all(client, &out_len, sizeof(out_len))) { fprintf(stderr, "send len failed\n"); }
-        if (out_len > 0) {
-            if (!send_all(client, emu_output, out_len)) { fprintf(stderr, "send data failed\n"); }
+        while (server.completed) {
+            Job *job = server.completed;
+            server.completed = job->next;
+            if (!server.completed) server.completed_tail = NULL;
+            conn_finish_job(job);
+        }
+        while (server.graveyard) {
+            Conn *c = server.graveyard;
+            server.graveyard = c->next_dead;
+            conn_free(c);
         }
-
-#ifdef _WIN32
-        closesocket(client);
-#else
-        close(client);
-#endif
-        fprintf(stderr, "client done\n");
     }
 
-#ifdef _WIN32
+    asm_cache_free(server.asm_cache); // finishes the queued cache writes
     closesocket(listen_sock);
+#ifdef _WIN32
     WSACleanup();
-#else
-    close(listen_sock);
 #endif
     return 0;
 }
@@ -0,0 +1,53 @@
+#include "../include/spsc.h"
+#include <stdlib.h>
+
+int spsc_init(SpscQueue *q, size_t slot_size, size_t capacity)
+{
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    q->slots = malloc(slot_size * cap);
+    if (!q->slots)
+        return 0;
+    q->slot_size = slot_size;
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 1;
+}
+
+void spsc_free(SpscQueue *q)
+{
+    free(q->slots);
+    q->slots = NULL;
+}
+
+void *spsc_reserve(SpscQueue *q)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask)
+        return NULL; // full
+    return q->slots + (tail & q->mask) * q->slot_size;
+}
+
+void spsc_publish(SpscQueue *q)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+void *spsc_peek(SpscQueue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL; // empty
+    return q->slots + (head & q->mask) * q->slot_size;
+}
+
+void spsc_release(SpscQueue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,503 @@
+#include "../include/video.h"
+#include <stdlib.h>
+#include <string.h>
+
+// BIOS data area fields programs commonly peek at
+#define BDA_VIDEO_MODE 0x449
+#define BDA_COLUMNS 0x44A
+#define BDA_CURSOR_POS 0x450
+
+static uint32_t cell_addr(uint8_t row, uint8_t col)
+{
+    return VRAM_BASE + (uint32_t)row * TEXT_ROW_BYTES + (uint32_t)col * 2;
+}
+
+void video_init(VideoState *v, Memory8086 *mem)
+{
+    memset(v, 0, sizeof(*v));
+    video_set_mode(v, mem, 0x03, 1);
+}
+
+int video_is_graphics(const VideoState *v)
+{
+    return v->mode >= 0x04 && v->mode <= 0x06;
+}
+
+int video_width(const VideoState *v)
+{
+    return v->mode == 0x06 ? 640 : 320;
+}
+
+int video_columns(const VideoState *v)
+{
+    return (v->mode == 0x04 || v->mode == 0x05) ? 40 : TEXT_COLS;
+}
+
+void video_set_mode(VideoState *v, Memory8086 *mem, uint8_t mode, int clear)
+{
+    v->mode = mode;
+    // colour select value the BIOS programs for the mode
+    v->cga_color = mode == 0x06 ? 0x3F : 0x30;
+    mem_write8(mem, BDA_VIDEO_MODE, mode);
+    mem_write16(mem, BDA_COLUMNS, (uint16_t)video_columns(v));
+    if (clear && video_is_graphics(v))
+    {
+        memset(&mem->data[VRAM_BASE], 0, CGA_PLANE_SIZE);
+        mem_mark_written(mem, VRAM_BASE, CGA_PLANE_SIZE);
+    }
+    else if (clear)
+        video_scroll(mem, 1, 0, TEXT_DEFAULT_ATTR, 0, 0, TEXT_ROWS - 1, TEXT_COLS - 1);
+    video_set_cursor(v, mem, 0, 0);
+}
+
+void video_set_cursor(VideoState *v, Memory8086 *mem, uint8_t row, uint8_t col)
+{
+    v->cursor_row = row < TEXT_ROWS ? row : TEXT_ROWS - 1;
+    v->cursor_col = col < TEXT_COLS ? col : TEXT_COLS - 1;
+    mem_write8(mem, BDA_CURSOR_POS, v->cursor_col);
+    mem_write8(mem, BDA_CURSOR_POS + 1, v->cursor_row);
+}
+
+void video_scroll(Memory8086 *mem, int up, uint8_t lines, uint8_t attr,
+                  uint8_t top, uint8_t left, uint8_t bottom, uint8_t right)
+{
+    if (bottom >= TEXT_ROWS)
+        bottom = TEXT_ROWS - 1;
+    if (right >= TEXT_COLS)
+        right = TEXT_COLS - 1;
+    if (top > bottom || left > right)
+        return;
+    uint8_t height = bottom - top + 1;
+    if (lines == 0 || lines > height)
+        lines = height;
+    size_t width_bytes = (size_t)(right - left + 1) * 2;
+    // move the surviving rows, then blank the ones scrolled in
+    for (uint8_t i = 0; i < height - lines; ++i)
+    {
+        uint8_t dst = up ? top + i : bottom - i;
+        uint8_t src = up ? dst + lines : dst - lines;
+        uint32_t d = cell_addr(dst, left);
+        memmove(&mem->data[d], &mem->data[cell_addr(src, left)], width_bytes);
+        mem_mark_written(mem, d, (uint32_t)width_bytes);
+    }
+    for (uint8_t i = 0; i < lines; ++i)
+    {
+        uint8_t row = up ? bottom - i : top + i;
+        for (uint8_t col = left; col <= right; ++col)
+        {
+            mem_write8(mem, cell_addr(row, col), ' ');
+            mem_write8(mem, cell_addr(row, col) + 1, attr);
+        }
+    }
+}
+
+void video_write_chars(VideoState *v, Memory8086 *mem, uint8_t ch, int attr, uint16_t count)
+{
+    if (video_is_graphics(v))
+        return; // no character generator, text is not drawn in graphics modes
+    uint32_t a = cell_addr(v->cursor_row, v->cursor_col);
+    uint32_t end = VRAM_BASE + TEXT_ROWS * TEXT_ROW_BYTES;
+    for (uint16_t i = 0; i < count && a < end; ++i, a += 2)
+    {
+        mem_write8(mem, a, ch);
+        if (attr >= 0)
+            mem_write8(mem, a + 1, (uint8_t)attr);
+    }
+}
+
+uint16_t video_read_cell(VideoState *v, Memory8086 *mem)
+{
+    return mem_read16(mem, cell_addr(v->cursor_row, v->cursor_col));
+}
+
+void video_teletype(VideoState *v, Memory8086 *mem, uint8_t ch, int attr)
+{
+    uint8_t row = v->cursor_row, col = v->cursor_col;
+    switch (ch)
+    {
+    case 0x07: // bell
+        return;
+    case 0x08:
+        if (col > 0)
+            col--;
+        break;
+    case '\n':
+        row++;
+        break;
+    case '\r':
+        col = 0;
+        break;
+    default:
+        if (!video_is_graphics(v))
+        {
+            mem_write8(mem, cell_addr(row, col), ch);
+            if (attr >= 0)
+                mem_write8(mem, cell_addr(row, col) + 1, (uint8_t)attr);
+        }
+        if (++col >= video_columns(v))
+        {
+            col = 0;
+            row++;
+        }
+        break;
+    }
+    if (row >= TEXT_ROWS && video_is_graphics(v))
+        row = TEXT_ROWS - 1;
+    else if (row >= TEXT_ROWS)
+    {
+        // keep the attribute of the line that scrolls up, like the BIOS does
+        uint8_t fill = mem_read8(mem, cell_addr(TEXT_ROWS - 1, 0) + 1);
+        video_scroll(mem, 1, 1, fill, 0, 0, TEXT_ROWS - 1, TEXT_COLS - 1);
+        row = TEXT_ROWS - 1;
+    }
+    video_set_cursor(v, mem, row, col);
+}
+
+static int chunk_dirty(const Memory8086 *mem, unsigned chunk)
+{
+    return (mem->vram_dirty[chunk >> 5] >> (chunk & 31)) & 1;
+}
+
+size_t video_text_delta(VideoState *v, Memory8086 *mem, uint8_t *out, size_t cap)
+{
+    const unsigned chunks_per_row = TEXT_ROW_BYTES >> VRAM_CHUNK_SHIFT; // 10
+    const unsigned cells_per_chunk = (1u << VRAM_CHUNK_SHIFT) / 2;     // 8
+    int changed = v->cursor_row != v->sent_row || v->cursor_col != v->sent_col;
+    for (unsigned w = 0; w < VRAM_CHUNKS / 32 && !changed; ++w)
+        changed = mem->vram_dirty[w] != 0;
+    if (!changed || cap < 5)
+        return 0;
+
+    size_t n = 5;
+    uint16_t runs = 0;
+    for (unsigned row = 0; row < TEXT_ROWS; ++row)
+    {
+        unsigned c = 0;
+        while (c < chunks_per_row)
+        {
+            if (!chunk_dirty(mem, row * chunks_per_row + c))
+            {
+                c++;
+                continue;
+            }
+            unsigned first = c;
+            while (c < chunks_per_row && chunk_dirty(mem, row * chunks_per_row + c))
+                c++;
+            unsigned cells = (c - first) * cells_per_chunk;
+            if (n + 3 + cells * 2 > cap)
+                return 0;
+            out[n++] = (uint8_t)row;
+            out[n++] = (uint8_t)(first * cells_per_chunk);
+            out[n++] = (uint8_t)cells;
+            memcpy(out + n, &mem->data[cell_addr(row, first * cells_per_chunk)], cells * 2);
+            n += cells * 2;
+            runs++;
+        }
+    }
+    out[0] = v->mode;
+    out[1] = v->cursor_row;
+    out[2] = v->cursor_col;
+    out[3] = runs & 0xFF;
+    out[4] = runs >> 8;
+    memset(mem->vram_dirty, 0, sizeof(mem->vram_dirty));
+    v->sent_row = v->cursor_row;
+    v->sent_col = v->cursor_col;
+    return n;
+}
+
+void video_dump_text(Memory8086 *mem, FILE *f)
+{
+    int last = -1;
+    for (int row = 0; row < TEXT_ROWS; ++row)
+        for (int col = 0; col < TEXT_COLS; ++col)
+        {
+            uint8_t ch = mem->data[cell_addr(row, col)];
+            if (ch != ' ' && ch != 0)
+                last = row;
+        }
+    for (int row = 0; row <= last; ++row)
+    {
+        char line[TEXT_COLS + 1];
+        int len = 0;
+        for (int col = 0; col < TEXT_COLS; ++col)
+        {
+            uint8_t ch = mem->data[cell_addr(row, col)];
+            line[col] = (ch < 32 || ch == 127) ? ' ' : (char)ch;
+            if (line[col] != ' ')
+                len = col + 1;
+        }
+        line[len] = 0;
+        fprintf(f, "%s\n", line);
+    }
+}
+
+// Physical address of the byte holding pixel row y, byte column xb
+static uint32_t cga_addr(uint16_t y, uint16_t xb)
+{
+    return VRAM_BASE + (y & 1) * CGA_BANK_OFFSET + (uint32_t)(y >> 1) * CGA_ROW_BYTES + xb;
+}
+
+void video_scroll_gfx(VideoState *v, Memory8086 *mem, int up, uint8_t lines, uint8_t color,
+                      uint8_t top, uint8_t left, uint8_t bottom, uint8_t right)
+{
+    uint8_t columns = (uint8_t)video_columns(v);
+    if (bottom >= CGA_HEIGHT / 8)
+        bottom = CGA_HEIGHT / 8 - 1;
+    if (right >= columns)
+        right = columns - 1;
+    if (top > bottom || left > right)
+        return;
+    uint8_t height = bottom - top + 1;
+    if (lines == 0 || lines > height)
+        lines = height;
+    // a character cell is 8 scanlines of 1 byte (mode 6) or 2 bytes
+    uint32_t cell_bytes = CGA_ROW_BYTES / columns;
+    uint32_t x = left * cell_bytes, width = (uint32_t)(right - left + 1) * cell_bytes;
+    // the fill colour in every pixel of a byte
+    uint8_t fill = v->mode == 0x06 ? ((color & 1) ? 0xFF : 0x00) : (uint8_t)((color & 3) * 0x55);
+    for (uint8_t i = 0; i < height; ++i)
+    {
+        uint8_t dst = up ? top + i : bottom - i;
+        for (uint16_t line = 0; line < 8; ++line)
+        {
+            uint32_t d = cga_addr((uint16_t)(dst * 8 + line), (uint16_t)x);
+            if (i < height - lines)
+            {
+                uint8_t src = up ? dst + lines : dst - lines;
+                memmove(&mem->data[d], &mem->data[cga_addr((uint16_t)(src * 8 + line), (uint16_t)x)], width);
+            }
+            else
+            {
+                memset(&mem->data[d], fill, width);
+            }
+            mem_mark_written(mem, d, width);
+        }
+    }
+}
+
+void video_put_pixel(VideoState *v, Memory8086 *mem, uint16_t x, uint16_t y, uint8_t color)
+{
+    if (!video_is_graphics(v) || x >= video_width(v) || y >= CGA_HEIGHT)
+        return;
+    int bpp = v->mode == 0x06 ? 1 : 2;
+    int per_byte = 8 / bpp;
+    uint32_t a = cga_addr(y, x / per_byte);
+    int shift = (per_byte - 1 - x % per_byte) * bpp;
+    uint8_t mask = (uint8_t)(((1 << bpp) - 1) << shift);
+    uint8_t bits = (uint8_t)((color << shift) & mask);
+    uint8_t b = mem_read8(mem, a);
+    b = (color & 0x80) ? (uint8_t)(b ^ bits) : (uint8_t)((b & ~mask) | bits);
+    mem_write8(mem, a, b);
+}
+
+uint8_t video_get_pixel(VideoState *v, Memory8086 *mem, uint16_t x, uint16_t y)
+{
+    if (!video_is_graphics(v) || x >= video_width(v) || y >= CGA_HEIGHT)
+        return 0;
+    int bpp = v->mode == 0x06 ? 1 : 2;
+    int per_byte = 8 / bpp;
+    int shift = (per_byte - 1 - x % per_byte) * bpp;
+    return (mem_read8(mem, cga_addr(y, x / per_byte)) >> shift) & ((1 << bpp) - 1);
+}
+
+void video_set_palette(VideoState *v, uint8_t id, uint8_t value)
+{
+    if (id == 0)
+        v->cga_color = (v->cga_color & 0x20) | (value & 0x1F);
+    else
+        v->cga_color = (v->cga_color & ~0x20) | ((value & 1) << 5);
+}
+
+static uint8_t cga_port_read(void *dev, uint16_t port)
+{
+    VideoState *v = (VideoState *)dev;
+    if (port == CGA_PORT_STATUS)
+    {
+        // programs poll for retrace; flip display-enable and vsync each read
+        v->cga_status ^= 0x09;
+        return v->cga_status;
+    }
+    return 0xFF;
+}
+
+static void cga_port_write(void *dev, uint16_t port, uint8_t value)
+{
+    VideoState *v = (VideoState *)dev;
+    if (port == CGA_PORT_MODE)
+        v->cga_mode_ctl = value;
+    else if (port == CGA_PORT_COLOR)
+        v->cga_color = value;
+}
+
+int video_add_cga_ports(VideoState *v, PortBus *bus)
+{
+    PortHandler h = {0};
+    h.read8 = cga_port_read;
+    h.write8 = cga_port_write;
+    h.dev = v;
+    return ports_register(bus, CGA_PORT_MODE, 3, &h);
+}
+
+typedef struct {
+    uint16_t xb, y, wb, h;
+} GfxRect;
+
+// 16-byte chunks per scanline and the chunk holding the start of line y
+#define CGA_LINE_CHUNKS (CGA_ROW_BYTES >> VRAM_CHUNK_SHIFT)
+#define CGA_MAX_RECTS (CGA_HEIGHT * 3)
+
+static size_t gfx_encode(VideoState *v, Memory8086 *mem, const GfxRect *rects, uint16_t n,
+                         uint8_t *out, size_t cap)
+{
+    size_t need = 4;
+    for (uint16_t i = 0; i < n; ++i)
+        need += 8 + (size_t)rects[i].wb * rects[i].h;
+    if (need > cap)
+        return 0;
+    size_t pos = 0;
+    out[pos++] = v->mode;
+    out[pos++] = v->cga_color;
+    out[pos++] = n & 0xFF;
+    out[pos++] = n >> 8;
+    for (uint16_t i = 0; i < n; ++i)
+    {
+        const GfxRect *r = &rects[i];
+        uint16_t f[4] = {r->xb, r->y, r->wb, r->h};
+        for (int k = 0; k < 4; ++k)
+        {
+            out[pos++] = f[k] & 0xFF;
+            out[pos++] = f[k] >> 8;
+        }
+        for (uint16_t y = r->y; y < r->y + r->h; ++y)
+        {
+            memcpy(out + pos, &mem->data[cga_addr(y, r->xb)], r->wb);
+            pos += r->wb;
+        }
+    }
+    return pos;
+}
+
+size_t video_gfx_delta(VideoState *v, Memory8086 *mem, uint8_t *out, size_t cap)
+{
+    GfxRect rects[CGA_MAX_RECTS];
+    uint16_t n = 0;
+    // rectangles still growing downwards: those that ended on the previous line
+    uint16_t open_first = 0;
+    for (uint16_t y = 0; y < CGA_HEIGHT; ++y)
+    {
+        unsigned first_chunk = (cga_addr(y, 0) - VRAM_BASE) >> VRAM_CHUNK_SHIFT;
+        uint16_t line_first = n;
+        unsigned c = 0;
+        while (c < CGA_LINE_CHUNKS)
+        {
+            if (!chunk_dirty(mem, first_chunk + c))
+            {
+                c++;
+                continue;
+            }
+            unsigned start = c;
+            while (c < CGA_LINE_CHUNKS && chunk_dirty(mem, first_chunk + c))
+                c++;
+            uint16_t xb = (uint16_t)(start << VRAM_CHUNK_SHIFT);
+            uint16_t wb = (uint16_t)((c - start) << VRAM_CHUNK_SHIFT);
+            GfxRect *grown = NULL;
+            for (uint16_t i = open_first; i < line_first; ++i)
+                if (rects[i].xb == xb && rects[i].wb == wb && rects[i].y + rects[i].h == y)
+                    grown = &rects[i];
+            if (grown)
+                grown->h++;
+            else
+                rects[n++] = (GfxRect){xb, y, wb, 1};
+        }
+        // only rectangles touching this line can grow into the next one
+        while (open_first < n && rects[open_first].y + rects[open_first].h != y + 1)
+            open_first++;
+    }
+    if (n == 0)
+        return 0;
+    size_t len = gfx_encode(v, mem, rects, n, out, cap);
+    if (len == 0)
+    {
+        GfxRect full = {0, 0, CGA_ROW_BYTES, CGA_HEIGHT};
+        len = gfx_encode(v, mem, &full, 1, out, cap);
+        if (len == 0)
+            return 0;
+    }
+    memset(mem->vram_dirty, 0, sizeof(mem->vram_dirty));
+    return len;
+}
+
+static const uint8_t cga_rgb[16][3] = {
+    {0x00, 0x00, 0x00}, {0x00, 0x00, 0xAA}, {0x00, 0xAA, 0x00}, {0x00, 0xAA, 0xAA},
+    {0xAA, 0x00, 0x00}, {0xAA, 0x00, 0xAA}, {0xAA, 0x55, 0x00}, {0xAA, 0xAA, 0xAA},
+    {0x55, 0x55, 0x55}, {0x55, 0x55, 0xFF}, {0x55, 0xFF, 0x55}, {0x55, 0xFF, 0xFF},
+    {0xFF, 0x55, 0x55}, {0xFF, 0x55, 0xFF}, {0xFF, 0xFF, 0x55}, {0xFF, 0xFF, 0xFF},
+};
+
+// Map the 2-bit (or 1-bit) pixel values of the current mode to CGA colours
+static void cga_palette(const VideoState *v, uint8_t map[4])
+{
+    uint8_t bright = (v->cga_color & 0x10) ? 8 : 0;
+    map[0] = v->cga_color & 0x0F;
+    if (v->mode == 0x06)
+    {
+        map[0] = 0;
+        map[1] = v->cga_color & 0x0F;
+        map[2] = map[3] = map[1];
+    }
+    else if (v->mode == 0x05)
+    {
+        map[1] = 3 + bright;
+        map[2] = 4 + bright;
+        map[3] = 7 + bright;
+    }
+    else
+    {
+        uint8_t base = (v->cga_color & 0x20) ? 3 : 2;
+        for (int i = 1; i < 4; ++i)
+            map[i] = (uint8_t)(base + (i - 1) * 2 + bright);
+    }
+}
+
+void video_render_indexed(VideoState *v, Memory8086 *mem, uint8_t *pixels)
+{
+    uint8_t map[4];
+    cga_palette(v, map);
+    int width = video_width(v);
+    for (uint16_t y = 0; y < CGA_HEIGHT; ++y)
+        for (uint16_t x = 0; x < width; ++x)
+            *pixels++ = map[video_get_pixel(v, mem, x, y)];
+}
+
+uint8_t *video_render_ppm(VideoState *v, Memory8086 *mem, size_t *len)
+{
+    size_t count = (size_t)video_width(v) * CGA_HEIGHT;
+    char header[32];
+    int n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", video_width(v), CGA_HEIGHT);
+    uint8_t *ppm = malloc((size_t)n + 3 * count);
+    uint8_t *pixels = malloc(count);
+    if (!ppm || !pixels)
+    {
+        free(ppm);
+        free(pixels);
+        return NULL;
+    }
+    video_render_indexed(v, mem, pixels);
+    memcpy(ppm, header, (size_t)n);
+    for (size_t i = 0; i < count; ++i)
+        memcpy(ppm + n + 3 * i, cga_rgb[pixels[i]], 3);
+    free(pixels);
+    *len = (size_t)n + 3 * count;
+    return ppm;
+}
+
+int video_write_ppm(VideoState *v, Memory8086 *mem, FILE *f)
+{
+    size_t len;
+    uint8_t *ppm = video_render_ppm(v, mem, &len);
+    if (!ppm)
+        return 0;
+    int ok = fwrite(ppm, 1, len, f) == len;
+    free(ppm);
+    return ok;
+}
@@ -0,0 +1,63 @@
+#include "../include/asm8086.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Short jumps at the edges of their range: in range they assemble to the
+// right displacement, one byte further they are an error, never a truncated
+// displacement.
+
+static const char *const jumps[] = { "jne", "loop", "jcxz", "jmp short" };
+
+// A two-byte jump whose displacement is rel, and the offset of that jump
+static size_t make_source(char *buf, size_t cap, const char *jump, int rel, size_t *at)
+{
+    if (rel >= 0)
+    {
+        // the target follows rel bytes of padding after the jump
+        *at = 0;
+        return (size_t)snprintf(buf, cap, "org 100h\n%s target\ntimes %d nop\ntarget:\nret\n", jump, rel);
+    }
+    // the jump follows the target and -rel - 2 bytes of padding
+    *at = (size_t)(-rel - 2);
+    return (size_t)snprintf(buf, cap, "org 100h\ntarget:\ntimes %d nop\n%s target\nret\n", -rel - 2, jump);
+}
+
+int main(void)
+{
+    static const int rels[] = { 127, 128, -127, -128, -129 };
+    char src[256];
+    int failures = 0;
+    for (size_t j = 0; j < sizeof(jumps) / sizeof(jumps[0]); ++j)
+    {
+        for (size_t r = 0; r < sizeof(rels) / sizeof(rels[0]); ++r)
+        {
+            int rel = rels[r];
+            int in_range = rel >= -128 && rel <= 127;
+            size_t at;
+            size_t len = make_source(src, sizeof(src), jumps[j], rel, &at);
+            AsmResult res;
+            int ok = asm_assemble(src, len, &res);
+            if (ok != in_range)
+            {
+                printf("FAIL %s %+d: %s\n", jumps[j], rel, ok ? "assembled" : "rejected");
+                failures++;
+            }
+            else if (ok && (res.size < at + 2 || (int8_t)res.code[at + 1] != rel))
+            {
+                printf("FAIL %s %+d: wrong displacement\n", jumps[j], rel);
+                failures++;
+            }
+            else if (!ok && (!res.errors || !strstr(res.errors, "out of range")))
+            {
+                printf("FAIL %s %+d: unexpected errors: %s\n", jumps[j], rel, res.errors ? res.errors : "(none)");
+                failures++;
+            }
+            asm_result_free(&res);
+        }
+    }
+    if (failures)
+        return EXIT_FAILURE;
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}
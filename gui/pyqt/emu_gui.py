@@ -3,31 +3,124 @@ import struct
 import os
 import socket
 import subprocess
+import threading
 from pathlib import Path
 from PyQt5 import QtWidgets, QtGui, QtCore
 
 HOST = '127.0.0.1'
 PORT = 5555
+UNIX_PATH = '/tmp/emu_server.sock'  # used instead of TCP when the server listens there
+
+
+# Pipelined protocol (see emulator/include/protocol.h)
+PIPE_MAGIC = 0x50363845  # "E86P"
+PROTOCOL_VERSION = 1
+MSG_JOB, MSG_CANCEL = 0x10, 0x1C
+SECTION_END, SECTION_PROGRAM, SECTION_SOURCE = 0, 1, 7
+EXIT_ASM_ERROR = 0x0A
+FRAME_OUTPUT, FRAME_RESULT, FRAME_ERROR, FRAME_BUSY = 1, 3, 6, 9
 
 
 class EmuClient:
+    """Keeps one pipelined connection to the emulator server open and reuses
+    it for every run, reconnecting if the server went away."""
+    _sock = None
+    _next_id = 0
+    _running_id = None  # request id of the run in flight, for cancel()
+
     @staticmethod
-    def send_bytes(b: bytes) -> bytes:
-        """Send length-prefixed bytes to the emulator server and return response bytes."""
-        with socket.create_connection((HOST, PORT), timeout=5) as s:
-            s.sendall(struct.pack('<I', len(b)))
-            s.sendall(b)
-            header = s.recv(4)
-            if len(header) < 4:
-                raise RuntimeError('no response from emulator')
-            out_len = struct.unpack('<I', header)[0]
-            data = bytearray()
-            while len(data) < out_len:
-                chunk = s.recv(out_len - len(data))
-                if not chunk:
-                    break
-                data.extend(chunk)
-            return bytes(data)
+    def _recv_exact(s, n: int) -> bytes:
+        data = bytearray()
+        while len(data) < n:
+            chunk = s.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError('emulator closed the connection')
+            data.extend(chunk)
+        return bytes(data)
+
+    @classmethod
+    def _connect(cls):
+        if hasattr(socket, 'AF_UNIX') and os.path.exists(UNIX_PATH):
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.settimeout(5)
+            try:
+                s.connect(UNIX_PATH)
+            except OSError:
+                s.close()  # stale socket file, fall back to TCP
+                s = socket.create_connection((HOST, PORT), timeout=5)
+        else:
+            s = socket.create_connection((HOST, PORT), timeout=5)
+        s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+        magic, _version = struct.unpack('<IH', cls._recv_exact(s, 6))
+        if magic != PIPE_MAGIC:
+            s.close()
+            raise RuntimeError('emulator does not speak the pipelined protocol')
+        # a run lasts as long as the server lets it (or until cancel())
+        s.settimeout(None)
+        cls._sock = s
+
+    @classmethod
+    def _run(cls, tag: int, b: bytes):
+        """Returns the output and the exit reason of the result record."""
+        if cls._sock is None:
+            cls._connect()
+        cls._next_id += 1
+        rid = cls._next_id
+        payload = (bytes([0]) + struct.pack('<BI', tag, len(b)) + b +
+                   struct.pack('<BI', SECTION_END, 0))
+        cls._sock.sendall(struct.pack('<BII', MSG_JOB, rid, len(payload)) + payload)
+        cls._running_id = rid
+        try:
+            out = bytearray()
+            while True:
+                ftype, frid, flen = struct.unpack('<BII', cls._recv_exact(cls._sock, 9))
+                data = cls._recv_exact(cls._sock, flen)
+                if frid != rid:
+                    continue  # reply to an earlier run that was abandoned, or to a cancel
+                if ftype == FRAME_OUTPUT:
+                    out.extend(data)
+                elif ftype == FRAME_RESULT:
+                    return bytes(out), data[12]
+                elif ftype in (FRAME_ERROR, FRAME_BUSY):
+                    raise RuntimeError(data.decode('latin-1'))
+        finally:
+            cls._running_id = None
+
+    @classmethod
+    def cancel(cls):
+        """Stop the run in flight (called from another thread than the run).
+        The run then returns with the output so far."""
+        rid, s = cls._running_id, cls._sock
+        if rid is None or s is None:
+            return
+        cls._next_id += 1
+        try:
+            s.sendall(struct.pack('<BIII', MSG_CANCEL, cls._next_id, 4, rid))
+        except OSError:
+            pass  # the run fails on its own
+
+    @classmethod
+    def _run_retry(cls, tag: int, b: bytes):
+        try:
+            return cls._run(tag, b)
+        except (OSError, ConnectionError):
+            # stale connection (server restarted): retry once on a fresh one
+            if cls._sock is not None:
+                cls._sock.close()
+            cls._sock = None
+            return cls._run(tag, b)
+
+    @classmethod
+    def send_bytes(cls, b: bytes) -> bytes:
+        """Run a .COM image on the emulator server and return its output."""
+        return cls._run_retry(SECTION_PROGRAM, b)[0]
+
+    @classmethod
+    def send_source(cls, asm: str):
+        """Have the server assemble and run NASM source. Returns the output
+        and whether it assembled; if not, the output is the error messages."""
+        out, reason = cls._run_retry(SECTION_SOURCE, asm.encode('utf-8'))
+        return out, reason != EXIT_ASM_ERROR
 
 
 def get_backend_path() -> Path:
@@ -59,6 +152,16 @@ def get_media_path(filename: str) -> Path:
     return base_dir / filename
 
 
+def get_asm_cache_path() -> Path:
+    """Per-user directory where the server keeps assembled programs, so
+    unchanged source is not assembled again after a restart."""
+    if os.name == 'nt':
+        base_dir = Path(os.environ.get('LOCALAPPDATA', Path.home() / 'AppData' / 'Local'))
+    else:
+        base_dir = Path(os.environ.get('XDG_CACHE_HOME', Path.home() / '.cache'))
+    return base_dir / 'emu8086' / 'asm'
+
+
 class TitleBar(QtWidgets.QWidget):
     """Custom title bar for a frameless window with retro-styled controls.
 
@@ -153,6 +256,9 @@ class TitleBar(QtWidgets.QWidget):
 
 
 class MainWindow(QtWidgets.QMainWindow):
+    # text for the output pane, from the thread a run waits on
+    runFinished = QtCore.pyqtSignal(str)
+
     def __init__(self):
         super().__init__()
         # use a frameless window so the chrome can match the app
@@ -177,11 +283,16 @@ class MainWindow(QtWidgets.QMainWindow):
         open_asm_btn = QtWidgets.QPushButton('Open .asm & Run')
         open_com_btn = QtWidgets.QPushButton('Open .com & Run')
         self.server_btn = QtWidgets.QPushButton('Start Server')
+        self.stop_btn = QtWidgets.QPushButton('Stop')
+        self.stop_btn.setEnabled(False)
+        self.run_buttons = (run_btn, open_asm_btn, open_com_btn)
+        self.runFinished.connect(self._on_run_finished)
 
         run_btn.clicked.connect(self.assemble_and_run)
         open_asm_btn.clicked.connect(self.open_asm_and_run)
         open_com_btn.clicked.connect(self.open_com_and_run)
         self.server_btn.clicked.connect(self.toggle_server)
+        self.stop_btn.clicked.connect(EmuClient.cancel)
 
         left = QtWidgets.QVBoxLayout()
         left.addWidget(QtWidgets.QLabel('ASM editor:'))
@@ -191,6 +302,7 @@ class MainWindow(QtWidgets.QMainWindow):
         btn_row.addWidget(run_btn)
         btn_row.addWidget(open_asm_btn)
         btn_row.addWidget(open_com_btn)
+        btn_row.addWidget(self.stop_btn)
         left.addLayout(btn_row)
 
         right = QtWidgets.QVBoxLayout()
@@ -325,8 +437,15 @@ class MainWindow(QtWidgets.QMainWindow):
         if exe is None:
             self.update_output('Emulator server executable not found in emulator/build')
             return False
+        args = [str(exe)]
+        try:
+            cache_dir = get_asm_cache_path()
+            cache_dir.mkdir(parents=True, exist_ok=True)
+            args += ['-A', str(cache_dir)]
+        except OSError:
+            pass  # the in-memory assembly cache still works
         try:
-            proc = subprocess.Popen([str(exe)], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            proc = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
             self.server_proc = proc
             self.server_btn.setText('Stop Server')
             self.update_output(f'Server started: {exe}')
@@ -358,30 +477,38 @@ class MainWindow(QtWidgets.QMainWindow):
         else:
             self.stop_server()
 
+    def start_run(self, run):
+        """Call run() on a background thread so the window stays responsive
+        and Stop can cancel it; run returns the text to show."""
+        if self.server_proc is None and not self.start_server():
+            return
+        for btn in self.run_buttons:
+            btn.setEnabled(False)
+        self.stop_btn.setEnabled(True)
+
+        def work():
+            try:
+                text = run()
+            except Exception as ex:
+                text = 'Error: ' + str(ex)
+            self.runFinished.emit(text)
+        threading.Thread(target=work, daemon=True).start()
+
+    def _on_run_finished(self, text: str):
+        self.update_output(text)
+        self.stop_btn.setEnabled(False)
+        for btn in self.run_buttons:
+            btn.setEnabled(True)
+
     def assemble_and_run(self):
         asm = self.asm_edit.toPlainText()
-        tmp = Path.cwd() / '.emu_tmp'
-        tmp.mkdir(exist_ok=True)
-        asm_file = tmp / 'prog.asm'
-        com_file = tmp / 'prog.com'
-        asm_file.write_text(asm, encoding='utf-8')
-        try:
-            # ensure server is running
-            if self.server_proc is None:
-                started = self.start_server()
-                if not started:
-                    return
-            p = subprocess.run(['nasm', '-f', 'bin', '-o', str(com_file), str(asm_file)], capture_output=True, text=True, timeout=10)
-            if p.returncode != 0:
-                self.update_output('NASM failed:\n' + p.stdout + p.stderr)
-                return
-            data = com_file.read_bytes()
-            out = EmuClient.send_bytes(data)
-            self.update_output(out.decode('latin-1', errors='replace'))
-        except FileNotFoundError:
-            self.update_output('nasm not found on PATH')
-        except Exception as ex:
-            self.update_output('Error: ' + str(ex))
+
+        def run():
+            # the server assembles the source itself, no nasm needed
+            out, assembled = EmuClient.send_source(asm)
+            text = out.decode('latin-1', errors='replace')
+            return text if assembled else 'Assembly failed:\n' + text
+        self.start_run(run)
 
     def open_asm_and_run(self):
         path, _ = QtWidgets.QFileDialog.getOpenFileName(self, 'Open ASM', filter='ASM files (*.asm *.s)')
@@ -396,15 +523,7 @@ class MainWindow(QtWidgets.QMainWindow):
         if not path:
             return
         data = Path(path).read_bytes()
-        try:
-            if self.server_proc is None:
-                started = self.start_server()
-                if not started:
-                    return
-            out = EmuClient.send_bytes(data)
-            self.update_output(out.decode('latin-1', errors='replace'))
-        except Exception as ex:
-            self.update_output('Error: ' + str(ex))
+        self.start_run(lambda: EmuClient.send_bytes(data).decode('latin-1', errors='replace'))
 
     # --- Embedded splash overlay (appears as part of the main window) ---
     def create_splash_overlay(self):
@@ -1,14 +1,437 @@
-import socket, struct
+import socket, struct, sys
 
 HOST='127.0.0.1'
 PORT=5555
 
-with open('hello.com','rb') as f:
+STREAM_MAGIC = 0x53363845  # "E86S"
+JOB_MAGIC = 0x4A363845     # "E86J"
+PIPE_MAGIC = 0x50363845    # "E86P"
+PROTOCOL_VERSION = 2
+MSG_JOB, MSG_JOB_BATCH, MSG_STATS, MSG_JOB_SHM = 0x10, 0x11, 0x12, 0x13
+MSG_SESSION_CREATE, MSG_SESSION_LOAD, MSG_SESSION_RUN, MSG_SESSION_GET_REGS = 0x14, 0x15, 0x16, 0x17
+MSG_SESSION_SET_REGS, MSG_SESSION_READ, MSG_SESSION_WRITE, MSG_SESSION_DESTROY = 0x18, 0x19, 0x1A, 0x1B
+MSG_CANCEL, MSG_SESSION_FRAME = 0x1C, 0x1D
+FRAME_ERROR, FRAME_BATCH_RESULT, FRAME_STATS, FRAME_BUSY, FRAME_SESSION = 6, 7, 8, 9, 10
+SESSION_TOKEN_SIZE = 16
+SECTION_END, SECTION_PROGRAM, SECTION_INPUT, SECTION_FILE, SECTION_BUDGET, SECTION_TIMEOUT = 0, 1, 2, 3, 4, 5
+SECTION_EXPECT, SECTION_SOURCE = 6, 7
+EXPECT_OUTPUT_HASH, EXPECT_OUTPUT_PREFIX, EXPECT_REGISTER, EXPECT_MEMORY, EXPECT_MAX_INSTRUCTIONS = 1, 2, 3, 4, 5
+EXPECT_KINDS = {1: 'output hash', 2: 'output prefix', 3: 'register', 4: 'memory', 5: 'instruction count'}
+EXIT_REASONS = {1: 'terminated', 2: 'halt', 3: 'divide error', 4: 'bad opcode', 5: 'budget', 6: 'timeout', 7: 'crashed', 8: 'busy', 9: 'rejected',
+                10: 'assembly error', 11: 'cancelled'}
+FRAME_OUTPUT, FRAME_HEARTBEAT, FRAME_RESULT, FRAME_VIDEO_TEXT, FRAME_VIDEO_GFX = 1, 2, 3, 4, 5
+JOB_FLAG_STREAM, JOB_FLAG_VIDEO, JOB_FLAG_LOW_PRIORITY, JOB_FLAG_RESULT, JOB_FLAG_CHECK_ONLY = 0x01, 0x02, 0x04, 0x08, 0x10
+RESULT_SIZE = 88
+RESULT_FLAG_OUTPUT_OMITTED = 0x02
+REGISTERS = ('AX', 'BX', 'CX', 'DX', 'SI', 'DI', 'BP', 'SP', 'DS', 'ES', 'SS', 'FLAGS', 'CS', 'IP')
+
+def fnv1a(data):
+    h = 0xcbf29ce484222325
+    for b in data:
+        h = ((h ^ b) * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+def describe_check(rec):
+    """One line for the assertion outcome in a result record."""
+    if len(rec) < 84 or rec[60] == 0:
+        return ''
+    if rec[60] == 1:
+        return 'checks passed'
+    kind, index, where, expected, actual = struct.unpack('<BHIQQ', rec[61:84])
+    if kind == EXPECT_REGISTER:
+        at = ' ' + REGISTERS[where]
+    elif kind in (EXPECT_OUTPUT_PREFIX, EXPECT_MEMORY):
+        at = (' at offset %d' if kind == EXPECT_OUTPUT_PREFIX else ' at %05X') % where
+    else:
+        at = ''
+    got = 'end of output' if actual == 0xFFFFFFFFFFFFFFFF else '%X' % actual
+    return 'check %d failed (%s%s): expected %X, got %s' % (index, EXPECT_KINDS.get(kind, kind), at, expected, got)
+
+UNIX_PATH = None  # --unix PATH: talk to the server's Unix socket instead of TCP
+
+def connect():
+    if UNIX_PATH:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(UNIX_PATH)
+        return s
+    return socket.create_connection((HOST, PORT))
+
+def recv_exact(s, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = s.recv(n - len(buf))
+        if not chunk:
+            break
+        buf += chunk
+    return buf
+
+def show_result(rec, indent=''):
+    """Print a FRAME_RESULT record."""
+    instr, total, reason, cs, ip = struct.unpack('<QIBHH', rec[:17])
+    print('%sresult: %d instructions, %d output bytes' % (indent, instr, total))
+    detail = ''
+    if len(rec) >= 60:
+        code, opcode, flags = rec[17:20]
+        if reason == 1:
+            detail = ', exit code %d' % code
+        elif reason == 4:
+            detail = ', opcode %02X' % opcode
+        elif reason == 10 and len(rec) >= 88:
+            detail = ', line %d' % struct.unpack('<I', rec[84:88])
+        if flags & 1:
+            detail += ', cached'
+        if flags & RESULT_FLAG_OUTPUT_OMITTED:
+            detail += ', output omitted'
+    print('%sexit: %s at CS:IP=%04X:%04X%s' % (indent, EXIT_REASONS.get(reason, reason), cs, ip, detail))
+    if len(rec) >= 60:
+        regs = struct.unpack('<12H', rec[20:44])
+        print(indent + ' '.join('%s=%04X' % r for r in zip(REGISTERS, regs)))
+        run_ns, queue_ns = struct.unpack('<QQ', rec[44:60])
+        print('%sran %.3f ms after waiting %.3f ms' % (indent, run_ns / 1e6, queue_ns / 1e6))
+    if describe_check(rec):
+        print(indent + describe_check(rec))
+
+def section(tag, payload=b''):
+    return struct.pack('<BI', tag, len(payload)) + payload
+
+def program_section(path, data):
+    """A .COM image, or for .asm files the source for the server to assemble."""
+    return section(SECTION_SOURCE if path.lower().endswith('.asm') else SECTION_PROGRAM, data)
+
+CANCEL_ID = 0x80000000  # request ids of our cancel messages
+
+def run_pipelined(job_payload, count, cancel_after=None):
+    """Send count copies of a job over one pipelined connection and collect
+    the ID-tagged replies, which may arrive in any order. With cancel_after
+    (seconds) every job still in flight by then is cancelled."""
+    import time
+    s = connect()
+    s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+    magic, version = struct.unpack('<IH', recv_exact(s, 6))
+    print('server protocol version', version)
+    start = time.time()
+    s.sendall(b''.join(struct.pack('<BII', MSG_JOB, i, len(job_payload)) + job_payload for i in range(count)))
+    if cancel_after is not None:
+        time.sleep(cancel_after)
+        s.sendall(b''.join(struct.pack('<BIII', MSG_CANCEL, CANCEL_ID | i, 4, i) for i in range(count)))
+    outputs, order, reasons, busy = {}, [], {}, 0
+    while len(order) < count:
+        hdr = recv_exact(s, 9)
+        if len(hdr) < 9:
+            print('connection closed with %d replies missing' % (count - len(order)))
+            break
+        ftype, rid, flen = struct.unpack('<BII', hdr)
+        payload = recv_exact(s, flen)
+        if ftype == FRAME_OUTPUT:
+            outputs[rid] = outputs.get(rid, b'') + payload
+        elif ftype == FRAME_RESULT:
+            order.append(rid)
+            reasons[rid] = payload[12] if len(payload) > 12 else 0
+        elif ftype == FRAME_ERROR and rid & CANCEL_ID:
+            pass  # that job had already been answered
+        elif ftype == FRAME_ERROR:
+            print('request %d rejected: %s' % (rid, payload.decode()))
+            order.append(rid)
+        elif ftype == FRAME_BUSY:
+            busy += 1
+            order.append(rid)
+    elapsed = time.time() - start
+    s.close()
+    distinct = set(outputs.values())
+    print('%d replies in %.3fs, completion order starts %s' % (len(order), elapsed, order[:10]))
+    if busy:
+        print('%d requests turned away: server busy' % busy)
+    print('exit reasons:', sorted(set(EXIT_REASONS.get(r, r) for r in reasons.values())))
+    for out in distinct:
+        print('output:', out[:200].decode('latin1', errors='replace'))
+
+def run_batch(entries, flags=0):
+    """Run several programs as one MSG_JOB_BATCH and print the per-program results."""
+    import time
+    s = connect()
+    s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+    recv_exact(s, 6)
+    # the batch flags ride in the top byte of the program count
+    payload = struct.pack('<I', flags << 24 | len(entries)) + b''.join(struct.pack('<I', len(e)) + e for e in entries)
+    start = time.time()
+    s.sendall(struct.pack('<BII', MSG_JOB_BATCH, 1, len(payload)) + payload)
+    ftype, rid, flen = struct.unpack('<BII', recv_exact(s, 9))
+    reply = recv_exact(s, flen)
+    elapsed = time.time() - start
+    s.close()
+    if ftype in (FRAME_ERROR, FRAME_BUSY):
+        print('batch rejected:', reply.decode())
+        return
+    count, = struct.unpack('<I', reply[:4])
+    pos = 4
+    for i in range(count):
+        rec = reply[pos:pos + RESULT_SIZE]
+        instr, olen, reason, cs, ip = struct.unpack('<QIBHH', rec[:17])
+        sent = 0 if rec[19] & RESULT_FLAG_OUTPUT_OMITTED else olen
+        out = reply[pos + RESULT_SIZE:pos + RESULT_SIZE + sent]
+        pos += RESULT_SIZE + sent
+        if i < 10 or i == count - 1:
+            print('%3d: %-12s at %04X:%04X exit code %3d %10d instructions, %d bytes: %s %s' % (
+                i, EXIT_REASONS.get(reason, reason), cs, ip, rec[17], instr, olen,
+                out[:40].decode('latin1', errors='replace'), describe_check(rec)))
+    print('%d programs in %.3fs' % (count, elapsed))
+
+def run_shm(program, flags, sections):
+    """Run a job through MSG_JOB_SHM: the program goes in a memfd passed over
+    the Unix socket and the server writes the output back into it."""
+    import fcntl, mmap, os
+    out_cap = 0x10000
+    fd = os.memfd_create('emu_job', os.MFD_ALLOW_SEALING)
+    os.ftruncate(fd, len(program) + out_cap)
+    # the server only maps memory that cannot shrink under it
+    fcntl.fcntl(fd, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK)
+    mem = mmap.mmap(fd, len(program) + out_cap)
+    mem[:len(program)] = program
+    s = connect()
+    s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+    recv_exact(s, 6)
+    payload = struct.pack('<BIIII', flags, 0, len(program), len(program), out_cap) + sections
+    socket.send_fds(s, [struct.pack('<BII', MSG_JOB_SHM, 1, len(payload)) + payload], [fd])
+    os.close(fd)
+    ftype, rid, flen = struct.unpack('<BII', recv_exact(s, 9))
+    reply = recv_exact(s, flen)
+    s.close()
+    if ftype in (FRAME_ERROR, FRAME_BUSY):
+        print('job rejected:', reply.decode())
+    else:
+        show_result(reply)
+        written, = struct.unpack('<I', reply[8:12])
+        print('shared memory output (%d bytes): %s' % (written, mem[len(program):len(program) + written][:200].decode('latin1', errors='replace')))
+    mem.close()
+
+def run_session(sections, step, frame_path):
+    """Load the program into a server session and run it step instructions
+    at a time, showing the registers and the next code bytes after each run.
+    With frame_path, the final graphics frame is saved there as PPM."""
+    import time
+    s = connect()
+    s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+    recv_exact(s, 6)
+    def request(mtype, payload):
+        s.sendall(struct.pack('<BII', mtype, 0, len(payload)) + payload)
+        out = b''
+        while True:
+            ftype, rid, flen = struct.unpack('<BII', recv_exact(s, 9))
+            data = recv_exact(s, flen)
+            if ftype == FRAME_OUTPUT:
+                out += data
+            elif ftype in (FRAME_ERROR, FRAME_BUSY):
+                raise SystemExit('session request failed: ' + data.decode('latin1'))
+            else:
+                return data, out
+    reply, _ = request(MSG_SESSION_CREATE, sections)
+    session, = struct.unpack('<I', reply[:4])
+    print('session', session)
+    # every later message names the session by its id and token
+    sid = reply[:4 + SESSION_TOKEN_SIZE]
+    while True:
+        start = time.perf_counter()
+        rec, out = request(MSG_SESSION_RUN, sid + struct.pack('<QI', step, 0))
+        elapsed = time.perf_counter() - start
+        if out:
+            print('output:', out[:200].decode('latin1', errors='replace'))
+        regs, _ = request(MSG_SESSION_GET_REGS, sid)
+        values = struct.unpack('<14H', regs[4:32])
+        cs, ip = values[12], values[13]
+        code, _ = request(MSG_SESSION_READ, sid + struct.pack('<II', (cs << 4) + ip, 8))
+        print('%d instructions in %.3f ms, %s, next %s' % (struct.unpack('<Q', rec[:8])[0], elapsed * 1000,
+              ' '.join('%s=%04X' % r for r in zip(REGISTERS, values)), code[4:].hex()))
+        if rec[12] != 5:
+            print('stopped:', EXIT_REASONS.get(rec[12], rec[12]))
+            break
+    if frame_path:
+        ppm, _ = request(MSG_SESSION_FRAME, sid + bytes([1]))
+        with open(frame_path, 'wb') as f:
+            f.write(ppm[4:])
+        print('frame saved to', frame_path)
+    request(MSG_SESSION_DESTROY, sid)
+    s.close()
+
+def show_stats():
+    s = connect()
+    s.sendall(struct.pack('<IH', PIPE_MAGIC, PROTOCOL_VERSION))
+    recv_exact(s, 6)
+    s.sendall(struct.pack('<BII', MSG_STATS, 1, 0))
+    ftype, rid, flen = struct.unpack('<BII', recv_exact(s, 9))
+    print(recv_exact(s, flen).decode(), end='')
+    s.close()
+
+# usage: test_client.py [--unix PATH] --stats
+#        test_client.py [--unix PATH] [program.com|source.asm ...] [--stream] [--video] [--input FILE] [--file DOSNAME=PATH ...]
+#                       [--budget INSTRUCTIONS] [--timeout MS] [--low-priority] [--result] [--pipe N [--cancel-after MS] | --batch | --shm | --session STEP [--frame FILE]]
+#                       [--expect-output FILE] [--expect-prefix TEXT] [--expect-reg REG=HEX ...]
+#                       [--expect-mem ADDR=HEXBYTES ...] [--max-instructions N] [--check-only]
+argv = sys.argv[1:]
+if '--unix' in argv:
+    i = argv.index('--unix')
+    UNIX_PATH = argv[i + 1]
+    del argv[i:i + 2]
+if '--stats' in argv:
+    show_stats()
+    raise SystemExit
+pipe_count = 0
+if '--pipe' in argv:
+    i = argv.index('--pipe')
+    pipe_count = int(argv[i + 1])
+    del argv[i:i + 2]
+cancel_after = None
+if '--cancel-after' in argv:
+    i = argv.index('--cancel-after')
+    cancel_after = int(argv[i + 1]) / 1000
+    del argv[i:i + 2]
+session_step = 0
+if '--session' in argv:
+    i = argv.index('--session')
+    session_step = int(argv[i + 1])
+    del argv[i:i + 2]
+frame_path = None
+if '--frame' in argv:
+    i = argv.index('--frame')
+    frame_path = argv[i + 1]
+    del argv[i:i + 2]
+budget = b''
+if '--budget' in argv:
+    i = argv.index('--budget')
+    budget = section(SECTION_BUDGET, struct.pack('<Q', int(argv[i + 1])))
+    del argv[i:i + 2]
+if '--timeout' in argv:
+    i = argv.index('--timeout')
+    budget += section(SECTION_TIMEOUT, struct.pack('<I', int(argv[i + 1])))
+    del argv[i:i + 2]
+input_data = None
+files = b''
+if '--input' in argv:
+    i = argv.index('--input')
+    with open(argv[i + 1], 'rb') as f:
+        input_data = f.read()
+    del argv[i:i + 2]
+while '--file' in argv:
+    i = argv.index('--file')
+    name, path = argv[i + 1].split('=', 1)
+    with open(path, 'rb') as f:
+        files += section(SECTION_FILE, bytes([len(name)]) + name.encode() + f.read())
+    del argv[i:i + 2]
+# assertions checked by the server, all in one SECTION_EXPECT
+checks = b''
+def add_check(kind, data):
+    global checks
+    checks += struct.pack('<BH', kind, len(data)) + data
+for opt in ('--expect-output', '--expect-prefix', '--expect-reg', '--expect-mem', '--max-instructions'):
+    while opt in argv:
+        i = argv.index(opt)
+        value = argv[i + 1]
+        del argv[i:i + 2]
+        if opt == '--expect-output':
+            with open(value, 'rb') as f:
+                add_check(EXPECT_OUTPUT_HASH, struct.pack('<Q', fnv1a(f.read())))
+        elif opt == '--expect-prefix':
+            add_check(EXPECT_OUTPUT_PREFIX, value.encode())
+        elif opt == '--expect-reg':
+            reg, val = value.split('=', 1)
+            add_check(EXPECT_REGISTER, struct.pack('<BHH', REGISTERS.index(reg.upper()), int(val, 16), 0xFFFF))
+        elif opt == '--expect-mem':
+            addr, hexbytes = value.split('=', 1)
+            add_check(EXPECT_MEMORY, struct.pack('<I', int(addr, 0)) + bytes.fromhex(hexbytes))
+        else:
+            add_check(EXPECT_MAX_INSTRUCTIONS, struct.pack('<Q', int(value)))
+if checks:
+    budget += section(SECTION_EXPECT, checks)
+check_only = JOB_FLAG_CHECK_ONLY if '--check-only' in argv else 0
+args = [a for a in argv if not a.startswith('--')]
+video = '--video' in argv
+stream = '--stream' in argv or video
+low_priority = JOB_FLAG_LOW_PRIORITY if '--low-priority' in argv else 0
+want_result = '--result' in argv
+path = args[0] if args else 'hello.com'
+with open(path,'rb') as f:
     data=f.read()
+is_source = path.lower().endswith('.asm')
+
+if '--batch' in argv:
+    # every program named on the command line becomes one batch entry
+    entries = []
+    for path in args or ['hello.com']:
+        with open(path, 'rb') as f:
+            entries.append(program_section(path, f.read()) + section(SECTION_INPUT, input_data or b'') +
+                           files + budget + section(SECTION_END))
+    run_batch(entries, check_only)
+    raise SystemExit
 
-s=socket.create_connection((HOST,PORT))
-s.sendall(struct.pack('<I', len(data)))
-s.sendall(data)
+if '--shm' in argv:
+    # needs the Unix socket, defaulting to the server's usual path
+    UNIX_PATH = UNIX_PATH or '/tmp/emu_server.sock'
+    if is_source:
+        raise SystemExit('--shm takes a .COM image, not source')
+    run_shm(data, low_priority | check_only, section(SECTION_INPUT, input_data or b'') + files + budget + section(SECTION_END))
+    raise SystemExit
+
+if session_step:
+    run_session(program_section(path, data) + section(SECTION_INPUT, input_data or b'') + files + section(SECTION_END), session_step, frame_path)
+    raise SystemExit
+
+if pipe_count:
+    flags = (JOB_FLAG_STREAM if stream else 0) | (JOB_FLAG_VIDEO if video else 0) | low_priority | check_only
+    run_pipelined(bytes([flags]) + program_section(path, data) + section(SECTION_INPUT, input_data or b'') +
+                  files + budget + section(SECTION_END), pipe_count, cancel_after)
+    raise SystemExit
+
+s=connect()
+if input_data is not None or files or video or budget or low_priority or want_result or is_source:
+    # job mode: flags byte + tagged sections
+    flags = (JOB_FLAG_STREAM if stream else 0) | (JOB_FLAG_VIDEO if video else 0) | low_priority | check_only
+    if want_result and not stream:
+        flags |= JOB_FLAG_RESULT
+    s.sendall(struct.pack('<IB', JOB_MAGIC, flags) + program_section(path, data) +
+              section(SECTION_INPUT, input_data or b'') + files + budget + section(SECTION_END))
+else:
+    if stream:
+        s.sendall(struct.pack('<I', STREAM_MAGIC))
+    s.sendall(struct.pack('<I', len(data)))
+    s.sendall(data)
+
+if stream:
+    out = b''
+    while True:
+        hdr = recv_exact(s, 5)
+        if len(hdr) < 5:
+            print('connection closed before result')
+            break
+        ftype, flen = struct.unpack('<BI', hdr)
+        payload = recv_exact(s, flen)
+        if ftype == FRAME_OUTPUT:
+            out += payload
+            print('output chunk: %d bytes' % flen)
+        elif ftype == FRAME_HEARTBEAT:
+            print('heartbeat: %d instructions' % struct.unpack('<Q', payload[:8]))
+        elif ftype == FRAME_VIDEO_TEXT:
+            mode, row, col, nruns = struct.unpack('<BBBH', payload[:5])
+            pos, cells = 5, 0
+            for _ in range(nruns):
+                r, c, n = payload[pos:pos + 3]
+                text = payload[pos + 3:pos + 3 + 2 * n:2].decode('latin1').rstrip()
+                if text:
+                    print('  screen %2d,%2d: %s' % (r, c, text))
+                pos += 3 + 2 * n
+                cells += n
+            print('video: mode %02X, cursor %d,%d, %d runs, %d cells' % (mode, row, col, nruns, cells))
+        elif ftype == FRAME_VIDEO_GFX:
+            mode, color, nrects = struct.unpack('<BBH', payload[:4])
+            pos, rects = 4, []
+            for _ in range(nrects):
+                xb, y, wb, h = struct.unpack('<HHHH', payload[pos:pos + 8])
+                rects.append('%dx%d@%d,%d' % (wb, h, xb, y))
+                pos += 8 + wb * h
+            print('graphics: mode %02X, colour %02X, %d rects %s' % (mode, color, nrects, ' '.join(rects[:8])))
+        elif ftype == FRAME_RESULT:
+            show_result(payload)
+            break
+    print('decoded:', out[:200].decode('latin1', errors='replace'))
+    s.close(); raise SystemExit
 
 out_len_bytes = s.recv(4)
 if len(out_len_bytes) < 4:
@@ -18,13 +441,11 @@ if len(out_len_bytes) < 4:
 out_len = struct.unpack('<I', out_len_bytes)[0]
 print('out_len =', out_len)
 
-out = b''
-while len(out) < out_len:
-    chunk = s.recv(out_len - len(out))
-    if not chunk:
-        break
-    out += chunk
+out = recv_exact(s, out_len)
 
 print('raw bytes:', out)
 print('decoded:', out.decode('latin1', errors='replace'))
-s.close()
\ No newline at end of file
+if want_result and not stream:
+    ftype, flen = struct.unpack('<BI', recv_exact(s, 5))
+    show_result(recv_exact(s, flen))
+s.close()